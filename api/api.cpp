@@ -30,7 +30,7 @@ struct APIObject {
 #include "common.cpp"
 #include "syscall.cpp"
 
-OSHandle osMessageMutex;
+OSMutex osMessageMutex;
 
 extern "C" void ProgramEntry();
 
@@ -40,10 +40,6 @@ extern "C" void OSInitialiseAPI() {
 	void OSFPInitialise();
 	OSFPInitialise();
 
-	heapMutex = OSCreateMutex();
-	printMutex = OSCreateMutex();
-	osMessageMutex = OSCreateMutex();
-
 	OSInitialiseGUI();
 }
 
@@ -96,7 +92,7 @@ void OSProcessMessages() {
 		OSWaitMessage(OS_WAIT_NO_TIMEOUT);
 
 		if (OSGetMessage(&message) == OS_SUCCESS) {
-			OSAcquireMutex(osMessageMutex);
+			OSLockMutex(&osMessageMutex);
 
 			if (message.context) {
 				OSSendMessage(message.context, &message);
@@ -115,7 +111,7 @@ void OSProcessMessages() {
 			}
 
 			done:;
-			OSReleaseMutex(osMessageMutex);
+			OSUnlockMutex(&osMessageMutex);
 		}
 	}
 }
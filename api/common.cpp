@@ -46,7 +46,7 @@ void CF(CopyMemory)(void *_destination, void *_source, size_t bytes) {
 	uint8_t *destination = (uint8_t *) _destination;
 	uint8_t *source = (uint8_t *) _source;
 
-#ifdef ARCH_X86_64
+#if defined(ARCH_X86_64) && !defined(KERNEL)
 	while (bytes >= 16) {
 		_mm_storeu_si128((__m128i *) destination, 
 				_mm_loadu_si128((__m128i *) source));
@@ -55,6 +55,15 @@ void CF(CopyMemory)(void *_destination, void *_source, size_t bytes) {
 		destination += 16;
 		bytes -= 16;
 	}
+#else
+	// The kernel is compiled without SSE, so that it doesn't touch the interrupted thread's FPU state.
+	while (bytes >= 8) {
+		((uint64_t *) destination)[0] = ((uint64_t *) source)[0];
+
+		source += 8;
+		destination += 8;
+		bytes -= 8;
+	}
 #endif
 
 	while (bytes >= 1) {
@@ -249,6 +258,7 @@ void CF(_FormatString)(CF(PutCharacterCallback) callback, void *callbackData, co
 					}
 				} break;
 
+#ifndef KERNEL // The kernel is compiled without floating point support.
 				case 'F': {
 					double number = va_arg(arguments, double);
 
@@ -315,6 +325,7 @@ void CF(_FormatString)(CF(PutCharacterCallback) callback, void *callbackData, co
 						}
 					}
 				} break;
+#endif
 			}
 		} else {
 			callback(c, callbackData);
@@ -351,7 +362,7 @@ void CF(FormatStringCallback)(int character, void *data) {
 }
 
 #ifndef KERNEL
-static OSHandle printMutex;
+static OSMutex printMutex;
 
 static char printBuffer[4096];
 static uintptr_t printBufferPosition = 0;
@@ -368,14 +379,14 @@ void CF(PrintCallback)(int character, void *data) {
 }
 
 void CF(Print)(const char *format, ...) {
-	OSAcquireMutex(printMutex);
+	OSLockMutex(&printMutex);
 	printBufferPosition = 0;
 	va_list arguments;
 	va_start(arguments, format);
 	CF(_FormatString)(CF(PrintCallback), nullptr, format, arguments);
 	va_end(arguments);
 	OSSyscall(OS_SYSCALL_PRINT, (uintptr_t) printBuffer, printBufferPosition, 0, 0);
-	OSReleaseMutex(printMutex);
+	OSUnlockMutex(&printMutex);
 }
 
 void CF(PrintDirect)(char *string, size_t stringLength) {
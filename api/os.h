@@ -223,6 +223,8 @@ typedef enum OSFatalError {
 	OS_FATAL_ERROR_BAD_OBJECT_TYPE,
 	OS_FATAL_ERROR_MESSAGE_SHOULD_BE_HANDLED,
 	OS_FATAL_ERROR_INDEX_OUT_OF_BOUNDS,
+	OS_FATAL_ERROR_INVALID_THREAD_PRIORITY,
+	OS_FATAL_ERROR_INVALID_THREAD_AFFINITY,
 	OS_FATAL_ERROR_COUNT,
 } OSFatalError;
 
@@ -262,6 +264,8 @@ typedef enum OSFatalError {
 #define OS_ERROR_TARGET_WITHIN_SOURCE		(-44)
 #define OS_ERROR_TARGET_INVALID_TYPE		(-45)
 #define OS_ERROR_NOTHING_TO_DRAW		(-46)
+#define OS_ERROR_ALREADY_ASSOCIATED		(-47)
+#define OS_ERROR_PERMISSION_NOT_GRANTED		(-48)
 
 typedef intptr_t OSError;
 
@@ -286,8 +290,8 @@ typedef enum OSSyscallType {
 	OS_SYSCALL_UPDATE_WINDOW,
 	OS_SYSCALL_DRAW_SURFACE,
 	OS_SYSCALL_CREATE_MUTEX,
-	OS_SYSCALL_ACQUIRE_MUTEX, // This (and RELEASE_MUTEX) is the most common system call.
-	OS_SYSCALL_RELEASE_MUTEX, // TODO Implement API-side locks?
+	OS_SYSCALL_ACQUIRE_MUTEX, // Prefer OSMutex, which only makes system calls when it's contended.
+	OS_SYSCALL_RELEASE_MUTEX,
 	OS_SYSCALL_CLOSE_HANDLE,
 	OS_SYSCALL_TERMINATE_THREAD,
 	OS_SYSCALL_CREATE_THREAD,
@@ -326,6 +330,16 @@ typedef enum OSSyscallType {
 	OS_SYSCALL_PASTE_TEXT,
 	OS_SYSCALL_DELETE_NODE,
 	OS_SYSCALL_MOVE_NODE,
+	OS_SYSCALL_SET_THREAD_PRIORITY,
+	OS_SYSCALL_FUTEX_WAIT,
+	OS_SYSCALL_FUTEX_WAKE,
+	OS_SYSCALL_SET_THREAD_AFFINITY,
+	OS_SYSCALL_GET_CPU_STATISTICS,
+	OS_SYSCALL_GET_SPINLOCK_STATISTICS,
+	OS_SYSCALL_SET_LOCK_PROFILER_ENABLED,
+	OS_SYSCALL_CREATE_COMPLETION_PORT,
+	OS_SYSCALL_ASSOCIATE_COMPLETION_PORT,
+	OS_SYSCALL_DEQUEUE_COMPLETIONS,
 } OSSyscallType;
 
 #define OS_INVALID_HANDLE 		((OSHandle) (0))
@@ -351,6 +365,53 @@ typedef struct OSBatchCall {
 	uintptr_t argument1, argument2, argument3;
 } OSBatchCall;
 
+typedef enum OSThreadPriority {
+	OS_THREAD_PRIORITY_HIGH,	// Realtime and UI threads.
+	OS_THREAD_PRIORITY_NORMAL,
+	OS_THREAD_PRIORITY_BACKGROUND,	// Only run when there are no other threads waiting.
+	OS_THREAD_PRIORITY_COUNT,
+} OSThreadPriority;
+
+// Bit n of an affinity mask is set if the thread can run on processor n.
+// Exclusive affinities reserve the processors, so that threads without an affinity don't run on them.
+#define OS_THREAD_AFFINITY_ANY (0)
+
+#define OS_STATISTICS_MAX_PROCESSORS (64)
+
+typedef struct OSCPUStatistics {
+	// Times are measured in ticks of the processors' time stamp counter.
+	uint64_t timeStamp, timeStampTicksPerMs;
+
+	// The times of the thread or process.
+	uint64_t runTicks;		// Executing.
+	uint64_t waitTicks;		// Waiting for a processor to execute on.
+	uint64_t blockedTicks;		// Blocking on a mutex or event.
+	uint64_t voluntarySwitches;	// The thread blocked.
+	uint64_t involuntarySwitches;	// The thread was pre-empted.
+
+	size_t processorCount;
+
+	struct {
+		uint64_t idleTicks;
+		uint64_t contextSwitches;
+	} processors[OS_STATISTICS_MAX_PROCESSORS];
+} OSCPUStatistics;
+
+#define OS_SPINLOCK_STATISTICS_NAME_LENGTH (32)
+
+typedef struct OSSpinlockStatistics {
+	char name[OS_SPINLOCK_STATISTICS_NAME_LENGTH];
+	uint64_t acquisitions;
+	uint64_t contendedAcquisitions;	// The lock was held by another processor.
+	uint64_t spinTicks;		// Time stamp counter ticks spent waiting for the lock.
+} OSSpinlockStatistics;
+
+typedef struct OSMutex {
+	// 0 = released, 1 = acquired, 2 = acquired and other threads might be waiting.
+	// Zero-initialise to create the mutex.
+	volatile int32_t state;
+} OSMutex;
+
 typedef struct OSThreadInformation {
 	OSHandle handle;
 	uintptr_t tid;
@@ -971,10 +1032,21 @@ OS_EXTERN_C void OSPauseProcess(OSHandle process, bool resume);
 OS_EXTERN_C void OSCrashProcess(OSError error);
 
 OS_EXTERN_C uintptr_t OSGetThreadID(OSHandle thread);
+OS_EXTERN_C OSError OSSetThreadPriority(OSHandle thread, OSThreadPriority priority); // Only the desktop can use OS_THREAD_PRIORITY_HIGH.
+OS_EXTERN_C OSError OSSetThreadAffinity(OSHandle thread, uint64_t processors, bool exclusive); // Only the desktop can reserve processors with exclusive, and at most half of them can be reserved.
+OS_EXTERN_C OSError OSGetCPUStatistics(OSHandle object /*A thread, process, or OS_INVALID_HANDLE for only the processors' statistics*/, OSCPUStatistics *statistics);
+OS_EXTERN_C void OSSetLockProfilerEnabled(bool enabled); // Disabling the profiler writes its results to the kernel log; see util/analyse_mutex_log.cpp.
+OS_EXTERN_C size_t OSGetSpinlockStatistics(OSSpinlockStatistics *buffer, size_t count); // Returns the number of kernel spinlocks with statistics; fills at most count entries.
 
 OS_EXTERN_C OSError OSReleaseMutex(OSHandle mutex);
 OS_EXTERN_C OSError OSAcquireMutex(OSHandle mutex);
 
+OS_EXTERN_C void OSLockMutex(OSMutex *mutex);
+OS_EXTERN_C void OSUnlockMutex(OSMutex *mutex);
+
+OS_EXTERN_C OSError OSFutexWait(volatile int32_t *address, int32_t expectedValue, uint64_t timeoutMs); // Blocks until woken, if *address == expectedValue.
+OS_EXTERN_C size_t OSFutexWake(volatile int32_t *address, size_t count); // Returns the number of threads woken.
+
 OS_EXTERN_C OSError OSSetEvent(OSHandle event);
 OS_EXTERN_C OSError OSResetEvent(OSHandle event);
 OS_EXTERN_C OSError OSPollEvent(OSHandle event);
@@ -982,6 +1054,10 @@ OS_EXTERN_C OSError OSPollEvent(OSHandle event);
 OS_EXTERN_C uintptr_t OSWait(OSHandle *objects, size_t objectCount, uintptr_t timeoutMs);
 #define OSWaitSingle(object) OSWait(&object, 1, OS_WAIT_NO_TIMEOUT)
 
+OS_EXTERN_C OSHandle OSCreateCompletionPort();
+OS_EXTERN_C OSError OSAssociateCompletionPort(OSHandle port, OSHandle object /*An event, IO request, or OS_CURRENT_PROCESS for its message queue*/, uintptr_t key); // An object can be associated with one port.
+OS_EXTERN_C intptr_t OSDequeueCompletions(OSHandle port, uintptr_t *keys, size_t count, uintptr_t timeoutMs); // Returns the number of keys dequeued, or OS_ERROR_TIMEOUT_REACHED.
+
 OS_EXTERN_C OSHandle OSOpenSharedMemory(size_t size, char *name, size_t nameLength, unsigned flags);
 OS_EXTERN_C OSHandle OSShareMemory(OSHandle sharedMemoryRegion, OSHandle targetProcess, bool readOnly);
 OS_EXTERN_C void *OSMapObject(OSHandle object, uintptr_t offset, size_t size, unsigned flags);
@@ -1172,7 +1248,7 @@ OS_EXTERN_C void _longjmp(jmp_buf *env, int val);
 #include "stb_image.h"
 
 OS_EXTERN_C uint64_t osRandomByteSeed;
-OS_EXTERN_C OSHandle osMessageMutex;
+OS_EXTERN_C OSMutex osMessageMutex;
 #endif
 
 OS_EXTERN_C void ProgramEntry();
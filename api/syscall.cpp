@@ -125,6 +125,39 @@ OSError OSReleaseMutex(OSHandle handle) {
 	return OSSyscall(OS_SYSCALL_RELEASE_MUTEX, handle, 0, 0, 0);
 }
 
+OSError OSFutexWait(volatile int32_t *address, int32_t expectedValue, uint64_t timeoutMs) {
+	return OSSyscall(OS_SYSCALL_FUTEX_WAIT, (uintptr_t) address, expectedValue, timeoutMs, 0);
+}
+
+size_t OSFutexWake(volatile int32_t *address, size_t count) {
+	return OSSyscall(OS_SYSCALL_FUTEX_WAKE, (uintptr_t) address, count, 0, 0);
+}
+
+void OSLockMutex(OSMutex *mutex) {
+	int32_t state = __sync_val_compare_and_swap(&mutex->state, 0, 1);
+
+	if (!state) {
+		// The mutex was uncontended.
+		return;
+	}
+
+	// Mark the mutex as having waiters, and then wait until it's released.
+	if (state != 2) state = __sync_lock_test_and_set(&mutex->state, 2);
+
+	while (state) {
+		OSFutexWait(&mutex->state, 2, OS_WAIT_NO_TIMEOUT);
+		state = __sync_lock_test_and_set(&mutex->state, 2);
+	}
+}
+
+void OSUnlockMutex(OSMutex *mutex) {
+	if (__sync_fetch_and_sub(&mutex->state, 1) != 1) {
+		// There might be threads waiting for the mutex.
+		mutex->state = 0;
+		OSFutexWake(&mutex->state, 1);
+	}
+}
+
 OSError OSCloseHandle(OSHandle handle) {
 	return OSSyscall(OS_SYSCALL_CLOSE_HANDLE, handle, 0, 0, 0);
 }
@@ -215,6 +248,18 @@ uintptr_t OSWait(OSHandle *handles, size_t count, uintptr_t timeoutMs) {
 	return OSSyscall(OS_SYSCALL_WAIT, (uintptr_t) handles, count, timeoutMs, 0);
 }
 
+OSHandle OSCreateCompletionPort() {
+	return OSSyscall(OS_SYSCALL_CREATE_COMPLETION_PORT, 0, 0, 0, 0);
+}
+
+OSError OSAssociateCompletionPort(OSHandle port, OSHandle object, uintptr_t key) {
+	return OSSyscall(OS_SYSCALL_ASSOCIATE_COMPLETION_PORT, port, object, key, 0);
+}
+
+intptr_t OSDequeueCompletions(OSHandle port, uintptr_t *keys, size_t count, uintptr_t timeoutMs) {
+	return OSSyscall(OS_SYSCALL_DEQUEUE_COMPLETIONS, port, (uintptr_t) keys, count, timeoutMs);
+}
+
 void OSRefreshNodeInformation(OSNodeInformation *information) {
 	OSSyscall(OS_SYSCALL_REFRESH_NODE_INFORMATION, (uintptr_t) information, 0, 0, 0);
 }
@@ -235,6 +280,26 @@ uintptr_t OSGetThreadID(OSHandle thread) {
 	return OSSyscall(OS_SYSCALL_GET_THREAD_ID, thread, 0, 0, 0);
 }
 
+OSError OSSetThreadPriority(OSHandle thread, OSThreadPriority priority) {
+	return OSSyscall(OS_SYSCALL_SET_THREAD_PRIORITY, thread, priority, 0, 0);
+}
+
+OSError OSSetThreadAffinity(OSHandle thread, uint64_t processors, bool exclusive) {
+	return OSSyscall(OS_SYSCALL_SET_THREAD_AFFINITY, thread, processors, exclusive, 0);
+}
+
+OSError OSGetCPUStatistics(OSHandle object, OSCPUStatistics *statistics) {
+	return OSSyscall(OS_SYSCALL_GET_CPU_STATISTICS, object, (uintptr_t) statistics, 0, 0);
+}
+
+void OSSetLockProfilerEnabled(bool enabled) {
+	OSSyscall(OS_SYSCALL_SET_LOCK_PROFILER_ENABLED, enabled, 0, 0, 0);
+}
+
+size_t OSGetSpinlockStatistics(OSSpinlockStatistics *buffer, size_t count) {
+	return OSSyscall(OS_SYSCALL_GET_SPINLOCK_STATISTICS, (uintptr_t) buffer, count, 0, 0);
+}
+
 OSError OSEnumerateDirectoryChildren(OSHandle directory, OSDirectoryChild *buffer, size_t size) {
 	return OSSyscall(OS_SYSCALL_ENUMERATE_DIRECTORY_CHILDREN, directory, (uintptr_t) buffer, size, 0);
 }
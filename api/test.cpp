@@ -353,6 +353,21 @@ void EnumerateRootThread(void *argument) {
 	}
 }
 
+void CountThread(void *argument) {
+	(*(volatile int *) argument)++;
+	OSTerminateThread(OS_CURRENT_THREAD);
+}
+
+volatile int dequeueThreadState;
+
+void DequeueThread(void *argument) {
+	OSHandle port = (OSHandle) (uintptr_t) argument;
+	uintptr_t key;
+	dequeueThreadState = 1;
+	OSDequeueCompletions(port, &key, 1, OS_WAIT_NO_TIMEOUT);
+	dequeueThreadState = 2; // Nothing is queued, so this should never be reached.
+}
+
 extern "C" void ProgramEntry() {
 	if (x != 5) OSCrashProcess(600);
 	if (y2.a != 1) OSCrashProcess(601);
@@ -793,6 +808,51 @@ extern "C" void ProgramEntry() {
 		if (handle2 != OS_INVALID_HANDLE) OSCrashProcess(140);
 	}
 
+	{
+		// Create and join enough threads that their objects and stacks are reused from the caches,
+		// and measure the time each create and join takes.
+		volatile int threadsRun = 0;
+		uintptr_t previousTID = 0;
+
+		OSCPUStatistics statistics;
+		OSGetCPUStatistics(OS_INVALID_HANDLE, &statistics);
+		uint64_t start = statistics.timeStamp;
+
+#define THREAD_BENCHMARK_COUNT (1000)
+		for (int i = 0; i < THREAD_BENCHMARK_COUNT; i++) {
+			OSThreadInformation information;
+			if (OSCreateThread(CountThread, &information, (void *) &threadsRun) != OS_SUCCESS) OSCrashProcess(160);
+			if (OSWaitSingle(information.handle) != 0) OSCrashProcess(161);
+			if (threadsRun != i + 1) OSCrashProcess(162);
+			if (information.tid == previousTID) OSCrashProcess(163);
+			previousTID = information.tid;
+			OSCloseHandle(information.handle);
+		}
+
+		OSGetCPUStatistics(OS_INVALID_HANDLE, &statistics);
+		uint64_t ticks = (statistics.timeStamp - start) / THREAD_BENCHMARK_COUNT;
+		OSPrint("Thread create and join: %d ticks (%d us)\n", ticks, ticks * 1000 / statistics.timeStampTicksPerMs);
+	}
+
+	{
+		// Terminate a thread that is blocked dequeuing from an empty completion port.
+		OSHandle port = OSCreateCompletionPort();
+		OSThreadInformation information;
+		if (OSCreateThread(DequeueThread, &information, (void *) (uintptr_t) port) != OS_SUCCESS) OSCrashProcess(170);
+		while (!dequeueThreadState);
+
+		// Give the thread time to block.
+		OSHandle event = OSCreateEvent(false);
+		OSWait(&event, 1, 10);
+		OSCloseHandle(event);
+
+		OSTerminateThread(information.handle);
+		if (OSWait(&information.handle, 1, 1000) != 0) OSCrashProcess(171);
+		if (dequeueThreadState != 1) OSCrashProcess(172);
+		OSCloseHandle(information.handle);
+		OSCloseHandle(port);
+	}
+
 	OSPrint("All tests completed successfully.\n");
 	// OSCrashProcess(OS_FATAL_ERROR_INVALID_BUFFER);
 	
@@ -84,8 +84,11 @@ struct ACPILapic {
 };
 
 void ACPILapic::NextTimer(size_t ms) {
-	WriteRegister(0x320 >> 2, TIMER_INTERRUPT | (1 << 17)); 
-	WriteRegister(0x380 >> 2, ticksPerMs * ms); 
+	// The timer is used in one-shot mode; writing an initial count of 0 stops it.
+	uint64_t ticks = (uint64_t) ticksPerMs * ms;
+	if (ticks > (uint32_t) -1) ticks = (uint32_t) -1;
+	WriteRegister(0x320 >> 2, TIMER_INTERRUPT); 
+	WriteRegister(0x380 >> 2, ticks); 
 }
 
 void ACPILapic::EndOfInterrupt() {
@@ -412,8 +415,10 @@ void ACPI::Initialise() {
 		// Set up the LAPIC's time
 		ProcessorDisableInterrupts();
 		acpi.lapic.WriteRegister(0x380 >> 2, (uint32_t) -1); 
+		uint64_t timeStampStart = ProcessorReadTimeStamp();
 		for (int i = 0; i < 8; i++) Delay1MS(); // Average over 8ms
 		acpi.lapic.ticksPerMs = ((uint32_t) -1 - acpi.lapic.ReadRegister(0x390 >> 2)) >> 4;
+		timeStampTicksPerMs = (ProcessorReadTimeStamp() - timeStampStart) >> 3;
 		osRandomByteSeed ^= acpi.lapic.ReadRegister(0x390 >> 2);
 		ProcessorEnableInterrupts();
 	}
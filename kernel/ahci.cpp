@@ -9,6 +9,7 @@
 #define AHCI_SECTOR_SIZE (512)
 #define AHCI_COMMAND_COUNT (1)
 #define AHCI_DRIVE_COUNT (32)
+#define AHCI_PRDT_ENTRY_COUNT (24) // Enough to read 64KiB directly into separate pages; the command table must stay a multiple of 128 bytes.
 #define AHCI_IDENTIFY (-1)
 
 enum AHCIPacketType {
@@ -204,7 +205,7 @@ struct AHCICommandTable {
 	uint8_t commandPacket[64];
 	uint8_t atapiCommand[16];
 	uint8_t _reserved0[48];
-	AHCIPRDTEntry prdtEntries[8];
+	AHCIPRDTEntry prdtEntries[AHCI_PRDT_ENTRY_COUNT];
 };
 
 struct AHCIHBA {
@@ -245,7 +246,10 @@ struct AHCIOperation {
 		} blocking;
 	};
 
+	AsyncTask finishTask; // Registered by the IRQ handler or the timeout, to finish the IO packet.
+
 	uint8_t _drive, operation;
+	bool direct; // The data is transferred directly to userBuffer, rather than through the command's buffer.
 };
 
 struct AHCIDrive {
@@ -293,7 +297,7 @@ AHCIController ahci;
 void AHCIController::AcquireMutex() {
 	mutex.Acquire();
 
-	if (kernelVMM.lock.owner == GetCurrentThread()) {
+	if (kernelVMM.lock.writerMutex.owner == GetCurrentThread()) {
 		// TODO I think this can happen?
 		// 	It seemed to appear in the analyse_mutex_log program as a potential problem.
 		// 	...but that could be buggy.
@@ -312,6 +316,7 @@ bool AHCIController::FinishOperation(AHCIOperation *operation) {
 	size_t countBytes = operation->countBytes;
 	int operationType = operation->operation;
 	uint8_t *userBuffer = operation->userBuffer;
+	bool direct = operation->direct;
 	uintptr_t commandIndex = operation->issued.commandIndex;
 
 	AHCIDrive *drive = drives + _drive;
@@ -362,7 +367,7 @@ bool AHCIController::FinishOperation(AHCIOperation *operation) {
 		if (ioPacket->request->cancelled) success = false;
 	}
 
-	if (success && operationType != DRIVE_ACCESS_WRITE) {
+	if (success && operationType != DRIVE_ACCESS_WRITE && !direct) {
 		// Copy to the output buffer.
 		CopyMemory(userBuffer, (uint8_t *) buffer + offsetIntoSector, countBytes);
 	}
@@ -429,7 +434,7 @@ void AHCITimeoutCallback(void *argument) {
 			operation->issued.receivedIRQ.Set();
 
 			scheduler.lock.Acquire();
-			RegisterAsyncTask(AHCIFinishOperation, operation, nullptr, true);
+			RegisterAsyncTask(&operation->finishTask, AHCIFinishOperation, operation, nullptr);
 			scheduler.lock.Release();
 		}
 	} else {
@@ -465,7 +470,7 @@ void AHCIProcessInterrupts(uint32_t pendingInterrupts) {
 
 					if (drive->operations[i].ioPacket) {
 						scheduler.lock.Acquire();
-						RegisterAsyncTask(AHCIFinishOperation, drive->operations + i, nullptr, true);
+						RegisterAsyncTask(&drive->operations[i].finishTask, AHCIFinishOperation, drive->operations + i, nullptr);
 						scheduler.lock.Release();
 					}
 				}
@@ -629,9 +634,9 @@ void AHCIRegisterController(PCIDevice *pciDevice) {
 			drive->buffers[i] = buffer;
 
 			volatile AHCICommandHeader *command = drive->commandList + i;
-			command->commandTableDescriptorLow = (uint32_t) ((commandTablePage + 256 * i) >> 0); 
-			command->commandTableDescriptorHigh = (uint32_t) ((commandTablePage + 256 * i) >> 32);
-			command->prdEntryCount = 8; 
+			command->commandTableDescriptorLow = (uint32_t) ((commandTablePage + sizeof(AHCICommandTable) * i) >> 0); 
+			command->commandTableDescriptorHigh = (uint32_t) ((commandTablePage + sizeof(AHCICommandTable) * i) >> 32);
+			command->prdEntryCount = AHCI_PRDT_ENTRY_COUNT; 
 		}
 
 		// Increment the position of these pages.
@@ -700,6 +705,46 @@ bool AHCIController::Access(IOPacket *ioPacket, uintptr_t _drive, uint64_t offse
 	_operation.operation = operation;
 	_operation.userBuffer = userBuffer;
 
+	// Reads of whole sectors into resident kernel memory are transferred directly, without copying out of the command's buffer.
+	AHCIPRDTEntry directEntries[AHCI_PRDT_ENTRY_COUNT] = {};
+	size_t directEntryCount = 0;
+
+	if (operation == DRIVE_ACCESS_READ && !offsetIntoSector && !(countBytes % AHCI_SECTOR_SIZE) 
+			&& !((uintptr_t) userBuffer & 1) && (uintptr_t) userBuffer >= 0xFFFF800000000000) {
+		_operation.direct = true;
+		uintptr_t previousEnd = 0;
+
+		for (uintptr_t position = 0; position < countBytes; ) {
+			uintptr_t address = (uintptr_t) userBuffer + position;
+			uintptr_t physicalPage = kernelVMM.virtualAddressSpace->Get(address, true);
+			size_t bytes = PAGE_SIZE - (address & (PAGE_SIZE - 1));
+			if (bytes > countBytes - position) bytes = countBytes - position;
+
+			if (!physicalPage) {
+				// The page isn't mapped yet.
+				_operation.direct = false;
+				break;
+			}
+
+			uintptr_t physicalAddress = physicalPage + (address & (PAGE_SIZE - 1));
+
+			if (directEntryCount && previousEnd == physicalAddress) {
+				directEntries[directEntryCount - 1].byteCount += bytes;
+			} else if (directEntryCount == AHCI_PRDT_ENTRY_COUNT) {
+				_operation.direct = false;
+				break;
+			} else {
+				directEntries[directEntryCount].targetAddressLow = (uint32_t) (physicalAddress >> 0);
+				directEntries[directEntryCount].targetAddressHigh = (uint32_t) (physicalAddress >> 32);
+				directEntries[directEntryCount].byteCount = bytes;
+				directEntryCount++;
+			}
+
+			previousEnd = physicalAddress + bytes;
+			position += bytes;
+		}
+	}
+
 	uintptr_t commandIndex = AHCI_COMMAND_COUNT;
 
 	// Wait for an available command.
@@ -774,11 +819,24 @@ bool AHCIController::Access(IOPacket *ioPacket, uintptr_t _drive, uint64_t offse
 	// Prepare the PRDT.
 	header->commandLength = sizeof(AHCIPacketDeviceToHost) / sizeof(uint32_t);
 	header->write = operation == DRIVE_ACCESS_WRITE;
-	header->prdEntryCount = 1;
-	table->prdtEntries[0].targetAddressLow = (uint32_t) (physicalBuffer >> 0);
-	table->prdtEntries[0].targetAddressHigh = (uint32_t) (physicalBuffer >> 32);
-	table->prdtEntries[0].byteCount = sectorsNeededToLoad * AHCI_SECTOR_SIZE;
-	table->prdtEntries[0].interruptOnCompletion = true;
+
+	if (_operation.direct) {
+		header->prdEntryCount = directEntryCount;
+
+		for (uintptr_t i = 0; i < directEntryCount; i++) {
+			// The byte count is stored minus 1; the entries must not overrun the caller's buffer.
+			table->prdtEntries[i].targetAddressLow = directEntries[i].targetAddressLow;
+			table->prdtEntries[i].targetAddressHigh = directEntries[i].targetAddressHigh;
+			table->prdtEntries[i].byteCount = directEntries[i].byteCount - 1;
+			table->prdtEntries[i].interruptOnCompletion = i == directEntryCount - 1;
+		}
+	} else {
+		header->prdEntryCount = 1;
+		table->prdtEntries[0].targetAddressLow = (uint32_t) (physicalBuffer >> 0);
+		table->prdtEntries[0].targetAddressHigh = (uint32_t) (physicalBuffer >> 32);
+		table->prdtEntries[0].byteCount = sectorsNeededToLoad * AHCI_SECTOR_SIZE;
+		table->prdtEntries[0].interruptOnCompletion = true;
+	}
 
 	// Setup the ATA command.
 	volatile AHCIPacketHostToDevice *packet = (volatile AHCIPacketHostToDevice *) table->commandPacket;
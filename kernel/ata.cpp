@@ -85,6 +85,7 @@ struct ATADriver {
 	uint16_t identifyData[ATA_SECTOR_SIZE / 2];
 
 	volatile ATAOperation op;
+	AsyncTask irqTask; // Completes an asynchronous operation.
 	
 	LinkedList<ATABlockedOperation> blockedPackets;
 	Mutex blockedPacketsMutex;
@@ -385,7 +386,7 @@ bool ATAIRQHandler(uintptr_t interruptIndex) {
 
 	if (ata.op.packet) {
 		scheduler.lock.Acquire();
-		RegisterAsyncTask(ATAIRQHandler2, nullptr, nullptr, true);
+		RegisterAsyncTask(&ata.irqTask, ATAIRQHandler2, nullptr, nullptr);
 		scheduler.lock.Release();
 	} else {
 		// If we're using synchronous IO, then *don't* queue an asynchronous task.
@@ -216,11 +216,11 @@ void Graphics::UpdateScreen_VIDEO_COLOR_24_RGB() {
 }
 
 void Graphics::UpdateScreen() {
-	windowManager.mutex.Acquire();
+	windowManager.lock.AcquireShared();
 	int cursorX = windowManager.cursorX + windowManager.cursorImageOffsetX, cursorY = windowManager.cursorY + windowManager.cursorImageOffsetY;
 	int cursorImageX = windowManager.cursorImageX, cursorImageY = windowManager.cursorImageY;
 	int cursorImageWidth = windowManager.cursorImageWidth, cursorImageHeight = windowManager.cursorImageHeight;
-	windowManager.mutex.Release();
+	windowManager.lock.ReleaseShared();
 
 	updateScreenMutex.Acquire();
 	Defer(updateScreenMutex.Release());
@@ -426,7 +426,7 @@ void Surface::InvalidateRectangle(OSRectangle rectangle) {
 	}
 }
 
-void Surface::Copy(Surface &source, OSPoint destinationPoint, OSRectangle sourceRegion, bool avoidUnmodifiedRegions, uint16_t depth,
+FPU_FUNCTION void Surface::Copy(Surface &source, OSPoint destinationPoint, OSRectangle sourceRegion, bool avoidUnmodifiedRegions, uint16_t depth,
 		bool alreadyLocked) {
 	if (depth != SURFACE_COPY_WITHOUT_DEPTH_CHECKING) {
 		if (!depthBuffer) {
@@ -588,7 +588,7 @@ void Surface::Copy(Surface &source, OSPoint destinationPoint, OSRectangle source
 	}
 }
 
-void Surface::BlendWindow(Surface &source, OSPoint destinationPoint, OSRectangle sourceRegion, uint16_t depth) {
+FPU_FUNCTION void Surface::BlendWindow(Surface &source, OSPoint destinationPoint, OSRectangle sourceRegion, uint16_t depth) {
 	mutex.Acquire();
 	Defer(mutex.Release());
 
@@ -804,7 +804,7 @@ void Surface::Draw(Surface &source, OSRectangle destinationRegion, OSRectangle s
 	}
 }
 
-void Surface::FillRectangle(OSRectangle region, OSColor color, bool alreadyLocked) {
+FPU_FUNCTION void Surface::FillRectangle(OSRectangle region, OSColor color, bool alreadyLocked) {
 	if (region.left < 0 || region.top < 0
 			|| region.right > (intptr_t) resX || region.bottom > (intptr_t) resY
 			|| region.left >= region.right || region.top >= region.bottom) {
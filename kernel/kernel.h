@@ -11,6 +11,11 @@
 #include <xmmintrin.h>
 #include <emmintrin.h>
 
+// The kernel is compiled without SSE, so that interrupt handlers never touch the FPU.
+// This lets FPU state be switched lazily; see FPUDeviceNotAvailable.
+// Functions that use SSE must be marked with FPU_FUNCTION, and can only be called from threads.
+#define FPU_FUNCTION __attribute__((target("sse2")))
+
 #define OS_FOLDER "/os"
 
 #define MAX_PROCESSORS (256)
@@ -83,8 +88,16 @@ extern "C" uint64_t ProcessorReadTimeStamp();
 extern "C" void DoContextSwitch(struct InterruptContext *context, 
 		uintptr_t virtualAddressSpace, uintptr_t threadKernelStack, struct Thread *newThread);
 extern "C" void ProcessorSetAddressSpace(uintptr_t virtualAddressSpaceIdentifier);
+extern "C" void ProcessorSwitchAddressSpace(struct VirtualAddressSpace *virtualAddressSpace); // Activate and load the address space with the interrupt flag cleared.
+extern "C" void ProcessorFlushTLB(bool global); // Flush the TLB entries for the current address space; or all entries, including global pages.
 extern "C" uintptr_t ProcessorGetAddressSpace();
 extern "C" uintptr_t ProcessorGetRSP();
+extern "C" void ProcessorSetTaskSwitched(); // Trap the next use of the FPU.
+extern "C" void ProcessorClearTaskSwitched();
+extern "C" bool ProcessorIsTaskSwitched();
+extern "C" void ProcessorSaveFPU(void *buffer); // The buffer must be 512 bytes, and 16-byte aligned.
+extern "C" void ProcessorLoadFPU(void *buffer);
+extern "C" void ProcessorInitialiseFPU();
 
 volatile uintptr_t ipiVector;
 extern struct Spinlock ipiLock;
@@ -93,10 +106,6 @@ extern struct Spinlock ipiLock;
 extern "C" uint64_t ProcessorReadCR3();
 extern "C" void gdt_data();
 
-volatile uintptr_t tlbShootdownVirtualAddress;
-volatile size_t tlbShootdownPageCount;
-volatile uintptr_t tlbShootdownRemainingProcessors;
-
 extern "C" CPULocalStorage *cpu_local_storage;
 
 extern "C" bool simdSSE3Support;
@@ -110,7 +119,9 @@ uintptr_t LoadELF(char *imageName, size_t imageNameLength);
 
 bool HandlePageFault(uintptr_t page);
 
-void NextTimer(size_t ms); // Receive a TIMER_INTERRUPT in ms ms.
+void NextTimer(size_t ms); // Receive a TIMER_INTERRUPT in ms ms. If ms is 0, the timer is stopped.
+uint64_t ReadTimeMs(); // The number of milliseconds since the processors were started.
+uint64_t timeStampTicksPerMs;
 void Delay1MS(); // Spin for 1ms. Use only during initialisation. Not thread-safe.
 
 typedef bool (*IRQHandler)(uintptr_t interruptIndex);
@@ -123,22 +134,65 @@ struct Mutex {
 
 	struct Thread *volatile owner;
 	uintptr_t acquireAddress, releaseAddress; // TODO Remove in non-debug builds?
+	uint64_t acquireTimeStamp; // Only set while the lock profiler is enabled.
 
 	size_t handles;
 
 	LinkedList<struct Thread> blockedThreads;
+	LinkedItem<struct Mutex> contendedItem; // Entry in the owner's contendedMutexes list, while threads are blocking on the mutex.
+};
+
+struct SpinlockStatistics {
+	const char *name;
+	volatile uint64_t acquisitions, contendedAcquisitions;
+	volatile uint64_t spinTicks; // Time stamp counter ticks spent waiting for the lock.
+};
+
+#define MAX_SPINLOCK_STATISTICS (32)
+SpinlockStatistics spinlockStatistics[MAX_SPINLOCK_STATISTICS];
+volatile size_t spinlockStatisticsCount;
+
+// The lock profiler records the contention on locks, by the call site that acquired them.
+// Disabling it writes the results to the log, for util/analyse_mutex_log.cpp.
+
+struct LockProfileEntry {
+	uintptr_t address; // The return address of Acquire, or 0 if the entry is unused.
+	bool spinlock;
+	uint64_t acquisitions, contendedAcquisitions;
+	uint64_t waitTicks, maxWaitTicks, holdTicks;
+};
+
+#define LOCK_PROFILE_ENTRIES (1024) // Must be a power of 2.
+
+struct LockProfile {
+	// Each processor has its own profile, so that recording doesn't need any synchronisation.
+	LockProfileEntry entries[LOCK_PROFILE_ENTRIES];
+	size_t droppedRecords; // The table was full.
 };
 
+volatile bool lockProfilerEnabled;
+void LockProfilerAcquired(uintptr_t address, bool spinlock, bool contended, uint64_t waitTicks);
+void LockProfilerReleased(uintptr_t address, bool spinlock, uint64_t holdTicks);
+void LockProfilerStart();
+void LockProfilerStop(); // Writes the results to the log.
+
 struct Spinlock {
 	void Acquire();
 	void Release(bool force = false);
 	void AssertLocked();
+	void EnableStatistics(const char *name); // Count the lock's acquisitions, reported by OSGetSpinlockStatistics.
+
+	// A ticket lock; processors take a ticket and wait for it to be served,
+	// so the lock is handed over in the order it was requested.
+	volatile uint16_t nextTicket, nowServing;
 
-	volatile uint8_t state;
 	volatile bool interruptsEnabled;
 	struct Thread *volatile owner;
 	volatile uintptr_t acquireAddress, releaseAddress;
 	volatile uint8_t ownerCPU;
+	volatile uint64_t acquireTimeStamp; // Only set while the lock profiler is enabled.
+
+	SpinlockStatistics *statistics; // nullptr if statistics aren't enabled.
 };
 
 struct Event {
@@ -156,6 +210,29 @@ struct Event {
 	volatile size_t handles;
 
 	LinkedList<Thread> blockedThreads;
+
+	struct CompletionPortAssociation *completion; // Protected by the scheduler's lock.
+};
+
+struct RWLock {
+	// Any number of threads can hold the lock shared, or one thread can hold it exclusive.
+	// Writers are preferred: once a writer is waiting, new readers block until it has released the lock.
+	// Shared acquisitions are not recursive, since a waiting writer would block the second acquisition.
+	void AcquireShared();
+	void ReleaseShared();
+	void AcquireExclusive();
+	void ReleaseExclusive();
+	void AssertShared(); // Held shared by some thread, or exclusive by this thread.
+	void AssertExclusive();
+
+	Mutex writerMutex; // Held by the thread that has the lock exclusive, or is waiting for readers to leave.
+	Spinlock lock; // Protects the counts.
+
+	volatile size_t readers;
+	volatile size_t writers; // Including writers waiting for writerMutex.
+	uintptr_t sharedAcquireAddress, sharedReleaseAddress;
+
+	Event noReaders, noWriters; // Manually reset.
 };
 
 typedef void (*AsyncTaskCallback)(void *argument);
@@ -164,12 +241,46 @@ struct AsyncTask {
 	AsyncTaskCallback callback;
 	void *argument;
 	struct VirtualAddressSpace *addressSpace;
+	struct AsyncTask *volatile next;
+
+#define ASYNC_TASK_EMBEDDED (0) // Owned by the object the task is for; registering it again while it's queued does nothing.
+#define ASYNC_TASK_FROM_RESERVE (1) // Returned to the reserve after it runs.
+#define ASYNC_TASK_FROM_HEAP (2) // Freed after it runs.
+	uint8_t storage;
+	volatile bool queued;
+};
+
+struct AsyncTaskQueue {
+	// A lock-free multiple-producer, single-consumer queue.
+	// Any processor can push a task; the worker threads take turns to pop them, with consumerLock.
+	void Initialise();
+	void Push(AsyncTask *task);
+	AsyncTask *Pop();
+
+	AsyncTask *volatile head; 	// The most recently pushed task.
+	AsyncTask *tail; 		// The next task to pop.
+	AsyncTask stub;
+	Spinlock consumerLock;
+
+	Event available; // Set when a task is pushed.
+};
+
+struct TLBShootdown {
+	// The pages to invalidate; a single shootdown can batch a few ranges.
+	// If flushAll is set, the ranges are ignored and the TLB is flushed.
+#define TLB_SHOOTDOWN_RANGES (8)
+#define TLB_SHOOTDOWN_FLUSH_PAGES (64) // Flush instead of invalidating more pages than this.
+	uintptr_t addresses[TLB_SHOOTDOWN_RANGES];
+	size_t pageCounts[TLB_SHOOTDOWN_RANGES];
+	size_t rangeCount, pageCount;
+	bool flushAll, global;
+
+	volatile size_t remainingProcessors;
 };
 
 struct CPULocalStorage {
 	struct Thread *currentThread, 
-		      *idleThread, 
-		      *asyncTaskThread;
+		      *idleThread;
 
 	bool irqSwitchThread;
 	unsigned processorID;
@@ -178,9 +289,50 @@ struct CPULocalStorage {
 
 	struct ACPIProcessor *acpiProcessor;
 
-#define MAX_ASYNC_TASKS (256)
-	volatile AsyncTask asyncTasks[MAX_ASYNC_TASKS];
-	volatile uint8_t asyncTasksRead, asyncTasksWrite;
+	// Protects activeThreads and currentThread, and the scheduledProcessor of threads queued on or executing on this processor.
+	// Taken after the scheduler's lock, and never while holding another processor's queueLock.
+	// Scheduler::Yield holds it until PostContextSwitch, so the previous thread can't be taken while its stack is in use.
+	Spinlock queueLock;
+	LinkedList<struct Thread> activeThreads[OS_THREAD_PRIORITY_COUNT]; // Threads waiting to execute on this processor. Protected by queueLock.
+	bool yieldLocked; // Scheduler::Yield acquired the scheduler's lock, to be released by PostContextSwitch.
+	struct Thread *requeueThread; // The previous thread, to be queued by PostContextSwitch on another processor or the paused queue.
+	uint64_t timerDeadlineMs; // When the next TIMER_INTERRUPT will be received, or 0 if the timer is stopped.
+
+	uint64_t idleTicks; // Time stamp counter ticks spent executing the idle thread.
+	uint64_t contextSwitches;
+
+	struct Thread *fpuOwner; // The thread whose FPU state was last loaded into this processor's registers.
+	struct LockProfile *lockProfile; // Allocated when the lock profiler is first started.
+
+	struct TimerWheel *timerWheel;
+
+#define ASYNC_TASK_THREADS (2)
+	AsyncTaskQueue asyncTasks;
+	struct Thread *asyncTaskThreads[ASYNC_TASK_THREADS]; // If one blocks while executing a task, another can continue with the queue.
+
+	AsyncTaskQueue workQueue; // Jobs from WorkGroups.
+	struct Thread *workerThread;
+
+	// Thread objects and kernel stacks of recently removed threads, so that spawning a thread doesn't need the VMM.
+	// Only accessed by this processor, with interrupts disabled.
+#define THREAD_CACHE_SIZE (8)
+	struct Thread *threadCache[THREAD_CACHE_SIZE];
+	uintptr_t kernelStackCache[THREAD_CACHE_SIZE];
+	size_t threadCacheCount, kernelStackCacheCount;
+
+	// Free physical pages, so that most page allocations and frees don't need the PMM's lock.
+	// Only accessed by this processor, with interrupts disabled. See PMM::AllocatePage.
+#define PMM_PAGE_CACHE_SIZE (64)
+#define PMM_PAGE_CACHE_BATCH (32) // The number of pages moved between a cache and the bitsets at once.
+	uintptr_t zeroedPageCache[PMM_PAGE_CACHE_SIZE], dirtyPageCache[PMM_PAGE_CACHE_SIZE];
+	size_t zeroedPageCacheCount, dirtyPageCacheCount;
+
+	struct VirtualAddressSpace *addressSpace; // The address space loaded on this processor. See VirtualAddressSpace::Activate.
+
+	// The shootdown this processor is sending, which is only modified with interrupts disabled,
+	// and a bit for each processor whose shootdown is waiting for this processor. See SendTLBShootdown.
+	TLBShootdown tlbShootdown;
+	volatile uint64_t tlbShootdownsPending[MAX_PROCESSORS / 64];
 };
 
 struct UniqueIdentifier {
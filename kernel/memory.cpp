@@ -6,6 +6,8 @@ void *_ArrayAdd(void **array, size_t &arrayCount, size_t &arrayAllocated, void *
 #ifdef ARCH_X86_64
 #define PAGE_BITS (12)
 #define PAGE_SIZE (1 << PAGE_BITS)
+#define LARGE_PAGE_BITS (21)
+#define LARGE_PAGE_SIZE (1 << LARGE_PAGE_BITS)
 #endif
 
 // We divide memory mapped files into chunks that can be loaded in and out memory.
@@ -38,21 +40,42 @@ extern "C" void SetupProcessor2();
 extern "C" void ProcessorInstallTSS(uint32_t *gdt, uint32_t *tss);
 #endif
 
+#define BUDDY_MAX_ORDER (LARGE_PAGE_BITS - PAGE_BITS) // Blocks of up to 2MB, the size of a large page.
+#define BUDDY_MAX_CHUNKS (64)
+
+struct BuddyChunk {
+	// A naturally aligned block of (1 << BUDDY_MAX_ORDER) pages taken from the bitsets, split into power-of-two blocks.
+	// The blocks form a binary tree: node 1 is the whole chunk, and the children of node n are 2n and 2n + 1.
+	// A node's bit is set if its block is free and has not been split.
+	uintptr_t base; // 0 if the chunk is unused.
+	uint64_t free[(2 << BUDDY_MAX_ORDER) / 64];
+};
+
 struct PMM {
 	uintptr_t AllocatePage(bool zeroPage); 
+	uintptr_t AllocateContiguous(size_t bytes); // Naturally aligned, and not zeroed. Up to 2MB; returns 0 on failure.
 	uintptr_t AllocateContiguous64KB();
 	uintptr_t AllocateContiguous128KB();
-	void FreePage(uintptr_t address, bool bypassStack = false);
+	void FreeContiguous(uintptr_t address, size_t bytes);
+	void FreePage(uintptr_t address, bool bypassStack = false); // The lock must not be held.
 	void ZeroPages();
 	void Initialise();
 	void Initialise2();
 
-	uintptr_t pagesAllocated;
+	uintptr_t AllocateCachedPage(bool zeroPage);
+	uintptr_t BuddyAllocate(uintptr_t order);
+	void BuddyFree(uintptr_t address, uintptr_t order);
+	uintptr_t BuddyTakeChunk();
+
+	BuddyChunk buddyChunks[BUDDY_MAX_CHUNKS]; // Protected by the lock.
+
+	volatile uintptr_t pagesAllocated;
 	uintptr_t startPageCount;
 
 	Bitset zeroed, dirty;
 
 	Mutex lock; 
+	bool pageCachesReady; // Set once every processor has its local storage.
 
 	struct Event signalZeroPageThread;
 	Thread *zeroPageThread;
@@ -84,9 +107,23 @@ enum VMMMapPolicy {
 #define VMM_REGION_FLAG_OVERWRITABLE (128)
 #define VMM_REGION_FLAG_COPIED       (256)
 #define VAS_SKIP_1MB		     (512)
+#define VAS_LARGE_PAGE		     (1024) // Returned by VirtualAddressSpace::Get.
+
+struct VMMRegionTreeLinks {
+	// Entries are referred to by their index + 1 (0 is none), since the region arrays can be reallocated.
+	uint32_t left, right;
+	int32_t height;
+};
+
+struct VMMRegionArrayIndex {
+	uint32_t tree; // The used entries, by base address.
+	uint32_t firstUnused; // Entries that were used and have been removed, linked through addressLinks.left.
+	size_t highWater; // Entries from here have never been used.
+};
 
 struct VMMRegion {
 	bool used;
+	VMMRegionTreeLinks addressLinks, sizeLinks; // sizeLinks is only used by free regions in VMM::regions.
 
 	uintptr_t baseAddress;
 	size_t pageCount;
@@ -110,6 +147,8 @@ struct VirtualAddressSpace {
 	void Map(uintptr_t physicalAddress,
 		 uintptr_t virtualAddress,
 		 unsigned flags);
+	bool MapLarge(uintptr_t physicalAddress, uintptr_t virtualAddress, unsigned flags); // Returns false if part of the range is already mapped.
+	void SplitLarge(uintptr_t virtualAddress); // Replace a large page with a page table.
 	void Remove(uintptr_t virtualAddress, size_t pageCount);
 	uintptr_t Get(uintptr_t virtualAddress, bool force = false, uint64_t *flags = nullptr);
 	
@@ -118,7 +157,22 @@ struct VirtualAddressSpace {
 
 #ifdef ARCH_X86_64
 #define VIRTUAL_ADDRESS_SPACE_IDENTIFIER(x) ((x)->cr3)
+#define VIRTUAL_ADDRESS_SPACE_SWITCH_VALUE(x) ((x)->Activate())
 	uintptr_t cr3;
+
+	// The TLB entries of each address space are tagged with its PCID, so they survive context switches.
+	// Processors with their bit set in pcidStale must flush the PCID before they next use it.
+#define PCID_KERNEL (0)
+#define PCID_SHARED (4095) // Used when the other PCIDs run out; flushed whenever it is loaded.
+	uint16_t pcid;
+	volatile uint64_t pcidStale[MAX_PROCESSORS / 64];
+
+	// Only these processors receive shootdowns for the lower half of the address space.
+	volatile uint64_t activeProcessors[MAX_PROCESSORS / 64];
+
+	void AllocatePCID();
+	void MarkPCIDStale(); // Make the other processors flush the PCID before they next use it.
+	uintptr_t Activate(); // Called when the address space is loaded on this processor; returns the value to load into CR3. The interrupt flag must be cleared, since IPIs are not masked by ProcessorDisableInterrupts.
 	
 #define PAGE_TABLE_L4 ((volatile uint64_t *) 0xFFFFFFFFFFFFF000)
 #define PAGE_TABLE_L3 ((volatile uint64_t *) 0xFFFFFFFFFFE00000)
@@ -154,14 +208,20 @@ struct VMM {
 
 	VirtualAddressSpace *virtualAddressSpace;
 	VirtualAddressSpace _virtualAddressSpace;
-	Mutex lock; 
+	RWLock lock; // Page faults and region lookups acquire this shared.
 
 	bool AddRegion(uintptr_t baseAddress, size_t pageCount, uintptr_t offset, VMMRegionType type, VMMMapPolicy mapPolicy, unsigned flags, void *object);
 	uintptr_t FindEmptySpaceInRegionArray(VMMRegion *region, VMMRegion *&array, size_t &arrayAllocated);
 	bool HandlePageFaultInRegion(uintptr_t page, VMMRegion *region, size_t limit = 0, struct FaultInformation *fault = nullptr);
-	VMMRegion *FindRegion(uintptr_t address, VMMRegion *array, size_t arrayAllocated);
-	void MergeIdenticalAdjacentRegions(VMMRegion *region, VMMRegion *array, size_t arrayAllocated);
-	void SplitRegion(VMMRegion *region, uintptr_t address, bool keepAbove, VMMRegion *array, size_t &arrayAllocated);
+	VMMRegion *FindRegion(uintptr_t address, VMMRegion *array);
+	void MergeIdenticalAdjacentRegions(VMMRegion *region, VMMRegion *array);
+	void SplitRegion(VMMRegion *&region, uintptr_t address, bool keepAbove, VMMRegion *&array, size_t &arrayAllocated);
+	void InsertRegionIntoArray(VMMRegion *region, VMMRegion *array);
+	void RemoveRegionFromArray(VMMRegion *region, VMMRegion *array);
+	VMMRegionArrayIndex *GetArrayIndex(VMMRegion *array) { return array == regions ? &regionsIndex : &lookupRegionsIndex; }
+	VMMRegion *FindFreeRegion(size_t pageCount); // Returns the smallest free region with more than pageCount pages.
+	void InsertFreeRegion(VMMRegion *region);
+	void RemoveFreeRegion(VMMRegion *region);
 
 	// This contains the canonical "split" regions.
 	VMMRegion *regions;
@@ -172,6 +232,10 @@ struct VMM {
 	VMMRegion *lookupRegions;
 	size_t lookupRegionsAllocated;
 
+	// Balanced trees over the arrays, so that lookups and allocations don't need to scan them.
+	VMMRegionArrayIndex regionsIndex, lookupRegionsIndex;
+	uint32_t freeRegionsTree; // The free regions, by page count and then base address.
+
 #ifdef ARCH_X86_64
 	uint64_t *pageTable;
 #endif
@@ -202,6 +266,7 @@ struct SharedMemoryRegion {
 
 #define SHARED_ADDRESS_PRESENT (1)
 #define SHARED_ADDRESS_READING (2)
+#define SHARED_ADDRESS_READAHEAD (4) // Set with SHARED_ADDRESS_READING while a mapped file's page is being read ahead.
 
 	VMMRegionReference *mappings;
 	size_t mappingsCount, mappingsAllocated;
@@ -236,11 +301,11 @@ struct FaultInformation {
 #define FAULT_TYPE_NONE (0)
 #define FAULT_TYPE_READ (1)
 #define FAULT_TYPE_WRITE (2)
+#define FAULT_TYPE_WAIT (3) // The section is being read ahead.
 	int type;
 
 	SharedMemoryRegion *region;
 	uintptr_t offset;
-	uintptr_t *sharedAddresses;
 
 	void *destination;
 	unsigned regionFlags;
@@ -254,6 +319,11 @@ struct SharedMemoryManager {
 	SharedMemoryRegion *CreateSharedMemory(size_t sizeBytes, char *name = nullptr, size_t nameLength = 0, unsigned flags = 0);
 	void DestroySharedMemory(SharedMemoryRegion *region);
 	void ResizeSharedMemory(struct SharedMemoryRegion *region, size_t newSizeBytes);
+	uintptr_t *GetPageEntry(SharedMemoryRegion *region, uintptr_t offset, bool create);
+
+	// For a mapped file's cached pages. The caller must stop the region from being resized.
+	bool ReadCachedPages(SharedMemoryRegion *region, uintptr_t offset, void *buffer, size_t count); // Fails unless every page is present.
+	void WriteCachedPages(SharedMemoryRegion *region, uintptr_t offset, void *buffer, size_t count); // Also cancels reads of the pages.
 
 	NamedSharedMemoryRegion *namedSharedMemoryRegions;
 	size_t namedSharedMemoryRegionsCount, namedSharedMemoryRegionsAllocated;
@@ -279,8 +349,13 @@ struct Pool {
 #define PHYSICAL_MEMORY_MANIPULATION_REGION_PAGES (16)
 void ZeroPhysicalMemory(uintptr_t page, size_t pageCount);
 void CopyIntoPhysicalMemory(uintptr_t page, void *source, size_t pageCount);
+void *MapPhysicalPages(uintptr_t *pages, size_t pageCount); // Zero entries are left unmapped. Free the window with kernelVMM.Free.
 void *physicalMemoryManipulationRegion;
 
+// A page used to fill page tables before they are installed.
+void *pageTableWindow;
+Spinlock pageTableWindowLock;
+
 #endif
 
 #ifdef IMPLEMENTATION
@@ -289,8 +364,8 @@ PMM pmm;
 VMM kernelVMM, memoryManagerVMM;
 
 void VMM::Initialise() {
-	lock.Acquire();
-	Defer(lock.Release());
+	lock.AcquireExclusive();
+	Defer(lock.ReleaseExclusive());
 
 	virtualAddressSpace = &_virtualAddressSpace;
 
@@ -333,6 +408,7 @@ void VMM::Initialise() {
 		ZeroMemory(pageTable + 0x000, PAGE_SIZE / 2);
 		CopyMemory(pageTable + 0x100, (uint64_t *) (PAGE_TABLE_L4 + 0x100), PAGE_SIZE / 2);
 		pageTable[512 - 1] = virtualAddressSpace->cr3 | 3;
+		virtualAddressSpace->AllocatePCID();
 #endif
 	}
 }
@@ -346,12 +422,96 @@ void ValidateCurrentVMM(VMM *target) {
 }
 
 #ifdef ARCH_X86_64
+Spinlock pcidLock;
+uint16_t pcidFreeList[PCID_SHARED];
+size_t pcidFreeCount;
+uint16_t pcidNext = PCID_KERNEL + 1;
+
+void VirtualAddressSpace::AllocatePCID() {
+	pcidLock.Acquire();
+
+	if (pcidFreeCount) {
+		pcid = pcidFreeList[--pcidFreeCount];
+	} else if (pcidNext != PCID_SHARED) {
+		pcid = pcidNext++;
+	} else {
+		pcid = PCID_SHARED;
+	}
+
+	pcidLock.Release();
+
+	// The processors may still have TLB entries from the last address space to use the PCID.
+	for (uintptr_t i = 0; i < MAX_PROCESSORS / 64; i++) {
+		pcidStale[i] = ~(uint64_t) 0;
+	}
+}
+
+void VirtualAddressSpace::MarkPCIDStale() {
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+
+	// This processor has already invalidated the pages.
+	CPULocalStorage *local = GetLocalStorage();
+	uintptr_t processorID = local ? local->processorID : MAX_PROCESSORS;
+
+	for (uintptr_t i = 0; i < MAX_PROCESSORS / 64; i++) {
+		uint64_t mask = ~(uint64_t) 0;
+		if (processorID / 64 == i) mask &= ~((uint64_t) 1 << (processorID % 64));
+		__sync_fetch_and_or(pcidStale + i, mask);
+	}
+
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+}
+
+uintptr_t VirtualAddressSpace::Activate() {
+	CPULocalStorage *local = GetLocalStorage();
+
+	if (!local) {
+		return pagingPCIDSupport ? (cr3 | pcid) : cr3;
+	}
+
+	uintptr_t index = local->processorID / 64;
+	uint64_t bit = (uint64_t) 1 << (local->processorID % 64);
+
+	if (local->addressSpace != this) {
+		// This must be visible before the PCID is checked; see VirtualAddressSpace::Remove.
+		if (local->addressSpace) __sync_fetch_and_and(local->addressSpace->activeProcessors + index, ~bit);
+		__sync_fetch_and_or(activeProcessors + index, bit);
+		local->addressSpace = this;
+	}
+
+	if (!pagingPCIDSupport) {
+		return cr3;
+	}
+
+	uintptr_t value = cr3 | pcid;
+
+	if (pcid == PCID_SHARED) {
+		return value;
+	}
+
+	if (pcidStale[index] & bit) {
+		__sync_fetch_and_and(pcidStale + index, ~bit);
+		return value;
+	}
+
+	return value | ((uint64_t) 1 << 63); // Don't flush the PCID.
+}
+
 void CleanupVirtualAddressSpace(void *argument) {
-	pmm.lock.Acquire();
 	// KernelLog(LOG_INFO, "Removing virtual address space page %x...\n", argument);
 	// KernelLog(LOG_INFO, "Current CR3 is %x\n", ProcessorGetAddressSpace());
-	pmm.FreePage((uintptr_t) argument);
-	pmm.lock.Release();
+
+	// The PCID is stored in the bottom bits of the argument.
+	uint16_t pcid = (uintptr_t) argument & (PAGE_SIZE - 1);
+
+	if (pcid != PCID_KERNEL && pcid != PCID_SHARED) {
+		pcidLock.Acquire();
+		pcidFreeList[pcidFreeCount++] = pcid;
+		pcidLock.Release();
+	}
+
+	pmm.FreePage((uintptr_t) argument & ~(PAGE_SIZE - 1));
 }
 #endif
 
@@ -383,13 +543,12 @@ void VMM::Destroy() {
 
 #ifdef ARCH_X86_64
 	// KernelLog(LOG_VERBOSE, "Freeing virtual address space...\n");
-	pmm.lock.Acquire();
 	for (uintptr_t i = 0; i < 256; i++) {
 		if (PAGE_TABLE_L4[i]) {
 			for (uintptr_t j = i * 512; j < (i + 1) * 512; j++) {
 				if (PAGE_TABLE_L3[j]) {
 					for (uintptr_t k = j * 512; k < (j + 1) * 512; k++) {
-						if (PAGE_TABLE_L2[k]) {
+						if (PAGE_TABLE_L2[k] && !(PAGE_TABLE_L2[k] & 0x80 /* Large page */)) {
 							pmm.FreePage(PAGE_TABLE_L2[k] & (~0xFFF));
 						}
 					}
@@ -399,61 +558,241 @@ void VMM::Destroy() {
 			pmm.FreePage(PAGE_TABLE_L4[i] & (~0xFFF));
 		}
 	}
-	pmm.lock.Release();
 
 	kernelVMM.Free(pageTable); 
+
+	// Stop using the address space on this processor, since it is about to be freed.
+	Thread *thread = GetCurrentThread();
+	if (thread->asyncTempAddressSpace == virtualAddressSpace) thread->asyncTempAddressSpace = nullptr;
+	ProcessorSwitchAddressSpace(kernelVMM.virtualAddressSpace);
 #endif
 
 #if ARCH_X86_64
+	AsyncTask *task = AllocateAsyncTask();
 	scheduler.lock.Acquire();
-	RegisterAsyncTask(CleanupVirtualAddressSpace, (void *) virtualAddressSpace->cr3, kernelProcess, true);
+	RegisterAsyncTask(task, CleanupVirtualAddressSpace, (void *) (virtualAddressSpace->cr3 | virtualAddressSpace->pcid), kernelProcess);
 	scheduler.lock.Release();
 #endif
 
 	// KernelLog(LOG_VERBOSE, "VMM destroyed,\n");
 }
 
-uintptr_t VMM::FindEmptySpaceInRegionArray(VMMRegion *region, VMMRegion *&array, size_t &arrayAllocated) {
-	uintptr_t regionIndex = -1;
-	retry:;
+// The region trees are AVL trees whose nodes are entries in a region array.
+// The address trees are keyed by base address; the free region tree by page count, and then base address.
+// Regions in the same array never overlap, so the base address of a region can be changed in place
+// as long as it stays within the region's previous range.
+
+static inline VMMRegionTreeLinks *RegionTreeLinks(VMMRegion *array, uint32_t node, bool bySize) {
+	return bySize ? &array[node - 1].sizeLinks : &array[node - 1].addressLinks;
+}
+
+static inline int32_t RegionTreeHeight(VMMRegion *array, uint32_t node, bool bySize) {
+	return node ? RegionTreeLinks(array, node, bySize)->height : 0;
+}
+
+static bool RegionTreeBefore(VMMRegion *array, uint32_t a, uint32_t b, bool bySize) {
+	VMMRegion *x = array + a - 1, *y = array + b - 1;
+	if (bySize && x->pageCount != y->pageCount) return x->pageCount < y->pageCount;
+	return x->baseAddress < y->baseAddress;
+}
+
+static void RegionTreeUpdateHeight(VMMRegion *array, uint32_t node, bool bySize) {
+	VMMRegionTreeLinks *links = RegionTreeLinks(array, node, bySize);
+	int32_t left = RegionTreeHeight(array, links->left, bySize), right = RegionTreeHeight(array, links->right, bySize);
+	links->height = (left > right ? left : right) + 1;
+}
+
+static uint32_t RegionTreeRotate(VMMRegion *array, uint32_t node, bool left, bool bySize) {
+	VMMRegionTreeLinks *links = RegionTreeLinks(array, node, bySize);
+	uint32_t pivot = left ? links->right : links->left;
+	VMMRegionTreeLinks *pivotLinks = RegionTreeLinks(array, pivot, bySize);
 
-	for (uintptr_t i = 0; i < arrayAllocated; i++) {
-		if (!array[i].used) {
-			regionIndex = i;
-			break;
+	if (left) {
+		links->right = pivotLinks->left;
+		pivotLinks->left = node;
+	} else {
+		links->left = pivotLinks->right;
+		pivotLinks->right = node;
+	}
+
+	RegionTreeUpdateHeight(array, node, bySize);
+	RegionTreeUpdateHeight(array, pivot, bySize);
+	return pivot;
+}
+
+static uint32_t RegionTreeBalance(VMMRegion *array, uint32_t node, bool bySize) {
+	RegionTreeUpdateHeight(array, node, bySize);
+	VMMRegionTreeLinks *links = RegionTreeLinks(array, node, bySize);
+	int32_t balance = RegionTreeHeight(array, links->left, bySize) - RegionTreeHeight(array, links->right, bySize);
+
+	if (balance > 1) {
+		VMMRegionTreeLinks *child = RegionTreeLinks(array, links->left, bySize);
+
+		if (RegionTreeHeight(array, child->left, bySize) < RegionTreeHeight(array, child->right, bySize)) {
+			links->left = RegionTreeRotate(array, links->left, true, bySize);
+		}
+
+		return RegionTreeRotate(array, node, false, bySize);
+	} else if (balance < -1) {
+		VMMRegionTreeLinks *child = RegionTreeLinks(array, links->right, bySize);
+
+		if (RegionTreeHeight(array, child->right, bySize) < RegionTreeHeight(array, child->left, bySize)) {
+			links->right = RegionTreeRotate(array, links->right, false, bySize);
 		}
+
+		return RegionTreeRotate(array, node, true, bySize);
+	}
+
+	return node;
+}
+
+static uint32_t RegionTreeInsert(VMMRegion *array, uint32_t root, uint32_t node, bool bySize) {
+	if (!root) {
+		VMMRegionTreeLinks *links = RegionTreeLinks(array, node, bySize);
+		links->left = links->right = 0;
+		links->height = 1;
+		return node;
+	}
+
+	VMMRegionTreeLinks *links = RegionTreeLinks(array, root, bySize);
+
+	if (RegionTreeBefore(array, node, root, bySize)) {
+		links->left = RegionTreeInsert(array, links->left, node, bySize);
+	} else {
+		links->right = RegionTreeInsert(array, links->right, node, bySize);
+	}
+
+	return RegionTreeBalance(array, root, bySize);
+}
+
+static uint32_t RegionTreeRemoveFirst(VMMRegion *array, uint32_t root, uint32_t *first, bool bySize) {
+	VMMRegionTreeLinks *links = RegionTreeLinks(array, root, bySize);
+
+	if (!links->left) {
+		*first = root;
+		return links->right;
+	}
+
+	links->left = RegionTreeRemoveFirst(array, links->left, first, bySize);
+	return RegionTreeBalance(array, root, bySize);
+}
+
+static uint32_t RegionTreeRemove(VMMRegion *array, uint32_t root, uint32_t node, bool bySize) {
+	if (!root) {
+		KernelPanic("RegionTreeRemove - Region %x is not in the tree.\n", array + node - 1);
+	}
+
+	VMMRegionTreeLinks *links = RegionTreeLinks(array, root, bySize);
+
+	if (root == node) {
+		if (!links->left) return links->right;
+		if (!links->right) return links->left;
+
+		// Replace the node with its successor.
+		uint32_t successor;
+		uint32_t right = RegionTreeRemoveFirst(array, links->right, &successor, bySize);
+		VMMRegionTreeLinks *successorLinks = RegionTreeLinks(array, successor, bySize);
+		successorLinks->left = links->left;
+		successorLinks->right = right;
+		return RegionTreeBalance(array, successor, bySize);
 	}
 
-	if (regionIndex == (uintptr_t) -1) {
-		if (this == &kernelVMM) {
-			KernelPanic("VMM::FindEmptySpaceInRegionArray - Maximum kernel VMM regions (%d) exceeded\n", arrayAllocated);
+	if (RegionTreeBefore(array, node, root, bySize)) {
+		links->left = RegionTreeRemove(array, links->left, node, bySize);
+	} else {
+		links->right = RegionTreeRemove(array, links->right, node, bySize);
+	}
+
+	return RegionTreeBalance(array, root, bySize);
+}
+
+void VMM::InsertRegionIntoArray(VMMRegion *region, VMMRegion *array) {
+	VMMRegionArrayIndex *index = GetArrayIndex(array);
+	index->tree = RegionTreeInsert(array, index->tree, region - array + 1, false);
+}
+
+void VMM::RemoveRegionFromArray(VMMRegion *region, VMMRegion *array) {
+	VMMRegionArrayIndex *index = GetArrayIndex(array);
+	uint32_t node = region - array + 1;
+
+	if (array == regions && region->type == VMM_REGION_FREE) {
+		RemoveFreeRegion(region);
+	}
+
+	index->tree = RegionTreeRemove(array, index->tree, node, false);
+	region->used = false;
+	region->addressLinks.left = index->firstUnused;
+	index->firstUnused = node;
+}
+
+void VMM::InsertFreeRegion(VMMRegion *region) {
+	freeRegionsTree = RegionTreeInsert(regions, freeRegionsTree, region - regions + 1, true);
+}
+
+void VMM::RemoveFreeRegion(VMMRegion *region) {
+	freeRegionsTree = RegionTreeRemove(regions, freeRegionsTree, region - regions + 1, true);
+}
+
+VMMRegion *VMM::FindFreeRegion(size_t pageCount) {
+	uint32_t node = freeRegionsTree;
+	VMMRegion *found = nullptr;
+
+	while (node) {
+		VMMRegion *region = regions + node - 1;
+
+		if (region->pageCount > pageCount) {
+			found = region;
+			node = region->sizeLinks.left;
 		} else {
-			if (arrayAllocated) {
-				size_t oldAllocated = arrayAllocated;
-				arrayAllocated = oldAllocated * 2;
-				VMMRegion *old = array;
-				array = (VMMRegion *) memoryManagerVMM.Allocate("VMM", arrayAllocated * sizeof(VMMRegion), VMM_MAP_ALL); 
-				CopyMemory(array, old, oldAllocated * sizeof(VMMRegion));
-				memoryManagerVMM.Free(old); 
+			node = region->sizeLinks.right;
+		}
+	}
+
+	return found;
+}
+
+uintptr_t VMM::FindEmptySpaceInRegionArray(VMMRegion *region, VMMRegion *&array, size_t &arrayAllocated) {
+	VMMRegion copy = *region; // The region might be in the array, which could be reallocated.
+	VMMRegionArrayIndex *index = GetArrayIndex(array);
+	uintptr_t regionIndex;
+
+	if (index->firstUnused) {
+		regionIndex = index->firstUnused - 1;
+		index->firstUnused = array[regionIndex].addressLinks.left;
+	} else {
+		if (index->highWater == arrayAllocated) {
+			if (this == &kernelVMM) {
+				KernelPanic("VMM::FindEmptySpaceInRegionArray - Maximum kernel VMM regions (%d) exceeded\n", arrayAllocated);
 			} else {
-				arrayAllocated = 256;
-				array = (VMMRegion *) memoryManagerVMM.Allocate("VMM", arrayAllocated * sizeof(VMMRegion), VMM_MAP_ALL); 
+				if (arrayAllocated) {
+					size_t oldAllocated = arrayAllocated;
+					arrayAllocated = oldAllocated * 2;
+					VMMRegion *old = array;
+					array = (VMMRegion *) memoryManagerVMM.Allocate("VMM", arrayAllocated * sizeof(VMMRegion), VMM_MAP_ALL); 
+					CopyMemory(array, old, oldAllocated * sizeof(VMMRegion));
+					memoryManagerVMM.Free(old); 
+				} else {
+					arrayAllocated = 256;
+					array = (VMMRegion *) memoryManagerVMM.Allocate("VMM", arrayAllocated * sizeof(VMMRegion), VMM_MAP_ALL); 
+				}
 			}
 		}
 
-		goto retry;
+		regionIndex = index->highWater++;
 	}
 
-	array[regionIndex] = *region;
+	array[regionIndex] = copy;
 	array[regionIndex].used = true;
+	array[regionIndex].addressLinks = {};
+	array[regionIndex].sizeLinks = {};
 
 	return regionIndex;
 }
 
 bool VMM::AddRegion(uintptr_t baseAddress, size_t pageCount, uintptr_t offset, VMMRegionType type, VMMMapPolicy mapPolicy, unsigned flags, void *object) {
-	lock.AssertLocked();
+	lock.AssertExclusive();
 
-	if (FindRegion(baseAddress, regions, regionsAllocated)) {
+	if (FindRegion(baseAddress, regions)) {
 		// This new region intersects an already existing region.
 		// Fail.
 		return false;
@@ -473,13 +812,16 @@ bool VMM::AddRegion(uintptr_t baseAddress, size_t pageCount, uintptr_t offset, V
 	{
 		VMMRegion *region = regions + regionIndex;
 		region->item.thisItem = region;
+		InsertRegionIntoArray(region, regions);
+		if (type == VMM_REGION_FREE) InsertFreeRegion(region);
 
 		// Print("Created region %x\n", region);
 	}
 
 	if (type != VMM_REGION_FREE && mapPolicy != VMM_MAP_ALL) {
 		uintptr_t lookupRegionIndex = FindEmptySpaceInRegionArray(&region, lookupRegions, lookupRegionsAllocated);
-		MergeIdenticalAdjacentRegions(lookupRegions + lookupRegionIndex, lookupRegions, lookupRegionsAllocated);
+		InsertRegionIntoArray(lookupRegions + lookupRegionIndex, lookupRegions);
+		MergeIdenticalAdjacentRegions(lookupRegions + lookupRegionIndex, lookupRegions);
 	}
 
 	if (type == VMM_REGION_SHARED) {
@@ -524,8 +866,8 @@ void *VMM::Allocate(const char *reason, size_t size, VMMMapPolicy mapPolicy, VMM
 #endif
 
 		{
-			vmm->lock.Acquire();
-			Defer(vmm->lock.Release());
+			vmm->lock.AcquireShared();
+			Defer(vmm->lock.ReleaseShared());
 
 			FaultInformation fault = {};
 			if (!vmm->HandlePageFault(offset, pageCount, false, &fault) || !fault.Handle()) {
@@ -561,8 +903,8 @@ void *VMM::Allocate(const char *reason, size_t size, VMMMapPolicy mapPolicy, VMM
 		}
 	}
 
-	lock.Acquire();
-	Defer(lock.Release());
+	lock.AcquireExclusive();
+	Defer(lock.ReleaseExclusive());
 
 #if 0
 	if (type == VMM_REGION_STANDARD) {
@@ -579,25 +921,49 @@ void *VMM::Allocate(const char *reason, size_t size, VMMMapPolicy mapPolicy, VMM
 	void *address;
 	bool success;
 
-	if (!baseAddress) {
-		// TODO Should we look for the smallest/largest/first/last/etc. region?
-		uintptr_t i = 0;
-
-		for (; i < regionsAllocated; i++) {
-			if (regions[i].used && regions[i].type == VMM_REGION_FREE
-					&& regions[i].pageCount > pageCount) {
-				break;
+	if (!baseAddress && mapPolicy == VMM_MAP_ALL && pageCount >= (LARGE_PAGE_SIZE >> PAGE_BITS)
+			&& (type == VMM_REGION_STANDARD || type == VMM_REGION_PHYSICAL) && !(flags & VMM_REGION_FLAG_OVERWRITABLE)) {
+		// Align the region so that it can be mapped with large pages.
+		// Physical regions must have the same offset into a large page as their physical address.
+		uintptr_t largePageOffset = type == VMM_REGION_PHYSICAL ? (offset & (LARGE_PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) : 0;
+
+		// Look for a free region big enough for any amount of padding.
+		region = FindFreeRegion(pageCount + (LARGE_PAGE_SIZE >> PAGE_BITS));
+
+		if (region) {
+			uintptr_t alignedAddress = region->baseAddress + ((largePageOffset - region->baseAddress) & (LARGE_PAGE_SIZE - 1));
+			size_t paddingPages = (alignedAddress - region->baseAddress) >> PAGE_BITS;
+			baseAddress = alignedAddress;
+			RemoveFreeRegion(region);
+
+			if (paddingPages) {
+				// Keep the padding free, and add a free region after the allocation.
+				uintptr_t remainingAddress = alignedAddress + (pageCount << PAGE_BITS);
+				size_t remainingPages = region->pageCount - paddingPages - pageCount;
+				region->pageCount = paddingPages;
+				InsertFreeRegion(region);
+				AddRegion(remainingAddress, remainingPages, 0, VMM_REGION_FREE, VMM_MAP_LAZY, VMM_REGION_FLAG_CACHABLE, nullptr);
+			} else {
+				region->baseAddress += pageCount << PAGE_BITS;
+				region->pageCount -= pageCount;
+				InsertFreeRegion(region);
 			}
 		}
+	}
+
+	if (!baseAddress) {
+		// Use the smallest free region that fits.
+		region = FindFreeRegion(pageCount);
 
-		if (i == regionsAllocated) {
+		if (!region) {
 			goto failure;
 		}
 
-		region = regions + i;
 		baseAddress = region->baseAddress;
+		RemoveFreeRegion(region);
 		region->baseAddress += pageCount << PAGE_BITS;
 		region->pageCount -= pageCount;
+		InsertFreeRegion(region);
 	}
 
 	success = AddRegion(baseAddress, pageCount, offset & ~(PAGE_SIZE - 1), type, mapPolicy, flags, object);
@@ -611,46 +977,49 @@ void *VMM::Allocate(const char *reason, size_t size, VMMMapPolicy mapPolicy, VMM
 	return nullptr;
 }
 
-void VMM::MergeIdenticalAdjacentRegions(VMMRegion *region, VMMRegion *array, size_t arrayAllocated) {
-	lock.AssertLocked();
+static bool CanMergeRegions(VMMRegion *region, VMMRegion *r) {
+	if (!r) return false;
+	if (r->type != region->type) return false;
 
-	intptr_t remove1 = -1, remove2 = -1;
+	if (r->type != VMM_REGION_STANDARD && r->type != VMM_REGION_FREE) {
+		// We can only merge standard and free regions.
+		return false;
+	}
 
-	for (uintptr_t i = 0; i < arrayAllocated && (remove1 != -1 || remove2 != 1); i++) {
-		VMMRegion *r = array + i;
+	if (r->type == VMM_REGION_STANDARD) {
+		if (r->mapPolicy != region->mapPolicy) return false;
+		if (r->offset != region->offset) return false;
+		if (r->flags != region->flags) return false;
+		if (r->object != region->object) return false;
+	}
 
-		if (!r->used) continue;
-		if (r->type != region->type) continue;
-		if (r == region) continue;
+	return true;
+}
 
-		if (r->type != VMM_REGION_STANDARD && r->type != VMM_REGION_FREE) {
-			// We can only merge standard and free regions.
-			continue;
-		}
+void VMM::MergeIdenticalAdjacentRegions(VMMRegion *region, VMMRegion *array) {
+	lock.AssertExclusive();
 
-		if (r->type == VMM_REGION_STANDARD) {
-			if (r->mapPolicy != region->mapPolicy) continue;
-			if (r->offset != region->offset) continue;
-			if (r->flags != region->flags) continue;
-			if (r->object != region->object) continue;
-		}
+	// Regions don't overlap, so the regions containing the addresses either side of this one must be adjacent.
+	VMMRegion *next = FindRegion(region->baseAddress + (region->pageCount << PAGE_BITS), array);
+	VMMRegion *previous = region->baseAddress ? FindRegion(region->baseAddress - 1, array) : nullptr;
 
-		if (r->baseAddress == region->baseAddress + (region->pageCount << PAGE_BITS)) {
-			region->pageCount += r->pageCount;
-			remove1 = i;
-		} else if (region->baseAddress == r->baseAddress + (r->pageCount << PAGE_BITS)){ 
-			region->pageCount += r->pageCount;
-			region->baseAddress = r->baseAddress;
-			remove2 = i;
-		}
+	if (CanMergeRegions(region, next)) {
+		size_t pageCount = next->pageCount;
+		RemoveRegionFromArray(next, array);
+		region->pageCount += pageCount;
 	}
 
-	if (remove1 != -1) array[remove1].used = false;
-	if (remove2 != -1) array[remove2].used = false;
+	if (CanMergeRegions(region, previous)) {
+		uintptr_t baseAddress = previous->baseAddress;
+		size_t pageCount = previous->pageCount;
+		RemoveRegionFromArray(previous, array);
+		region->pageCount += pageCount;
+		region->baseAddress = baseAddress;
+	}
 }
 
-void VMM::SplitRegion(VMMRegion *region, uintptr_t address, bool keepAbove, VMMRegion *array, size_t &arrayAllocated) {
-	lock.AssertLocked();
+void VMM::SplitRegion(VMMRegion *&region, uintptr_t address, bool keepAbove, VMMRegion *&array, size_t &arrayAllocated) {
+	lock.AssertExclusive();
 
 	if (region->baseAddress == address) {
 		return;
@@ -660,17 +1029,21 @@ void VMM::SplitRegion(VMMRegion *region, uintptr_t address, bool keepAbove, VMMR
 		return;
 	}
 
-	VMMRegion *newRegion = array + FindEmptySpaceInRegionArray(region, array, arrayAllocated);
+	uintptr_t regionIndex = region - array;
+	uintptr_t newRegionIndex = FindEmptySpaceInRegionArray(region, array, arrayAllocated);
+	region = array + regionIndex; // The array may have been reallocated.
+
+	VMMRegion *lower = region, *upper = array + newRegionIndex;
 
 	if (keepAbove) {
-		VMMRegion *t = newRegion;
-		newRegion = region;
-		region = t;
+		lower = upper;
+		upper = region;
 	}
 
-	newRegion->baseAddress = address;
-	newRegion->pageCount -= (address - region->baseAddress) >> PAGE_BITS;
-	region->pageCount -= newRegion->pageCount;
+	upper->baseAddress = address;
+	upper->pageCount -= (address - lower->baseAddress) >> PAGE_BITS;
+	lower->pageCount -= upper->pageCount;
+	InsertRegionIntoArray(array + newRegionIndex, array);
 }
 
 void CloseHandleToSharedMemoryRegionAfterVMMFree(void *argument) {
@@ -700,16 +1073,16 @@ OSError VMM::Free(void *address, void **object, VMMRegionType *type, bool skipVi
 
 	ValidateCurrentVMM(this);
 
-	lock.Acquire();
+	lock.AcquireExclusive();
 
 	uintptr_t baseAddress = (uintptr_t) address;
-	VMMRegion *region = FindRegion(baseAddress, regions, regionsAllocated);
+	VMMRegion *region = FindRegion(baseAddress, regions);
 
 	if (!region) {
-		lock.Release();
+		lock.ReleaseExclusive();
 		return OS_FATAL_ERROR_INVALID_MEMORY_REGION;
 	} else if (region->lock) {
-		lock.Release();
+		lock.ReleaseExclusive();
 		return OS_FATAL_ERROR_MEMORY_REGION_LOCKED_BY_KERNEL;
 	} else if (region->type == VMM_REGION_FREE) {
 		KernelPanic("VMM::Free - Trying to free region that has already been freed.\n");
@@ -765,10 +1138,6 @@ OSError VMM::Free(void *address, void **object, VMMRegionType *type, bool skipVi
 		virtualAddressSpace->lock.Acquire();
 		Defer(virtualAddressSpace->lock.Release());
 
-		// The PMM lock must be acquired after the virtual address space lock.
-		pmm.lock.Acquire();
-		Defer(pmm.lock.Release());
-
 		for (uintptr_t address = region->baseAddress;
 				address < region->baseAddress + (region->pageCount << PAGE_BITS);
 				address += PAGE_SIZE) {
@@ -780,6 +1149,13 @@ OSError VMM::Free(void *address, void **object, VMMRegionType *type, bool skipVi
 				continue;
 			}
 
+			if (flags & VAS_LARGE_PAGE) {
+				// Large pages are only used for standard and physical regions that cover the whole page.
+				if (region->type == VMM_REGION_STANDARD) pmm.FreeContiguous(mappedAddress, LARGE_PAGE_SIZE);
+				address += LARGE_PAGE_SIZE - PAGE_SIZE;
+				continue;
+			}
+
 			if (mappedAddress) {
 				switch (region->type) {
 					case VMM_REGION_STANDARD: {
@@ -824,22 +1200,23 @@ OSError VMM::Free(void *address, void **object, VMMRegionType *type, bool skipVi
 	VMMMapPolicy mapPolicy = region->mapPolicy;
 
 	if (mapPolicy != VMM_MAP_ALL) {
-		VMMRegion *lookupRegion = FindRegion(baseAddress, lookupRegions, lookupRegionsAllocated);
+		VMMRegion *lookupRegion = FindRegion(baseAddress, lookupRegions);
 		SplitRegion(lookupRegion, baseAddress, true, lookupRegions, lookupRegionsAllocated);
 		SplitRegion(lookupRegion, baseAddress + (regionPageCount << PAGE_BITS), false, lookupRegions, lookupRegionsAllocated);
-		lookupRegion->used = false;
+		RemoveRegionFromArray(lookupRegion, lookupRegions);
 	}
 
 	region->type = VMM_REGION_FREE;
-	MergeIdenticalAdjacentRegions(region, regions, regionsAllocated);
+	MergeIdenticalAdjacentRegions(region, regions);
+	InsertFreeRegion(region);
 
-	lock.Release();
+	lock.ReleaseExclusive();
 
 	if (copyReference) {
-		copyReference->vmm->lock.Acquire();
+		copyReference->vmm->lock.AcquireShared();
 		VMMRegion *region2 = copyReference->vmm->regions + copyReference->index;
 		__sync_fetch_and_sub(&region2->lock, 1);
-		copyReference->vmm->lock.Release();
+		copyReference->vmm->lock.ReleaseShared();
 		OSHeapFree(copyReference, 0, MMVMM_HEAP); 
 	}
 
@@ -850,8 +1227,47 @@ OSError VMM::Free(void *address, void **object, VMMRegionType *type, bool skipVi
 	return OS_SUCCESS;
 }
 
+static bool MapIfUnmapped(VirtualAddressSpace *virtualAddressSpace, uintptr_t physicalAddress, uintptr_t virtualAddress, unsigned flags) {
+	// Since page faults only acquire the VMM's lock shared, 
+	// another thread might have mapped the page since we checked.
+	virtualAddressSpace->lock.Acquire();
+	Defer(virtualAddressSpace->lock.Release());
+	if (virtualAddressSpace->Get(virtualAddress)) return false;
+	virtualAddressSpace->Map(physicalAddress, virtualAddress, flags);
+	return true;
+}
+
+static bool MapLargePageInRegion(VirtualAddressSpace *virtualAddressSpace, uintptr_t address, VMMRegion *region) {
+	// Large pages are used for regions that are mapped all at once and cover the whole large page.
+	if (region->mapPolicy != VMM_MAP_ALL || (region->flags & VMM_REGION_FLAG_OVERWRITABLE)) return false;
+	if (region->type != VMM_REGION_STANDARD && region->type != VMM_REGION_PHYSICAL) return false;
+	if ((address & (LARGE_PAGE_SIZE - 1)) || address + LARGE_PAGE_SIZE > region->baseAddress + (region->pageCount << PAGE_BITS)) return false;
+
+	uintptr_t physicalAddress;
+
+	if (region->type == VMM_REGION_PHYSICAL) {
+		physicalAddress = address - region->baseAddress + region->offset;
+		if (physicalAddress & (LARGE_PAGE_SIZE - 1)) return false;
+	} else {
+		// If physical memory is too fragmented, the caller falls back to normal pages.
+		physicalAddress = pmm.AllocateContiguous(LARGE_PAGE_SIZE);
+		if (!physicalAddress) return false;
+		ZeroPhysicalMemory(physicalAddress, LARGE_PAGE_SIZE >> PAGE_BITS);
+	}
+
+	virtualAddressSpace->lock.Acquire();
+	bool mapped = virtualAddressSpace->MapLarge(physicalAddress, address, region->flags);
+	virtualAddressSpace->lock.Release();
+
+	if (!mapped && region->type == VMM_REGION_STANDARD) {
+		pmm.FreeContiguous(physicalAddress, LARGE_PAGE_SIZE);
+	}
+
+	return mapped;
+}
+
 bool VMM::HandlePageFaultInRegion(uintptr_t page, VMMRegion *region, size_t limit, FaultInformation *fault) {
-	lock.AssertLocked();
+	lock.AssertShared();
 
 	uintptr_t postCount;
 
@@ -903,54 +1319,54 @@ bool VMM::HandlePageFaultInRegion(uintptr_t page, VMMRegion *region, size_t limi
 			continue;
 		}
 
+		if (MapLargePageInRegion(virtualAddressSpace, address, region)) {
+			address += LARGE_PAGE_SIZE - PAGE_SIZE;
+			i += (LARGE_PAGE_SIZE >> PAGE_BITS) - 1;
+			continue;
+		}
+
 		switch (region->type) {
 			case VMM_REGION_STANDARD: {
 				uintptr_t physicalPage = pmm.AllocatePage(true);
-				virtualAddressSpace->lock.Acquire();
-				virtualAddressSpace->Map(physicalPage, address, region->flags);
-				virtualAddressSpace->lock.Release();
+
+				if (!MapIfUnmapped(virtualAddressSpace, physicalPage, address, region->flags)) {
+					pmm.FreePage(physicalPage);
+				}
 			} break;
 
 			case VMM_REGION_PHYSICAL: {
-				virtualAddressSpace->lock.Acquire();
-				virtualAddressSpace->Map(address - region->baseAddress + region->offset, address, region->flags);
-				virtualAddressSpace->lock.Release();
+				MapIfUnmapped(virtualAddressSpace, address - region->baseAddress + region->offset, address, region->flags);
 			} break;
 
 			case VMM_REGION_SHARED: {
 				SharedMemoryRegion *sharedRegion = (SharedMemoryRegion *) region->object;
 				sharedRegion->mutex.AssertLocked();
 
-				uintptr_t *volatile addresses = (uintptr_t *) (sharedRegion->data);
-				uintptr_t index;
-
 				uintptr_t base = (address - region->baseAddress + region->offset);
-
-				if (sharedRegion->big) {
-					uintptr_t group = base / BIG_SHARED_MEMORY;
-
-					if (!addresses[group]) {
-						addresses[group] = (uintptr_t) OSHeapAllocate(BIG_SHARED_MEMORY / PAGE_SIZE * sizeof(uintptr_t), false, MMVMM_HEAP); 
-						ZeroMemory((void *) addresses[group], BIG_SHARED_MEMORY / PAGE_SIZE * sizeof(uintptr_t));
-					}
-
-					addresses = (uintptr_t *) addresses[group];
-					index = (base % BIG_SHARED_MEMORY) >> PAGE_BITS;
-				} else {
-					index = base >> PAGE_BITS;
-				}
+				uintptr_t *entry = sharedMemoryManager.GetPageEntry(sharedRegion, base, true);
 
 				bool readInBlock = false;
 
-				if (addresses[index] & SHARED_ADDRESS_PRESENT) {
+				if (*entry & SHARED_ADDRESS_PRESENT) {
 					virtualAddressSpace->lock.Acquire();
-					virtualAddressSpace->Map(addresses[index], address, region->flags);
+					virtualAddressSpace->Map(*entry, address, region->flags);
 					virtualAddressSpace->lock.Release();
+
+					if (sharedRegion->node && !limit && !i) {
+						sharedRegion->node->UpdateReadahead(base, postCount << PAGE_BITS);
+					}
+				} else if ((*entry & SHARED_ADDRESS_READAHEAD) && fault && !limit) {
+					// The page is already being read; don't read it again.
+					if (!i) {
+						fault->type = FAULT_TYPE_WAIT;
+						fault->region = sharedRegion;
+						return true;
+					}
 				} else {
 					if (sharedRegion->node) {
 						// This is a memory mapped file.
 						// Let's read in the file.
-						addresses[index] = SHARED_ADDRESS_READING;
+						*entry = SHARED_ADDRESS_READING;
 						readInBlock = true;
 					} else {
 						// NOTE Duplicated from above.
@@ -960,7 +1376,7 @@ bool VMM::HandlePageFaultInRegion(uintptr_t page, VMMRegion *region, size_t limi
 						virtualAddressSpace->lock.Release();
 
 						// Store the address.
-						addresses[index] = physicalPage | SHARED_ADDRESS_PRESENT;
+						*entry = physicalPage | SHARED_ADDRESS_PRESENT;
 					}
 				}
 
@@ -969,7 +1385,6 @@ bool VMM::HandlePageFaultInRegion(uintptr_t page, VMMRegion *region, size_t limi
 					fault->type = FAULT_TYPE_READ;
 					fault->region = sharedRegion;
 					fault->offset = base;
-					fault->sharedAddresses = addresses + index;
 					fault->destination = (void *) address;
 					fault->regionFlags = region->flags;
 					fault->addressSpace = virtualAddressSpace;
@@ -982,16 +1397,14 @@ bool VMM::HandlePageFaultInRegion(uintptr_t page, VMMRegion *region, size_t limi
 				uintptr_t physicalAddress = virtualAddressSpace->Get(address - region->baseAddress + region->offset);
 				// KernelLog(LOG_VERBOSE, "VMM_REGION_COPY: %x\n", physicalAddress);
 				if (!physicalAddress) KernelPanic("VMM::HandlePageFaultInRegion - Copy region page (%x/%x) was unmapped.\n", address, address - region->baseAddress + region->offset);
-				virtualAddressSpace->Map(physicalAddress, address, region->flags);
+				if (!virtualAddressSpace->Get(address)) virtualAddressSpace->Map(physicalAddress, address, region->flags);
 				virtualAddressSpace->lock.Release();
 				// KernelLog(LOG_VERBOSE, "VMM_REGION_COPY: %x (from %x) -> %x\n", physicalAddress, address - region->baseAddress + region->offset, address);
 			} break;
 
 			case VMM_REGION_HANDLE_TABLE: {
 				// This means we're trying to access an invalid handle.
-				virtualAddressSpace->lock.Acquire();
-				virtualAddressSpace->Map(emptyHandlePage, address, region->flags);
-				virtualAddressSpace->lock.Release();
+				MapIfUnmapped(virtualAddressSpace, emptyHandlePage, address, region->flags);
 			} break;
 
 			default: {
@@ -1003,18 +1416,28 @@ bool VMM::HandlePageFaultInRegion(uintptr_t page, VMMRegion *region, size_t limi
 	return true;
 }
 
-VMMRegion *VMM::FindRegion(uintptr_t address, VMMRegion *array, size_t arrayAllocated) {
-	lock.AssertLocked();
+VMMRegion *VMM::FindRegion(uintptr_t address, VMMRegion *array) {
+	lock.AssertShared();
+
+	// Find the last region that starts at or before the address.
+	uint32_t node = GetArrayIndex(array)->tree;
+	VMMRegion *found = nullptr;
 
-	for (uintptr_t i = 0; i < arrayAllocated; i++) {
-		VMMRegion *region = array + i;
+	while (node) {
+		VMMRegion *region = array + node - 1;
 
-		if (region->used && region->baseAddress <= address
-				&& region->baseAddress + (region->pageCount << PAGE_BITS) > address) {
-			return region;
+		if (region->baseAddress <= address) {
+			found = region;
+			node = region->addressLinks.right;
+		} else {
+			node = region->addressLinks.left;
 		}
 	}
 
+	if (found && found->baseAddress + (found->pageCount << PAGE_BITS) > address) {
+		return found;
+	}
+
 	return nullptr;
 }
 
@@ -1023,10 +1446,10 @@ VMMRegionReference VMM::FindAndLockRegion(uintptr_t address, size_t size) {
 
 	if (!address) return reference;
 
-	lock.Acquire();
-	Defer(lock.Release());
+	lock.AcquireShared();
+	Defer(lock.ReleaseShared());
 
-	VMMRegion *region = FindRegion(address, regions, regionsAllocated);
+	VMMRegion *region = FindRegion(address, regions);
 
 	if (!region) {
 		return reference;
@@ -1057,8 +1480,8 @@ void VMM::UnlockRegion(VMMRegionReference reference) {
 		KernelPanic("VMM::UnlockRegion - Region reference VMM mismatch.\n");
 	}
 
-	lock.Acquire();
-	Defer(lock.Release());
+	lock.AcquireShared();
+	Defer(lock.ReleaseShared());
 
 	VMMRegion *region = regions + reference.index;
 
@@ -1070,15 +1493,15 @@ void VMM::UnlockRegion(VMMRegionReference reference) {
 }
 
 bool VMM::HandlePageFault(uintptr_t address, size_t limit, bool lookupRegionsOnly, FaultInformation *fault) {
-	lock.AssertLocked();
+	lock.AssertShared();
 
 	uintptr_t page = address & ~(PAGE_SIZE - 1);
 	VMMRegion *region;
 
 	if (lookupRegionsOnly) {
-		region = FindRegion(address, lookupRegions, lookupRegionsAllocated);
+		region = FindRegion(address, lookupRegions);
 	} else {
-		region = FindRegion(address, regions, regionsAllocated);
+		region = FindRegion(address, regions);
 	}
 
 	if (region) {
@@ -1121,8 +1544,14 @@ bool FaultInformation::Handle() {
 
 	uintptr_t count = MM_FILE_CHUNK_BYTES;
 	if (count > maxCount) count = maxCount;
-	void *readBuffer = OSHeapAllocate(count, false);
-	Defer(OSHeapFree(readBuffer));
+	uintptr_t pages[MM_FILE_CHUNK_PAGES];
+	uint8_t *window;
+
+	if (type == FAULT_TYPE_WAIT) {
+		// Wait for the readahead to finish, and then let the fault be retried.
+		readahead.done.Wait(OS_WAIT_NO_TIMEOUT);
+		goto done;
+	}
 
 	if (type == FAULT_TYPE_WRITE) {
 		result = false;
@@ -1162,6 +1591,19 @@ bool FaultInformation::Handle() {
 		goto done;
 	}
 
+	// Read the file directly into the pages that will be mapped, through a window in the kernel's address space.
+	// The pages don't need to be zeroed, since the read and the zeroing past the end of the file cover them.
+	for (uintptr_t i = 0; i < count / PAGE_SIZE; i++) {
+		pages[i] = pmm.AllocatePage(false);
+	}
+
+	window = (uint8_t *) MapPhysicalPages(pages, count / PAGE_SIZE);
+
+	if (!window) {
+		result = false;
+		goto freePages;
+	}
+
 	{
 		IORequest *request = (IORequest *) ioRequestPool.Add();
 		request->handles = 1;
@@ -1169,7 +1611,7 @@ bool FaultInformation::Handle() {
 		request->node = region->node;
 		request->offset = offset;
 		request->count = count;
-		request->buffer = readBuffer;
+		request->buffer = window;
 		request->Start();
 		request->complete.Wait(OS_WAIT_NO_TIMEOUT);
 
@@ -1178,29 +1620,38 @@ bool FaultInformation::Handle() {
 		result = error == OS_SUCCESS;
 
 		if (result) {
-			ZeroMemory((char *) readBuffer + request->count, count - request->count);
+			ZeroMemory(window + request->count, count - request->count);
 		}
 	}
 
-	if (!result) {
-		goto done;
-	}
+	kernelVMM.Free(window);
 
-	region->mutex.Acquire();
+	if (result) {
+		region->mutex.Acquire();
 
-	if (sharedAddresses[0] & SHARED_ADDRESS_READING) {
 		for (uintptr_t i = 0; i < count / PAGE_SIZE; i++) {
-			uintptr_t physicalPage = pmm.AllocatePage(true);
-			CopyIntoPhysicalMemory(physicalPage, (char *) readBuffer + i * PAGE_SIZE, 1);
-			sharedAddresses[i] = SHARED_ADDRESS_PRESENT | physicalPage;
+			// Only fill the pages that are still waiting for this read;
+			// the others might have been written, or read by someone else, in the meantime.
+			uintptr_t pageOffset = offset + i * PAGE_SIZE;
+			uintptr_t *entry = pageOffset < region->sizeBytes ? sharedMemoryManager.GetPageEntry(region, pageOffset, false) : nullptr;
+			if (!entry || *entry != SHARED_ADDRESS_READING) continue;
+
+			*entry = SHARED_ADDRESS_PRESENT | pages[i];
+			pages[i] = 0;
 
 			addressSpace->lock.Acquire();
-			addressSpace->Map(sharedAddresses[i], (uintptr_t) destination + i * PAGE_SIZE, regionFlags);
+			addressSpace->Map(*entry, (uintptr_t) destination + i * PAGE_SIZE, regionFlags);
 			addressSpace->lock.Release();
 		}
+
+		region->mutex.Release();
 	}
 
-	region->mutex.Release();
+	freePages:;
+
+	for (uintptr_t i = 0; i < count / PAGE_SIZE; i++) {
+		if (pages[i]) pmm.FreePage(pages[i]);
+	}
 
 	done:;
 	if (!result) KernelLog(LOG_WARNING, "FaultInformation::Handle - Could not load memory mapped file section.\n");
@@ -1292,9 +1743,9 @@ bool HandlePageFault(uintptr_t page, bool write) {
 	{
 		FaultInformation fault = {};
 		fault.wantWriteAccess = write;
-		vmm->lock.Acquire();
+		vmm->lock.AcquireShared();
 		bool result = vmm->HandlePageFault(page, 0, true, &fault);
-		vmm->lock.Release();
+		vmm->lock.ReleaseShared();
 		if (!result) return false;
 		result = fault.Handle();
 		return result;
@@ -1302,60 +1753,299 @@ bool HandlePageFault(uintptr_t page, bool write) {
 }
 #endif
 
-uintptr_t PMM::AllocateContiguous64KB() {
-	lock.Acquire();
-	Defer(lock.Release());
+inline bool BuddyIsFree(BuddyChunk *chunk, uintptr_t node) {
+	return chunk->free[node >> 6] & ((uint64_t) 1 << (node & 63));
+}
 
-	pagesAllocated += 65536 >> PAGE_BITS;
+inline void BuddySetFree(BuddyChunk *chunk, uintptr_t node, bool free) {
+	if (free) chunk->free[node >> 6] |= (uint64_t) 1 << (node & 63);
+	else chunk->free[node >> 6] &= ~((uint64_t) 1 << (node & 63));
+}
 
-	uintptr_t index = dirty.Get(65536 >> PAGE_BITS);
-	if (index == (uintptr_t) -1) index = zeroed.Get(65536 >> PAGE_BITS);
+inline uintptr_t BuddyFirstNode(uintptr_t order) {
+	return (uintptr_t) 1 << (BUDDY_MAX_ORDER - order);
+}
 
-	if (index != (uintptr_t) -1) {
-		index <<= PAGE_BITS;
-		return index;
-	} else {
-		return 0;
+uintptr_t BuddyFindFree(BuddyChunk *chunk, uintptr_t order) {
+	// Returns 0 if there are no free blocks of this order in the chunk.
+	uintptr_t first = BuddyFirstNode(order), last = first << 1;
+
+	for (uintptr_t node = first; node < last; node = (node | 63) + 1) {
+		uint64_t word = chunk->free[node >> 6] >> (node & 63);
+
+		if (word) {
+			node += __builtin_ctzll(word);
+			return node < last ? node : 0;
+		}
 	}
+
+	return 0;
 }
 
-uintptr_t PMM::AllocateContiguous128KB() {
-	lock.Acquire();
-	Defer(lock.Release());
+uintptr_t PMM::BuddyTakeChunk() {
+	lock.AssertLocked();
 
-	pagesAllocated += 131072 >> PAGE_BITS;
+	// Look for a naturally aligned run of free pages in the bitsets.
+	// Its pages can be split between the zeroed and dirty bitsets.
 
-	uintptr_t index = dirty.Get(131072 >> PAGE_BITS);
-	if (index == (uintptr_t) -1) index = zeroed.Get(131072 >> PAGE_BITS);
+	size_t chunkWords = (1 << BUDDY_MAX_ORDER) / 32, groupWords = BITSET_GROUP_SIZE / 32;
+	size_t wordCount = dirty.singleCount >> 5;
 
-	if (index != (uintptr_t) -1) {
-		index <<= PAGE_BITS;
-		return index;
-	} else {
-		return 0;
+	for (uintptr_t group = 0; group < dirty.groupCount; group++) {
+		if ((size_t) dirty.groupUsage[group] + zeroed.groupUsage[group] < (1 << BUDDY_MAX_ORDER)) {
+			continue;
+		}
+
+		for (uintptr_t word = group * groupWords; word < (group + 1) * groupWords && word + chunkWords <= wordCount; word += chunkWords) {
+			bool allFree = true;
+
+			for (uintptr_t i = word; i < word + chunkWords && allFree; i++) {
+				if ((dirty.singleUsage[i] | zeroed.singleUsage[i]) != (uint32_t) -1) {
+					allFree = false;
+				}
+			}
+
+			if (!allFree) continue;
+
+			for (uintptr_t i = word; i < word + chunkWords; i++) {
+				dirty.groupUsage[group] -= __builtin_popcount(dirty.singleUsage[i]);
+				zeroed.groupUsage[group] -= __builtin_popcount(zeroed.singleUsage[i]);
+				dirty.singleUsage[i] = zeroed.singleUsage[i] = 0;
+			}
+
+			return (word * 32) << PAGE_BITS;
+		}
 	}
+
+	return 0;
 }
 
-uintptr_t PMM::AllocatePage(bool zeroPage) {
-	uintptr_t returnValue = 0;
-	lock.Acquire();
-	pagesAllocated++;
+uintptr_t PMM::BuddyAllocate(uintptr_t order) {
+	lock.AssertLocked();
 
-	if (physicalMemoryRegionsPagesCount) {
-		uintptr_t i = physicalMemoryRegionsIndex;
+	BuddyChunk *chunk = nullptr;
+	uintptr_t node = 0, nodeOrder;
 
-		while (!physicalMemoryRegions[i].pageCount) {
-			i++;
+	// Find the smallest free block that is large enough.
 
-			if (i == physicalMemoryRegionsCount) {
-				KernelPanic("PMM::AllocatePhysicalPage - expected more pages in physical regions");
-			}
+	for (nodeOrder = order; nodeOrder <= BUDDY_MAX_ORDER && !node; nodeOrder++) {
+		for (uintptr_t i = 0; i < BUDDY_MAX_CHUNKS && !node; i++) {
+			chunk = buddyChunks + i;
+			if (chunk->base) node = BuddyFindFree(chunk, nodeOrder);
 		}
+	}
 
-		PhysicalMemoryRegion *region = physicalMemoryRegions + i;
-		returnValue = region->baseAddress;
+	nodeOrder--;
 
-		region->baseAddress += PAGE_SIZE;
+	if (!node) {
+		// Take a new chunk from the bitsets.
+
+		chunk = nullptr;
+
+		for (uintptr_t i = 0; i < BUDDY_MAX_CHUNKS && !chunk; i++) {
+			if (!buddyChunks[i].base) chunk = buddyChunks + i;
+		}
+
+		if (!chunk) return 0;
+		chunk->base = BuddyTakeChunk();
+		if (!chunk->base) return 0;
+
+		ZeroMemory(chunk->free, sizeof(chunk->free));
+		node = 1, nodeOrder = BUDDY_MAX_ORDER;
+	}
+
+	// Split the block until it is the right size, freeing the other halves.
+
+	BuddySetFree(chunk, node, false);
+
+	while (nodeOrder > order) {
+		node <<= 1, nodeOrder--;
+		BuddySetFree(chunk, node + 1, true);
+	}
+
+	return chunk->base + ((node - BuddyFirstNode(order)) << (order + PAGE_BITS));
+}
+
+void PMM::BuddyFree(uintptr_t address, uintptr_t order) {
+	lock.AssertLocked();
+
+	BuddyChunk *chunk = nullptr;
+
+	for (uintptr_t i = 0; i < BUDDY_MAX_CHUNKS && !chunk; i++) {
+		if (buddyChunks[i].base && address >= buddyChunks[i].base
+				&& address < buddyChunks[i].base + (PAGE_SIZE << BUDDY_MAX_ORDER)) {
+			chunk = buddyChunks + i;
+		}
+	}
+
+	if (!chunk || (address & ((PAGE_SIZE << order) - 1))) {
+		KernelPanic("PMM::BuddyFree - Invalid block %x of order %d.\n", address, order);
+	}
+
+	uintptr_t node = BuddyFirstNode(order) + ((address - chunk->base) >> (order + PAGE_BITS));
+
+	if (BuddyIsFree(chunk, node)) {
+		KernelPanic("PMM::BuddyFree - Block %x of order %d is already free.\n", address, order);
+	}
+
+	// Coalesce the block with its buddy while the buddy is free.
+
+	while (node > 1 && BuddyIsFree(chunk, node ^ 1)) {
+		BuddySetFree(chunk, node ^ 1, false);
+		node >>= 1;
+	}
+
+	if (node == 1) {
+		// The whole chunk is free, so return it to the bitsets.
+
+		uintptr_t firstPage = chunk->base >> PAGE_BITS;
+		chunk->base = 0;
+
+		for (uintptr_t i = 0; i < (1 << BUDDY_MAX_ORDER); i++) {
+			dirty.Put(firstPage + i, true);
+		}
+
+		if (zeroPageThreadStarted) {
+			signalZeroPageThread.Set(false, true);
+		}
+	} else {
+		BuddySetFree(chunk, node, true);
+	}
+}
+
+uintptr_t PMM::AllocateContiguous(size_t bytes) {
+	uintptr_t order = 0;
+	while (((size_t) PAGE_SIZE << order) < bytes && order <= BUDDY_MAX_ORDER) order++;
+	if (order > BUDDY_MAX_ORDER) return 0;
+
+	lock.Acquire();
+	uintptr_t address = BuddyAllocate(order);
+	lock.Release();
+
+	if (address) {
+		__sync_fetch_and_add(&pagesAllocated, 1 << order);
+	}
+
+	return address;
+}
+
+void PMM::FreeContiguous(uintptr_t address, size_t bytes) {
+	uintptr_t order = 0;
+	while (((size_t) PAGE_SIZE << order) < bytes && order <= BUDDY_MAX_ORDER) order++;
+
+	lock.Acquire();
+	BuddyFree(address, order);
+	lock.Release();
+
+	__sync_fetch_and_sub(&pagesAllocated, 1 << order);
+}
+
+uintptr_t PMM::AllocateContiguous64KB() {
+	return AllocateContiguous(65536);
+}
+
+uintptr_t PMM::AllocateContiguous128KB() {
+	return AllocateContiguous(131072);
+}
+
+uintptr_t PMM::AllocateCachedPage(bool zeroPage) {
+	// Try to take a page from this processor's cache.
+
+	bool needsZeroing = false;
+	uintptr_t page = 0;
+
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+	CPULocalStorage *local = GetLocalStorage();
+
+	if (!local) {
+		if (interruptsEnabled) ProcessorEnableInterrupts();
+		return 0;
+	}
+
+	if (zeroPage) {
+		if (local->zeroedPageCacheCount) page = local->zeroedPageCache[--local->zeroedPageCacheCount];
+	} else {
+		if (local->dirtyPageCacheCount) page = local->dirtyPageCache[--local->dirtyPageCacheCount];
+		else if (local->zeroedPageCacheCount) page = local->zeroedPageCache[--local->zeroedPageCacheCount];
+	}
+
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+
+	if (!page) {
+		// Refill the cache with a batch of pages from the bitsets.
+		// Zeroed pages are preferred for zeroPage, so dirty pages are only taken when there aren't any.
+
+		uintptr_t batch[PMM_PAGE_CACHE_BATCH];
+		size_t batchCount = 0;
+		bool batchZeroed = zeroPage;
+
+		lock.Acquire();
+
+		for (uintptr_t pass = 0; pass < 2 && !batchCount; pass++) {
+			if (pass) batchZeroed = !zeroPage;
+			Bitset *bitset = batchZeroed ? &zeroed : &dirty;
+
+			while (batchCount < PMM_PAGE_CACHE_BATCH) {
+				uintptr_t index = bitset->Get();
+				if (index == (uintptr_t) -1) break;
+				batch[batchCount++] = index << PAGE_BITS;
+			}
+		}
+
+		if (batchCount) {
+			needsZeroing = zeroPage && !batchZeroed;
+			page = batch[--batchCount];
+
+			// The thread might have moved processor while it was acquiring the lock,
+			// so the cache could be full; return what doesn't fit.
+
+			ProcessorDisableInterrupts();
+			local = GetLocalStorage();
+			uintptr_t *cache = batchZeroed ? local->zeroedPageCache : local->dirtyPageCache;
+			size_t *cacheCount = batchZeroed ? &local->zeroedPageCacheCount : &local->dirtyPageCacheCount;
+			while (batchCount && *cacheCount != PMM_PAGE_CACHE_SIZE) cache[(*cacheCount)++] = batch[--batchCount];
+			if (interruptsEnabled) ProcessorEnableInterrupts();
+
+			while (batchCount) (batchZeroed ? &zeroed : &dirty)->Put(batch[--batchCount] >> PAGE_BITS);
+		}
+
+		lock.Release();
+	}
+
+	if (page) {
+		__sync_fetch_and_add(&pagesAllocated, 1);
+		if (needsZeroing) ZeroPhysicalMemory(page, 1);
+	}
+
+	return page;
+}
+
+uintptr_t PMM::AllocatePage(bool zeroPage) {
+	if (pageCachesReady) {
+		uintptr_t page = AllocateCachedPage(zeroPage);
+		if (page) return page;
+	}
+
+	uintptr_t returnValue = 0;
+	lock.Acquire();
+	__sync_fetch_and_add(&pagesAllocated, 1);
+
+	if (physicalMemoryRegionsPagesCount) {
+		uintptr_t i = physicalMemoryRegionsIndex;
+
+		while (!physicalMemoryRegions[i].pageCount) {
+			i++;
+
+			if (i == physicalMemoryRegionsCount) {
+				KernelPanic("PMM::AllocatePhysicalPage - expected more pages in physical regions");
+			}
+		}
+
+		PhysicalMemoryRegion *region = physicalMemoryRegions + i;
+		returnValue = region->baseAddress;
+
+		region->baseAddress += PAGE_SIZE;
 		region->pageCount--;
 		physicalMemoryRegionsPagesCount--;
 		physicalMemoryRegionsIndex = i;
@@ -1407,9 +2097,7 @@ void PMM::Initialise() {
 		startPageCount++;
 
 		uintptr_t page = AllocatePage(false);
-		lock.Acquire();
 		FreePage(page, true);
-		lock.Release();
 	}
 
 	for (uintptr_t i = 0x100; i < 0x200; i++) {
@@ -1417,46 +2105,71 @@ void PMM::Initialise() {
 			PAGE_TABLE_L4[i] = pmm.AllocatePage(true) | 3;
 		}
 	}
+
+	// Create the page tables for the window now, so that SplitLarge can write its entry directly.
+	pageTableWindow = kernelVMM.Allocate("PTW", PAGE_SIZE, VMM_MAP_STRICT, 
+			VMM_REGION_PHYSICAL, 0, VMM_REGION_FLAG_OVERWRITABLE | VMM_REGION_FLAG_CACHABLE, nullptr); 
+	kernelVMM.virtualAddressSpace->lock.Acquire();
+	kernelVMM.virtualAddressSpace->Map(0, (uintptr_t) pageTableWindow, VMM_REGION_FLAG_OVERWRITABLE);
+	PAGE_TABLE_L1[((uintptr_t) pageTableWindow & 0x0000FFFFFFFFF000) >> PAGE_BITS] = 0;
+	ProcessorInvalidatePage((uintptr_t) pageTableWindow);
+	kernelVMM.virtualAddressSpace->lock.Release();
 }
 
-void PMM::ZeroPages() {
-	uintptr_t count = 0;
+#define ZERO_PAGES_BATCH (256)
 
-	while (dirty.singleCount > 65536 / PAGE_SIZE) {
-		lock.Acquire();
-		uintptr_t page = dirty.Get(65536 / PAGE_SIZE);
-		lock.Release();
+struct ZeroPagesBatch {
+	uintptr_t pages[ZERO_PAGES_BATCH];
+	size_t pagesPerEntry;
+};
 
-		if (page == (uintptr_t) -1) break;
+void ZeroPagesRange(void *argument, uintptr_t start, uintptr_t end) {
+	ZeroPagesBatch *batch = (ZeroPagesBatch *) argument;
 
-		ZeroPhysicalMemory(page << PAGE_BITS, 65536 / PAGE_SIZE);
-		count += 65536 / PAGE_SIZE;
+	for (uintptr_t i = start; i < end; i++) {
+		ZeroPhysicalMemory(batch->pages[i] << PAGE_BITS, batch->pagesPerEntry);
+	}
 
-		lock.Acquire();
+	pmm.lock.Acquire();
 
-		for (uintptr_t i = 0; i < 65536 / PAGE_SIZE; i++) {
-			zeroed.Put(page + i);
+	for (uintptr_t i = start; i < end; i++) {
+		for (uintptr_t j = 0; j < batch->pagesPerEntry; j++) {
+			pmm.zeroed.Put(batch->pages[i] + j);
 		}
-
-		lock.Release();
 	}
 
-	while (dirty.singleCount) {
-		lock.Acquire();
-		uintptr_t page = dirty.Get();
-		lock.Release();
+	pmm.lock.Release();
+}
 
-		if (page == (uintptr_t) -1) break;
+void PMM::ZeroPages() {
+	// Take batches of dirty pages, and zero them in parallel on the worker threads.
+	// 64KB chunks are taken first, and then the remaining single pages.
 
-		ZeroPhysicalMemory(page << PAGE_BITS, 1);
-		count++;
+	ZeroPagesBatch batch;
+	WorkGroup group = {};
 
-		lock.Acquire();
-		zeroed.Put(page);
-		lock.Release();
-	}
+	for (uintptr_t pass = 0; pass < 2; pass++) {
+		batch.pagesPerEntry = pass ? 1 : 65536 / PAGE_SIZE;
+
+		while (true) {
+			uintptr_t count = 0;
+
+			lock.Acquire();
+
+			while (count < ZERO_PAGES_BATCH) {
+				uintptr_t page = dirty.Get(batch.pagesPerEntry);
+				if (page == (uintptr_t) -1) break;
+				batch.pages[count++] = page;
+			}
+
+			lock.Release();
+
+			if (!count) break;
 
-	(void) count;
+			group.ParallelFor(ZeroPagesRange, &batch, count, pass ? 64 : 4);
+			group.Wait();
+		}
+	}
 }
 
 void _ZeroPageThread(PMM *pmm) {
@@ -1469,21 +2182,51 @@ void _ZeroPageThread(PMM *pmm) {
 void PMM::Initialise2() {
 	zeroPageThread = scheduler.SpawnThread((uintptr_t) _ZeroPageThread, (uintptr_t) this, kernelProcess, false);
 	zeroPageThreadStarted = true;
+	pageCachesReady = true;
 }
 
 void PMM::FreePage(uintptr_t address, bool bypassStack) {
-	lock.AssertLocked();
-	pagesAllocated--;
-
 	if (!address) {
 		KernelPanic("PMM::FreePage - address was 0\n");
 	}
 
+	// The page is put in the processor's cache as it is, so AllocatePage would return any flags left in it.
+	if (address & (PAGE_SIZE - 1)) {
+		KernelPanic("PMM::FreePage - Address %x is not page aligned.\n", address);
+	}
+
+	__sync_fetch_and_sub(&pagesAllocated, 1);
+
+	uintptr_t batch[PMM_PAGE_CACHE_BATCH];
+	size_t batchCount = 0;
+
+	if (pageCachesReady && !bypassStack) {
+		bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+		ProcessorDisableInterrupts();
+		CPULocalStorage *local = GetLocalStorage();
+
+		if (local && local->dirtyPageCacheCount != PMM_PAGE_CACHE_SIZE) {
+			local->dirtyPageCache[local->dirtyPageCacheCount++] = address;
+			if (interruptsEnabled) ProcessorEnableInterrupts();
+			return;
+		} else if (local) {
+			// The cache is full, so return a batch of pages to the bitset.
+			while (batchCount < PMM_PAGE_CACHE_BATCH) batch[batchCount++] = local->dirtyPageCache[--local->dirtyPageCacheCount];
+		}
+
+		if (interruptsEnabled) ProcessorEnableInterrupts();
+	}
+
+	lock.Acquire();
+
 	dirty.Put(address >> PAGE_BITS, bypassStack);
+	while (batchCount) dirty.Put(batch[--batchCount] >> PAGE_BITS);
 
 	if (zeroPageThreadStarted) {
 		signalZeroPageThread.Set(false, true);
 	}
+
+	lock.Release();
 }
 
 #ifdef ARCH_X86_64
@@ -1518,6 +2261,18 @@ uintptr_t VirtualAddressSpace::Get(uintptr_t virtualAddress, bool force, uint64_
 		return 0;
 	}
 
+	if (PAGE_TABLE_L2[indexL2] & 0x80) {
+		// This is a large page, so there is no L1 page table.
+		uint64_t entry = PAGE_TABLE_L2[indexL2];
+
+		if (flags) {
+			*flags |= VAS_LARGE_PAGE;
+			if (!(entry & 2)) *flags |= VMM_REGION_FLAG_READ_ONLY;
+		}
+
+		return (entry & 0x000FFFFFFFE00000) + (virtualAddress & (LARGE_PAGE_SIZE - 1));
+	}
+
 	uintptr_t physicalAddress = PAGE_TABLE_L1[indexL1];
 
 	if (physicalAddress & 1) {
@@ -1537,6 +2292,61 @@ uintptr_t VirtualAddressSpace::Get(uintptr_t virtualAddress, bool force, uint64_
 	}
 }
 
+static void AddToTLBShootdown(TLBShootdown *shootdown, uintptr_t address, size_t pageCount) {
+	shootdown->pageCount += pageCount;
+
+	if (shootdown->flushAll) {
+		return;
+	}
+
+	if (shootdown->pageCount > TLB_SHOOTDOWN_FLUSH_PAGES) {
+		shootdown->flushAll = true;
+	} else if (shootdown->rangeCount && shootdown->addresses[shootdown->rangeCount - 1] 
+			+ (shootdown->pageCounts[shootdown->rangeCount - 1] << PAGE_BITS) == address) {
+		shootdown->pageCounts[shootdown->rangeCount - 1] += pageCount;
+	} else if (shootdown->rangeCount == TLB_SHOOTDOWN_RANGES) {
+		shootdown->flushAll = true;
+	} else {
+		shootdown->addresses[shootdown->rangeCount] = address;
+		shootdown->pageCounts[shootdown->rangeCount] = pageCount;
+		shootdown->rangeCount++;
+	}
+}
+
+static void SendTLBShootdown(TLBShootdown *shootdown, volatile uint64_t *targets /* nullptr for all processors */) {
+	if (scheduler.processors == 1) {
+		return;
+	}
+
+	// The request lives in this processor's local storage until every target has handled it,
+	// so we must not be preempted or moved to another processor.
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+
+	CPULocalStorage *local = GetLocalStorage();
+	TLBShootdown *request = &local->tlbShootdown;
+	*request = *shootdown;
+	request->remainingProcessors = 1; // Don't let the count reach 0 until all the IPIs are sent.
+
+	for (uintptr_t i = 0; i < MAX_PROCESSORS; i++) {
+		CPULocalStorage *target = scheduler.localStorage[i];
+
+		if (!target || target == local || (targets && !(targets[i / 64] & ((uint64_t) 1 << (i % 64))))) {
+			continue;
+		}
+
+		__sync_fetch_and_add(&request->remainingProcessors, 1);
+		__sync_fetch_and_or(target->tlbShootdownsPending + local->processorID / 64, (uint64_t) 1 << (local->processorID % 64));
+		ProcessorSendIPI(TLB_SHOOTDOWN_IPI, false, i);
+	}
+
+	// IPIs are not masked by ProcessorDisableInterrupts, so we'll still handle shootdowns from other processors while we wait.
+	__sync_fetch_and_sub(&request->remainingProcessors, 1);
+	while (request->remainingProcessors);
+
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+}
+
 void VirtualAddressSpace::Remove(uintptr_t _virtualAddress, size_t pageCount) {
 	lock.AssertLocked();
 
@@ -1545,33 +2355,59 @@ void VirtualAddressSpace::Remove(uintptr_t _virtualAddress, size_t pageCount) {
 	uintptr_t virtualAddressU = _virtualAddress;
 	_virtualAddress &= 0x0000FFFFFFFFF000;
 
+	TLBShootdown shootdown = {};
+	shootdown.global = !userland || (virtualAddressU & 0xFFFF000000000000);
+
 	for (uintptr_t i = 0; i < pageCount; i++) {
 		uintptr_t virtualAddress = (i << PAGE_BITS) + _virtualAddress;
+		uint64_t flags;
+
+		if (Get(virtualAddress, false, &flags)) {
+			if (flags & VAS_LARGE_PAGE) {
+				if (!(virtualAddress & (LARGE_PAGE_SIZE - 1)) && pageCount - i >= (LARGE_PAGE_SIZE >> PAGE_BITS)) {
+					// Remove the whole large page.
+					uintptr_t indexL2 = virtualAddress >> (PAGE_BITS + ENTRIES_PER_PAGE_TABLE_BITS * 1);
+					PAGE_TABLE_L2[indexL2] = 0;
+					ProcessorInvalidatePage((i << PAGE_BITS) + virtualAddressU);
+					AddToTLBShootdown(&shootdown, (i << PAGE_BITS) + virtualAddressU, LARGE_PAGE_SIZE >> PAGE_BITS);
+					i += (LARGE_PAGE_SIZE >> PAGE_BITS) - 1;
+					continue;
+				}
+
+				// Only part of the large page is being removed.
+				// This is only expected for physical regions, since standard regions free their large pages whole.
+				SplitLarge((i << PAGE_BITS) + virtualAddressU);
+			}
 
-		if (Get(virtualAddress)) {
 			uintptr_t indexL1 = virtualAddress >> (PAGE_BITS + ENTRIES_PER_PAGE_TABLE_BITS * 0);
 			PAGE_TABLE_L1[indexL1] = 0;
 
 			uint64_t invalidateAddress = (i << PAGE_BITS) + virtualAddressU;
 
 			ProcessorInvalidatePage(invalidateAddress);
+			AddToTLBShootdown(&shootdown, invalidateAddress, 1);
 		}
 	}
 
-	// TODO Only send the IPI to the processors that are actually executing threads with the virtual address space.
-	// 	Currently we only support the kernel's virtual address space, so this'll apply to all processors.
-	// 	If we use Intel's PCID then we may have to send this to all processors anyway.
-	// 	And we'll probably also have to be careful with shared memory regions.
-	//	...actually I think we might not bother doing this.
-	if (scheduler.processors > 1) {
-		ipiLock.Acquire();
-		tlbShootdownVirtualAddress = virtualAddressU;
-		tlbShootdownPageCount = pageCount;
-		tlbShootdownRemainingProcessors = scheduler.processors - 1;
-		ProcessorSendIPI(TLB_SHOOTDOWN_IPI);
-		while (tlbShootdownRemainingProcessors);
-		ipiLock.Release();
+	if (!shootdown.pageCount) {
+		return;
 	}
+
+	if (shootdown.global) {
+		// Kernel pages are global and mapped in every address space, so every processor needs to invalidate them.
+		SendTLBShootdown(&shootdown, nullptr);
+		return;
+	}
+
+	if (pagingPCIDSupport && pcid != PCID_KERNEL) {
+		// Invalidation only applies to the loaded PCID.
+		MarkPCIDStale();
+	}
+
+	// Processors that load the address space after this will either flush the TLB or see the PCID is stale.
+	// (Activate sets the active bit before checking for staleness, and we mark it stale before reading the active bits.)
+	__sync_synchronize();
+	SendTLBShootdown(&shootdown, activeProcessors);
 }
 
 void VirtualAddressSpace::Map(uintptr_t physicalAddress, uintptr_t virtualAddress, unsigned flags) {
@@ -1611,6 +2447,13 @@ void VirtualAddressSpace::Map(uintptr_t physicalAddress, uintptr_t virtualAddres
 		PAGE_TABLE_L2[indexL2] = pmm.AllocatePage(false) | 7;
 		ProcessorInvalidatePage((uintptr_t) (PAGE_TABLE_L1 + indexL1));
 		ZeroMemory((void *) ((uintptr_t) (PAGE_TABLE_L1 + indexL1) & ~(PAGE_SIZE - 1)), PAGE_SIZE);
+	} else if (PAGE_TABLE_L2[indexL2] & 0x80) {
+		if (!(flags & VMM_REGION_FLAG_OVERWRITABLE)) {
+			KernelPanic("VirtualAddressSpace::Map - Attempt to map to %x address %x that is within a large page in address space %x.\n", 
+					physicalAddress, virtualAddress, ProcessorReadCR3());
+		}
+
+		SplitLarge(oldVirtualAddress);
 	}
 
 	if ((PAGE_TABLE_L1[indexL1] & 1) && !(flags & VMM_REGION_FLAG_OVERWRITABLE)) {
@@ -1618,7 +2461,8 @@ void VirtualAddressSpace::Map(uintptr_t physicalAddress, uintptr_t virtualAddres
 				physicalAddress, virtualAddress, ProcessorReadCR3(), PAGE_TABLE_L1[indexL1] & (~(PAGE_SIZE - 1)));
 	}
 
-	uintptr_t value = physicalAddress | ((userland && !(flags & VMM_REGION_FLAG_SUPERVISOR)) ? 7 : 0x103) | (flags & VMM_REGION_FLAG_CACHABLE ? 0 : 24);
+	// Supervisor pages in a user address space must not be global, since they belong to this address space only.
+	uintptr_t value = physicalAddress | (userland ? ((flags & VMM_REGION_FLAG_SUPERVISOR) ? 3 : 7) : 0x103) | (flags & VMM_REGION_FLAG_CACHABLE ? 0 : 24);
 	if (flags & VMM_REGION_FLAG_READ_ONLY) value &= ~2;
 	if (flags & VMM_REGION_FLAG_COPIED) value |= ((uint64_t) 1 << 52);
 	PAGE_TABLE_L1[indexL1] = value;
@@ -1630,6 +2474,89 @@ void VirtualAddressSpace::Map(uintptr_t physicalAddress, uintptr_t virtualAddres
 		ProcessorInvalidatePage(oldVirtualAddress);
 	}
 }
+
+bool VirtualAddressSpace::MapLarge(uintptr_t physicalAddress, uintptr_t virtualAddress, unsigned flags) {
+	lock.AssertLocked();
+
+	if ((virtualAddress & 0xFFFF000000000000) == 0
+			&& ProcessorReadCR3() != cr3) {
+		KernelPanic("VirtualAddressSpace::MapLarge - Attempt to map page into other address space.\n");
+	}
+
+	if ((physicalAddress & (LARGE_PAGE_SIZE - 1)) || (virtualAddress & (LARGE_PAGE_SIZE - 1))) {
+		KernelPanic("VirtualAddressSpace::MapLarge - Unaligned large page %x -> %x.\n", virtualAddress, physicalAddress);
+	}
+
+	uintptr_t oldVirtualAddress = virtualAddress;
+	virtualAddress &= 0x0000FFFFFFFFF000;
+
+	uintptr_t indexL4 = virtualAddress >> (PAGE_BITS + ENTRIES_PER_PAGE_TABLE_BITS * 3);
+	uintptr_t indexL3 = virtualAddress >> (PAGE_BITS + ENTRIES_PER_PAGE_TABLE_BITS * 2);
+	uintptr_t indexL2 = virtualAddress >> (PAGE_BITS + ENTRIES_PER_PAGE_TABLE_BITS * 1);
+
+	if ((PAGE_TABLE_L4[indexL4] & 1) == 0) {
+		PAGE_TABLE_L4[indexL4] = pmm.AllocatePage(false) | 7;
+		ProcessorInvalidatePage((uintptr_t) (PAGE_TABLE_L3 + indexL3));
+		ZeroMemory((void *) ((uintptr_t) (PAGE_TABLE_L3 + indexL3) & ~(PAGE_SIZE - 1)), PAGE_SIZE);
+	}
+
+	if ((PAGE_TABLE_L3[indexL3] & 1) == 0) {
+		PAGE_TABLE_L3[indexL3] = pmm.AllocatePage(false) | 7;
+		ProcessorInvalidatePage((uintptr_t) (PAGE_TABLE_L2 + indexL2));
+		ZeroMemory((void *) ((uintptr_t) (PAGE_TABLE_L2 + indexL2) & ~(PAGE_SIZE - 1)), PAGE_SIZE);
+	}
+
+	if (PAGE_TABLE_L2[indexL2] & 1) {
+		// There is already a large page, or a page table.
+		return false;
+	}
+
+	uintptr_t value = physicalAddress | (userland ? ((flags & VMM_REGION_FLAG_SUPERVISOR) ? 3 : 7) : 0x103) | 0x80 | (flags & VMM_REGION_FLAG_CACHABLE ? 0 : 24);
+	if (flags & VMM_REGION_FLAG_READ_ONLY) value &= ~2;
+	PAGE_TABLE_L2[indexL2] = value;
+
+	ProcessorInvalidatePage(oldVirtualAddress);
+	return true;
+}
+
+void VirtualAddressSpace::SplitLarge(uintptr_t virtualAddress) {
+	lock.AssertLocked();
+
+	uintptr_t oldVirtualAddress = virtualAddress & ~(uintptr_t) (LARGE_PAGE_SIZE - 1);
+	virtualAddress &= 0x0000FFFFFFE00000;
+
+	uintptr_t indexL2 = virtualAddress >> (PAGE_BITS + ENTRIES_PER_PAGE_TABLE_BITS * 1);
+	uintptr_t indexL1 = virtualAddress >> (PAGE_BITS + ENTRIES_PER_PAGE_TABLE_BITS * 0);
+
+	uint64_t entry = PAGE_TABLE_L2[indexL2];
+	uintptr_t physicalAddress = entry & 0x000FFFFFFFE00000;
+	uint64_t pageFlags = entry & 0xFFF & ~0x80;
+
+	// Fill the page table through the window before installing it, so that no processor can walk a partially filled table.
+	// The window's entry is in the kernel's half of the address space, so it can be written directly in any address space.
+	uintptr_t table = pmm.AllocatePage(false);
+	volatile uint64_t *windowEntry = PAGE_TABLE_L1 + (((uintptr_t) pageTableWindow & 0x0000FFFFFFFFF000) >> PAGE_BITS);
+	uint64_t *entries = (uint64_t *) pageTableWindow;
+
+	pageTableWindowLock.Acquire();
+	*windowEntry = table | 3;
+	ProcessorInvalidatePage((uintptr_t) pageTableWindow);
+
+	for (uintptr_t i = 0; i < ENTRIES_PER_PAGE_TABLE; i++) {
+		entries[i] = (physicalAddress + (i << PAGE_BITS)) | pageFlags;
+	}
+
+	*windowEntry = 0;
+	ProcessorInvalidatePage((uintptr_t) pageTableWindow);
+	pageTableWindowLock.Release();
+
+	// Other processors' translations of the large page are still correct until the callers shoot them down.
+	PAGE_TABLE_L2[indexL2] = table | 7;
+	ProcessorInvalidatePage((uintptr_t) (PAGE_TABLE_L1 + indexL1));
+
+	// Invalidating any address in the large page removes its translation, and any cached walks through the old entry.
+	ProcessorInvalidatePage(oldVirtualAddress);
+}
 #endif
 
 void Pool::Initialise(size_t _elementSize) {
@@ -1749,9 +2676,7 @@ void SharedMemoryManager::ResizeSharedMemory(SharedMemoryRegion *region, size_t
 			}
 			
 			if (address & SHARED_ADDRESS_PRESENT) {
-				pmm.lock.Acquire();
-				pmm.FreePage(address);
-				pmm.lock.Release();
+				pmm.FreePage(address & ~(PAGE_SIZE - 1));
 			}
 		}
 	}
@@ -1792,6 +2717,89 @@ void SharedMemoryManager::ResizeSharedMemory(SharedMemoryRegion *region, size_t
 	}
 }
 
+uintptr_t *SharedMemoryManager::GetPageEntry(SharedMemoryRegion *region, uintptr_t offset, bool create) {
+	region->mutex.AssertLocked();
+
+	uintptr_t *addresses = (uintptr_t *) region->data;
+
+	if (region->big) {
+		uintptr_t group = offset / BIG_SHARED_MEMORY;
+
+		if (!addresses[group]) {
+			if (!create) return nullptr;
+			addresses[group] = (uintptr_t) OSHeapAllocate(BIG_SHARED_MEMORY / PAGE_SIZE * sizeof(uintptr_t), false, MMVMM_HEAP); 
+			ZeroMemory((void *) addresses[group], BIG_SHARED_MEMORY / PAGE_SIZE * sizeof(uintptr_t));
+		}
+
+		return (uintptr_t *) addresses[group] + ((offset % BIG_SHARED_MEMORY) >> PAGE_BITS);
+	} else {
+		return addresses + (offset >> PAGE_BITS);
+	}
+}
+
+static bool CopyCachedPages(SharedMemoryRegion *region, uintptr_t offset, uint8_t *buffer, size_t count, bool write) {
+	if (!count) return true;
+
+	uintptr_t pages[MM_FILE_CHUNK_PAGES];
+	uintptr_t firstPage = offset >> PAGE_BITS, lastPage = (offset + count - 1) >> PAGE_BITS;
+
+	for (uintptr_t batch = firstPage; batch <= lastPage; batch += MM_FILE_CHUNK_PAGES) {
+		size_t batchCount = lastPage + 1 - batch;
+		if (batchCount > MM_FILE_CHUNK_PAGES) batchCount = MM_FILE_CHUNK_PAGES;
+
+		region->mutex.Acquire();
+
+		if (offset + count > region->sizeBytes) {
+			region->mutex.Release();
+			return false;
+		}
+
+		for (uintptr_t i = 0; i < batchCount; i++) {
+			uintptr_t *entry = sharedMemoryManager.GetPageEntry(region, (batch + i) << PAGE_BITS, false);
+			pages[i] = 0;
+
+			if (entry && (*entry & SHARED_ADDRESS_PRESENT)) {
+				pages[i] = *entry & ~(PAGE_SIZE - 1);
+			} else if (write) {
+				// Stop any read of the page from filling it with the old contents.
+				if (entry && (*entry & SHARED_ADDRESS_READING)) *entry = 0;
+			} else {
+				region->mutex.Release();
+				return false;
+			}
+		}
+
+		region->mutex.Release();
+
+		uint8_t *window = (uint8_t *) MapPhysicalPages(pages, batchCount);
+		if (!window) return false;
+
+		for (uintptr_t i = 0; i < batchCount; i++) {
+			if (!pages[i]) continue;
+
+			uintptr_t from = (batch + i) << PAGE_BITS, to = from + PAGE_SIZE;
+			if (from < offset) from = offset;
+			if (to > offset + count) to = offset + count;
+
+			uint8_t *page = window + from - (batch << PAGE_BITS);
+			if (write) CopyMemory(page, buffer + from - offset, to - from);
+			else CopyMemory(buffer + from - offset, page, to - from);
+		}
+
+		kernelVMM.Free(window);
+	}
+
+	return true;
+}
+
+bool SharedMemoryManager::ReadCachedPages(SharedMemoryRegion *region, uintptr_t offset, void *buffer, size_t count) {
+	return CopyCachedPages(region, offset, (uint8_t *) buffer, count, false);
+}
+
+void SharedMemoryManager::WriteCachedPages(SharedMemoryRegion *region, uintptr_t offset, void *buffer, size_t count) {
+	CopyCachedPages(region, offset, (uint8_t *) buffer, count, true);
+}
+
 SharedMemoryRegion *SharedMemoryManager::CreateSharedMemory(size_t sizeBytes, char *name, size_t nameLength, unsigned flags) {
 	mutex.Acquire();
 	Defer(mutex.Release());
@@ -1884,16 +2892,14 @@ void SharedMemoryManager::DestroySharedMemory(SharedMemoryRegion *region) {
 		size_t pageGroups = pages / (BIG_SHARED_MEMORY / PAGE_SIZE) + 1;
 		uintptr_t **addresses = (uintptr_t **) (region->data);
 
-		pmm.lock.Acquire();
 		for (uintptr_t i = 0; i < pageGroups; i++) {
 			if (!addresses[i]) continue;
 			for (uintptr_t j = 0; j < (BIG_SHARED_MEMORY / PAGE_SIZE); j++) {
 				uintptr_t address = addresses[i][j];
-				if (!address) continue;
-				pmm.FreePage(address);
+				if (!(address & SHARED_ADDRESS_PRESENT)) continue;
+				pmm.FreePage(address & ~(PAGE_SIZE - 1));
 			}
 		}
-		pmm.lock.Release();
 
 		for (uintptr_t i = 0; i < pageGroups; i++) {
 			if (!addresses[i]) continue;
@@ -1902,13 +2908,11 @@ void SharedMemoryManager::DestroySharedMemory(SharedMemoryRegion *region) {
 	} else {
 		uintptr_t *addresses = (uintptr_t *) (region->data);
 
-		pmm.lock.Acquire();
 		for (uintptr_t i = 0; i < pages; i++) {
 			uintptr_t address = addresses[i];
-			if (!address) continue;
-			pmm.FreePage(address);
+			if (!(address & SHARED_ADDRESS_PRESENT)) continue;
+			pmm.FreePage(address & ~(PAGE_SIZE - 1));
 		}
-		pmm.lock.Release();
 	}
 
 	OSHeapFree(region->data, 0, MMVMM_HEAP); 
@@ -1918,10 +2922,67 @@ void SharedMemoryManager::DestroySharedMemory(SharedMemoryRegion *region) {
 	}
 }
 
+void *MapPhysicalPages(uintptr_t *pages, size_t pageCount) {
+	uint8_t *window = (uint8_t *) kernelVMM.Allocate("MMFile", pageCount * PAGE_SIZE, VMM_MAP_STRICT, VMM_REGION_PHYSICAL, 0, 
+			VMM_REGION_FLAG_OVERWRITABLE | VMM_REGION_FLAG_CACHABLE, nullptr);
+
+	if (!window) {
+		return nullptr;
+	}
+
+	VirtualAddressSpace *vas = kernelVMM.virtualAddressSpace;
+	vas->lock.Acquire();
+
+	for (uintptr_t i = 0; i < pageCount; i++) {
+		if (!pages[i]) continue;
+		vas->Map(pages[i], (uintptr_t) window + i * PAGE_SIZE, VMM_REGION_FLAG_CACHABLE | VMM_REGION_FLAG_OVERWRITABLE);
+	}
+
+	vas->lock.Release();
+
+	return window;
+}
+
 Mutex physicalMemoryManipulationLock;
 Spinlock physicalMemoryManipulationProcessorLock;
 
 void ZeroPhysicalMemory(uintptr_t page, size_t pageCount) {
+	Thread *thread = GetCurrentThread();
+	void *window = thread ? thread->physicalMemoryWindow : nullptr;
+
+	if (window) {
+		VirtualAddressSpace *vas = kernelVMM.virtualAddressSpace;
+
+		while (pageCount) {
+			size_t doCount = pageCount > PHYSICAL_MEMORY_MANIPULATION_REGION_PAGES ? PHYSICAL_MEMORY_MANIPULATION_REGION_PAGES : pageCount;
+
+			vas->lock.Acquire();
+
+			for (uintptr_t i = 0; i < doCount; i++) {
+				vas->Map(page + PAGE_SIZE * i, (uintptr_t) window + PAGE_SIZE * i, VMM_REGION_FLAG_CACHABLE | VMM_REGION_FLAG_OVERWRITABLE);
+			}
+
+			vas->lock.Release();
+
+			// The thread mustn't move to another processor between invalidating the window and using it,
+			// since that processor might have stale translations for the window.
+			bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+			ProcessorDisableInterrupts();
+
+			for (uintptr_t i = 0; i < doCount; i++) {
+				ProcessorInvalidatePage((uintptr_t) window + i * PAGE_SIZE);
+			}
+
+			ZeroMemory(window, doCount * PAGE_SIZE);
+			if (interruptsEnabled) ProcessorEnableInterrupts();
+
+			page += doCount * PAGE_SIZE;
+			pageCount -= doCount;
+		}
+
+		return;
+	}
+
 	physicalMemoryManipulationLock.Acquire();
 
 	repeat:;
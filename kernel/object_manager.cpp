@@ -5,7 +5,8 @@
 #define CLOSABLE_OBJECT_TYPES ((KernelObjectType) \
 		(KERNEL_OBJECT_MUTEX | KERNEL_OBJECT_PROCESS | KERNEL_OBJECT_THREAD \
 		 | KERNEL_OBJECT_SHMEM | KERNEL_OBJECT_NODE | KERNEL_OBJECT_EVENT \
-		 | KERNEL_OBJECT_SURFACE | KERNEL_OBJECT_WINDOW | KERNEL_OBJECT_IO_REQUEST))
+		 | KERNEL_OBJECT_SURFACE | KERNEL_OBJECT_WINDOW | KERNEL_OBJECT_IO_REQUEST \
+		 | KERNEL_OBJECT_COMPLETION_PORT))
 
 enum KernelObjectType {
 	COULD_NOT_RESOLVE_HANDLE	= 0x00000000,
@@ -18,6 +19,7 @@ enum KernelObjectType {
 	KERNEL_OBJECT_NODE		= 0x00000040,
 	KERNEL_OBJECT_EVENT		= 0x00000080,
 	KERNEL_OBJECT_IO_REQUEST	= 0x00000100,
+	KERNEL_OBJECT_COMPLETION_PORT	= 0x00000200,
 	KERNEL_OBJECT_NONE		= 0x00008000,
 };
 
@@ -66,7 +68,7 @@ struct HandleTableL1 {
 struct HandleTable {
 	HandleTableL1 l1r;
 	Handle *linear;
-	Mutex lock;
+	RWLock lock; // Resolving a handle to use it only needs to acquire this shared.
 	Process *process;
 
 	OSHandle OpenHandle(Handle &handle);
@@ -118,19 +120,37 @@ void CloseHandleToObject(void *object, KernelObjectType type, uint64_t flags) {
 			objectHandleCountChange.Release();
 
 			if (deallocate) {
+				CompletionPortDetach(event);
 				OSHeapFree(event, sizeof(Event));
 			}
 		} break;
 
+		case KERNEL_OBJECT_COMPLETION_PORT: {
+			objectHandleCountChange.Acquire();
+
+			CompletionPort *port = (CompletionPort *) object;
+			port->handles--;
+
+			bool deallocate = !port->handles;
+
+			objectHandleCountChange.Release();
+
+			if (deallocate) {
+				port->Destroy();
+			}
+		} break;
+
 		case KERNEL_OBJECT_PROCESS: {
+			AsyncTask *task = AllocateAsyncTask();
 			scheduler.lock.Acquire();
-			RegisterAsyncTask(CloseHandleToProcess, object, (Process *) object, true);
+			RegisterAsyncTask(task, CloseHandleToProcess, object, (Process *) object);
 			scheduler.lock.Release();
 		} break;
 
 		case KERNEL_OBJECT_THREAD: {
+			AsyncTask *task = AllocateAsyncTask();
 			scheduler.lock.Acquire();
-			RegisterAsyncTask(CloseHandleToThread, object, kernelProcess, true);
+			RegisterAsyncTask(task, CloseHandleToThread, object, kernelProcess);
 			scheduler.lock.Release();
 		} break;
 
@@ -166,10 +186,10 @@ void CloseHandleToObject(void *object, KernelObjectType type, uint64_t flags) {
 
 		case KERNEL_OBJECT_WINDOW: {
 			Window *window = (Window *) object;
-			windowManager.mutex.Acquire();
+			windowManager.lock.AcquireExclusive();
 			bool destroy = window->handles == 1;
 			window->handles--;
-			windowManager.mutex.Release();
+			windowManager.lock.ReleaseExclusive();
 
 			if (destroy) {
 				window->Destroy();
@@ -183,6 +203,7 @@ void CloseHandleToObject(void *object, KernelObjectType type, uint64_t flags) {
 			request->mutex.Release();
 
 			if (destroy) {
+				CompletionPortDetach(&request->complete);
 				OSHeapFree(request, sizeof(IORequest));
 			}
 		} break;
@@ -194,7 +215,7 @@ void CloseHandleToObject(void *object, KernelObjectType type, uint64_t flags) {
 }
 
 void HandleTable::CloseHandle(OSHandle handle) {
-	lock.Acquire();
+	lock.AcquireExclusive();
 
 	uintptr_t l1Index = ((handle / HANDLE_TABLE_L3_ENTRIES) / HANDLE_TABLE_L2_ENTRIES);
 	uintptr_t l2Index = ((handle / HANDLE_TABLE_L3_ENTRIES) % HANDLE_TABLE_L2_ENTRIES);
@@ -214,7 +235,7 @@ void HandleTable::CloseHandle(OSHandle handle) {
 	l1->u[l1Index]--;
 	l2->u[l2Index]--;
 
-	lock.Release();
+	lock.ReleaseExclusive();
 
 	CloseHandleToObject(object, type, flags);
 }
@@ -252,8 +273,11 @@ void *HandleTable::ResolveHandle(OSHandle handle, KernelObjectType &type, Resolv
 		return nullptr;
 	}
 
-	lock.Acquire();
-	Defer(lock.Release());
+	// Closing a handle needs to check that it isn't in use, so it must exclude other resolutions.
+	// Using a handle only increments its lock, so can be done concurrently.
+	bool exclusive = reason != RESOLVE_HANDLE_TO_USE;
+	if (exclusive) lock.AcquireExclusive(); else lock.AcquireShared();
+	Defer(if (exclusive) lock.ReleaseExclusive(); else lock.ReleaseShared());
 
 #if 0
 	uintptr_t l1Index = ((handle / HANDLE_TABLE_L3_ENTRIES) / HANDLE_TABLE_L2_ENTRIES);
@@ -280,7 +304,7 @@ void *HandleTable::ResolveHandle(OSHandle handle, KernelObjectType &type, Resolv
 				type = COULD_NOT_RESOLVE_HANDLE;
 				return nullptr; // The handle is being closed.
 			} else {
-				_handle->lock++;
+				__sync_fetch_and_add(&_handle->lock, 1);
 				if (handleData) *handleData = _handle;
 				return _handle->object;
 			}
@@ -312,8 +336,8 @@ void HandleTable::CompleteHandle(void *object, OSHandle handle) {
 	// We've already checked that the handle is valid during ResolveHandle,
 	// and because the lock was incremented we know that it is still valid.
 	
-	lock.Acquire();
-	Defer(lock.Release());
+	lock.AcquireShared();
+	Defer(lock.ReleaseShared());
 	
 #if 0
 	uintptr_t l1Index = ((handle / HANDLE_TABLE_L3_ENTRIES) / HANDLE_TABLE_L2_ENTRIES);
@@ -329,12 +353,12 @@ void HandleTable::CompleteHandle(void *object, OSHandle handle) {
 	Handle *_handle = l3->t + l3Index;
 #endif
 	Handle *_handle = linear + handle;
-	_handle->lock--;
+	__sync_fetch_and_sub(&_handle->lock, 1);
 }
 
 OSHandle HandleTable::OpenHandle(Handle &handle) {
-	lock.Acquire();
-	Defer(lock.Release());
+	lock.AcquireExclusive();
+	Defer(lock.ReleaseExclusive());
 
 	if (!handle.object) {
 		KernelPanic("HandleTable::OpenHandle - Invalid object.\n");
@@ -158,7 +158,7 @@ bool PS2IRQHandler(uintptr_t interruptIndex) {
 				| ((firstByte & (1 << 2)) ? MIDDLE_BUTTON : 0);
 
 		scheduler.lock.Acquire();
-		RegisterAsyncTask(PS2MouseUpdated, update, kernelProcess, false);
+		RegisterAsyncTask(PS2MouseUpdated, update, kernelProcess);
 		scheduler.lock.Release();
 
 		firstByte = 0;
@@ -210,7 +210,7 @@ bool PS2IRQHandler(uintptr_t interruptIndex) {
 		}
 
 		scheduler.lock.Acquire();
-		RegisterAsyncTask(PS2KeyboardUpdated, update, kernelProcess, false);
+		RegisterAsyncTask(PS2KeyboardUpdated, update, kernelProcess);
 		scheduler.lock.Release();
 
 		firstByte = 0;
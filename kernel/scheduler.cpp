@@ -1,4 +1,3 @@
-// TODO Priority inversion
 // TODO Yield on mutex/spinlock release and event set
 
 #ifndef IMPLEMENTATION
@@ -7,7 +6,22 @@ void CloseHandleToThread(void *_thread);
 void CloseHandleToProcess(void *_thread);
 void KillThread(void *_thread);
 
-void RegisterAsyncTask(AsyncTaskCallback callback, void *argument, struct Process *targetProcess, bool needed /*If false, the task may not be registered if there are many queued tasks.*/);
+// Tasks that must run are registered with storage provided by the caller, so they can never be dropped.
+// Interrupt handlers must use embedded storage; other callers can use AllocateAsyncTask.
+void RegisterAsyncTask(AsyncTask *task, AsyncTaskCallback callback, void *argument, struct Process *targetProcess, 
+		int processorID = -1 /*The processor whose worker threads should execute the task; -1 for this processor.*/);
+AsyncTask *AllocateAsyncTask();
+
+// Optional tasks are taken from the reserve, and are dropped if the reserve is running low.
+void RegisterAsyncTask(AsyncTaskCallback callback, void *argument, struct Process *targetProcess, int processorID = -1);
+
+// Optional asynchronous tasks are taken from a reserve that is refilled by the worker threads,
+// since RegisterAsyncTask is called from interrupt handlers, where the heap can't be used.
+#define ASYNC_TASK_RESERVE (256) // Added to the reserve's target for each processor.
+AsyncTask *volatile asyncTaskReserve;
+volatile size_t asyncTaskReserveCount, asyncTaskReserveTarget;
+volatile bool asyncTaskReserveExhausted; // Set when a task was dropped; the target is doubled.
+Mutex asyncTaskReserveMutex;
 
 struct Semaphore {
 	void Take(uintptr_t units = 1);
@@ -20,21 +34,91 @@ struct Semaphore {
 	uintptr_t lastTaken;
 };
 
+// Work groups split a job across the processors' worker threads.
+// Don't wait on a work group from within one of its jobs, since the worker thread might be needed to run the rest of the jobs.
+
+typedef void (*WorkRangeCallback)(void *argument, uintptr_t start, uintptr_t end);
+
+struct WorkGroup {
+	void Submit(AsyncTaskCallback callback, void *argument); 
+	void ParallelFor(WorkRangeCallback callback, void *argument, uintptr_t count, 
+			uintptr_t batch = 0 /*The number of indices given to each job; 0 to split the range evenly between the processors.*/);
+	void Wait(); // Wait for all the submitted jobs to complete. The group can then be reused.
+
+	volatile uintptr_t pendingJobs;
+	Event complete;
+};
+
+struct WorkJob {
+	AsyncTask task; // Queued on a processor's workQueue.
+	WorkGroup *group;
+
+	AsyncTaskCallback callback;
+	WorkRangeCallback rangeCallback;
+	void *argument;
+	uintptr_t start, end;
+};
+
+// Futexes let userland block until another thread wakes it at an address,
+// so that its locks only need to enter the kernel when they're contended.
+// Waiters are kept in a hash table of buckets, keyed by the address and the VMM it's in.
+
+struct FutexWaiter {
+	LinkedItem<FutexWaiter> item;
+	struct VMM *vmm;
+	uintptr_t address;
+	Event woken;
+};
+
+#define FUTEX_BUCKET_COUNT (64)
+
+struct FutexBucket {
+	Mutex mutex;
+	LinkedList<FutexWaiter> waiters;
+};
+
+FutexBucket futexBuckets[FUTEX_BUCKET_COUNT];
+
+OSError FutexWait(volatile int32_t *address, int32_t expectedValue, uint64_t timeoutMs); // Returns immediately if *address != expectedValue.
+size_t FutexWake(volatile int32_t *address, size_t count); // Returns the number of woken threads.
+
 struct Timer {
 	void Set(uint64_t triggerInMs, bool autoReset, AsyncTaskCallback callback = nullptr, void *argument = nullptr);
 	void Remove();
 
 	Event event;
 	LinkedItem<Timer> item;
+	struct TimerWheel *wheel; // The wheel of the processor that set the timer.
 	uint64_t triggerTimeMs;
 	AsyncTaskCallback callback;
 	void *argument;
+	AsyncTask callbackTask; // A timer with a callback must not be freed until the callback has run.
+};
+
+// Each processor keeps its timers in a hierarchical timer wheel.
+// Level 0 has a slot for each millisecond, and each slot of level N covers all of level N-1.
+// Timers are moved down a level when its slot is reached, so insertion and removal are O(1).
+
+#define TIMER_WHEEL_LEVELS (4)
+#define TIMER_WHEEL_SLOT_BITS (6)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+struct TimerWheel {
+	void Insert(Timer *timer);
+	void Expire(uint64_t timeMs); // Sets the events and registers the callbacks of all the expired timers.
+	uint64_t NextExpiryMs();      // Returns 0 if there are no timers.
+
+	LinkedList<Timer> slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	size_t levelCounts[TIMER_WHEEL_LEVELS];
+	uint64_t currentMs; // All the timers before this time have been expired.
+
+	Timer *volatile expiringTimer; // Timer::Remove must wait for this timer to be notified before returning.
+	Spinlock lock;
 };
 
 struct InterruptContext {
 #ifdef ARCH_X86_64
 	uint64_t cr2, ds;
-	uint8_t  fxsave[512 + 16];
 	uint64_t _check, cr8, r15, r14, r13, r12, r11, r10, r9, r8;
 	uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
 	uint64_t interruptNumber, errorCode;
@@ -56,6 +140,21 @@ enum ThreadType {
 	THREAD_ASYNC_TASK,		// A thread that processes the kernel's asynchronous tasks.
 };
 
+// CPU accounting, measured with the time stamp counter.
+// Protected by the scheduler's lock.
+
+enum CPUTimeType {
+	CPU_TIME_RUN,		// Executing.
+	CPU_TIME_WAIT,		// Waiting in a processor's queue to execute.
+	CPU_TIME_BLOCKED,	// Blocking on a mutex or event.
+	CPU_TIME_TYPE_COUNT,
+};
+
+struct CPUTimes {
+	uint64_t ticks[CPU_TIME_TYPE_COUNT];
+	uint64_t voluntarySwitches, involuntarySwitches;
+};
+
 enum ThreadTerminatableState {
 	THREAD_INVALID_TS,
 	THREAD_TERMINATABLE,		// The thread is currently executing user code.
@@ -83,11 +182,40 @@ struct Thread {
 
 	int executingProcessorID;
 
+	// The processor the thread is executing on or queued on, or nullptr if it's blocked, paused or not yet queued.
+	// Only changed with that processor's queueLock held. See Scheduler::LockThreadProcessor.
+	struct CPULocalStorage *volatile scheduledProcessor;
+
+	OSThreadPriority priority;	// Which of the processor's queues the thread is put in.
+	volatile bool boosted;		// Set when the thread is woken by an input message. 
+					// It is queued as OS_THREAD_PRIORITY_HIGH until it next yields.
+
+	// Threads inherit the priority of the highest priority thread blocking on a mutex they own,
+	// so that they can't be stalled by threads of a lower priority while they hold it.
+	bool inheritsPriority;
+	OSThreadPriority inheritedPriority;
+	LinkedList<Mutex> contendedMutexes;
+
+	uint64_t affinity;		// Bit n is set if the thread can run on processor n. 
+					// If 0, the thread can run on any processor that isn't reserved.
+	bool exclusiveAffinity;		// Reserve the processors in affinity for threads that have an affinity set.
+
+	CPUTimes cpuTimes;
+	uint64_t accountingTimeStamp; // When the thread last started executing, was queued, or blocked.
+
+	// The FPU state is only loaded when the thread first uses the FPU after being switched to,
+	// and only saved when it's switched from if it was loaded.
+	uint8_t fpuState[512 + 16]; 	// Aligned to 16 bytes with FPU_STATE.
+	bool fpuStateValid;		// Set when the thread first uses the FPU.
+	int fpuLoadedProcessor; 	// The processor the thread's FPU state was last loaded on.
+#define FPU_STATE(thread) ((void *) (((uintptr_t) (thread)->fpuState + 15) & ~15))
+
 	Mutex *volatile blockingMutex;
 	Event *volatile blockingEvents[OS_MAX_WAIT_COUNT];
 	volatile size_t blockingEventCount;
 
 	Event killedEvent;
+	AsyncTask killTask; // Registered when the thread is terminated.
 
 	uintptr_t userStackBase;
 	uintptr_t kernelStackBase;
@@ -104,6 +232,10 @@ struct Thread {
 	// when the task is being executed.
 	VirtualAddressSpace *volatile asyncTempAddressSpace;
 
+	// Worker threads have their own window for ZeroPhysicalMemory,
+	// so that they don't contend on the shared one.
+	void *physicalMemoryWindow;
+
 	InterruptContext *interruptContext;  // TODO Store the userland interrupt context instead?
 	uintptr_t lastKnownExecutionAddress; // For debugging.
 
@@ -124,6 +256,31 @@ struct MessageQueue {
 	Event notEmpty;
 };
 
+struct CompletionPortAssociation {
+	LinkedItem<CompletionPortAssociation> item; // In the port's list of associations.
+	LinkedItem<CompletionPortAssociation> queueItem; // In the port's queue, while a completion is pending.
+	struct CompletionPort *port;
+	Event *event;
+	uintptr_t key;
+};
+
+struct CompletionPort {
+	// Events, IO requests and message queues can be associated with a completion port.
+	// When an associated event is set, its key is queued (at most once until it is dequeued),
+	// so a thread can wait on any number of objects without the limit of OS_MAX_WAIT_COUNT.
+	// The port is protected by the scheduler's lock, since completions are queued from Event::Set.
+
+	bool Associate(Event *event, uintptr_t key, CompletionPortAssociation *association); // Returns false if the event is already associated with a port.
+	size_t Dequeue(uintptr_t *keys, size_t count); // Does not block.
+	void Destroy();
+
+	LinkedList<CompletionPortAssociation> associations, queue;
+	Event available; // Set while completions are queued.
+	volatile size_t handles;
+};
+
+void CompletionPortDetach(Event *event); // Call before deallocating an event that may be associated with a completion port.
+
 struct Process {
 	MessageQueue messageQueue;
 
@@ -156,6 +313,12 @@ struct Process {
 	Event killedEvent;
 	bool allThreadsTerminated;
 	bool terminating, crashed;
+
+	CPUTimes cpuTimes; // The total of its threads' times, including the threads that have terminated.
+
+#define PROCESS_USER_STACK_CACHE (4)
+	uintptr_t userStackCache[PROCESS_USER_STACK_CACHE]; // Stacks of terminated threads, reused by new threads. Protected by the scheduler's lock.
+	size_t userStackCacheCount;
 };
 
 Process *kernelProcess;
@@ -170,6 +333,11 @@ struct Scheduler {
 	Thread *SpawnThread(uintptr_t startAddress, uintptr_t argument, Process *process, bool userland, bool addToActiveList = true);
 	void TerminateThread(Thread *thread, bool lockAlreadyAcquired = false);
 	void RemoveThread(Thread *thread); // Do not call. Use TerminateThread/CloseHandleToObject.
+
+	Thread *AllocateThread(); // Zeroed.
+	void FreeThread(Thread *thread);
+	uintptr_t AllocateKernelStack();
+	void FreeKernelStack(uintptr_t stack);
 	void PauseThread(Thread *thread, bool resume /*true to resume, false to pause*/, bool lockAlreadyAcquired = false);
 
 	Process *SpawnProcess(char *imagePath, size_t imagePathLength, bool kernelProcess = false, void *argument = nullptr);
@@ -179,17 +347,36 @@ struct Scheduler {
 
 	void CrashProcess(Process *process, OSCrashReason &reason);
 
-	void AddActiveThread(Thread *thread, bool start /*Put it at the start*/);	// Add an active thread into the queue.
+	void AddActiveThread(Thread *thread, bool start /*Put it at the start*/);	// Add an active thread into a processor's queue.
+	Thread *StealThread(CPULocalStorage *local);					// Take a thread from the busiest other processor's queue, with its queueLock held.
+	void WakeProcessor(CPULocalStorage *target, Thread *thread);			// Make sure a thread queued on target will be run. Called with target's queueLock held.
+	size_t QueuedThreadCount(CPULocalStorage *storage);
+
+	void SetThreadPriority(Thread *thread, OSThreadPriority priority);
+	OSError SetThreadAffinity(Thread *thread, uint64_t affinity, bool exclusive); // Returns OS_ERROR_UNKNOWN_OPERATION_FAILURE if none of the processors exist,
+											// or OS_ERROR_PERMISSION_NOT_GRANTED if too many processors would be reserved.
+	bool CanRunOn(Thread *thread, CPULocalStorage *storage);
+	void UpdateReservedProcessors();
+	OSThreadPriority EffectivePriority(Thread *thread);
+	void RequeueThread(Thread *thread); // Move a queued thread to the queue for its current priority.
+	CPULocalStorage *LockThreadProcessor(Thread *thread); // Acquire the queueLock of the thread's scheduledProcessor. Returns nullptr if it has none.
+	bool DequeueThread(Thread *thread); // Remove an active thread from its processor's queue or the paused queue. Returns false if it is executing.
+
+	LinkedItem<Thread> *HighestPriorityWaiter(LinkedList<Thread> *blockedThreads);
+	void InheritPriority(Mutex *mutex);	   // Give the owner of the mutex (and the owners of the mutexes it is blocking on) the priority of its waiters.
+	void UpdateInheritedPriority(Thread *thread); // Recalculate the priority a thread inherits after it releases a mutex.
 	void InsertNewThread(Thread *thread, bool addToActiveList, Process *owner); 	// Used during thread creation.
 
-	void WaitMutex(Mutex *mutex);
+	void AccountTime(Thread *thread, CPUTimeType type, uint64_t timeStamp);	// Add the time since the thread's accountingTimeStamp.
+	void GetCPUStatistics(CPUTimes *times, OSCPUStatistics *statistics);
+
+	bool WaitMutex(Mutex *mutex); // Returns true if the thread blocked.
 	uintptr_t WaitEvents(Event **events, size_t count); // Returns index of notified object.
 	void NotifyObject(LinkedList<Thread> *blockedThreads, bool schedulerAlreadyLocked = false, bool unblockAll = false);
 	void UnblockThread(Thread *unblockedThread);
 
 	Pool threadPool, processPool;
-	LinkedList<Thread>  activeThreads, pausedThreads;
-	LinkedList<Timer>   activeTimers;
+	LinkedList<Thread>  pausedThreads; // Active threads are queued in each processor's CPULocalStorage.
 	LinkedList<Thread>  allThreads;
 	LinkedList<Process> allProcesses;
 	Spinlock lock;
@@ -197,6 +384,7 @@ struct Scheduler {
 	uintptr_t nextThreadID;
 	uintptr_t nextProcessID;
 	uintptr_t processors;
+	uint64_t reservedProcessors; // Threads without an affinity aren't run on these processors.
 
 	bool initialised;
 	volatile bool started;
@@ -210,6 +398,16 @@ struct Scheduler {
 
 extern Scheduler scheduler;
 
+// Processors only receive timer interrupts when other threads are waiting to run on them,
+// or when a timer is due to expire.
+#define TIME_SLICE_MS (10)
+
+#define KERNEL_STACK_SIZE (0x20000) // TODO Temporarily set very large, revert this?
+#define USER_STACK_SIZE (0x100000)
+
+// How many times to check a mutex owned by an executing thread before blocking.
+#define MUTEX_SPIN_COUNT (1024)
+
 #endif
 
 #ifdef IMPLEMENTATION
@@ -218,6 +416,114 @@ Scheduler scheduler;
 
 int temp;
 
+Mutex lockProfilerMutex;
+
+LockProfileEntry *LockProfilerFind(uintptr_t address, bool spinlock) {
+	CPULocalStorage *local = GetLocalStorage();
+	LockProfile *profile = local ? local->lockProfile : nullptr;
+	if (!profile || !lockProfilerEnabled) return nullptr;
+
+	uintptr_t hash = ((address >> 2) * 0x9E3779B97F4A7C15) >> 32;
+
+	for (uintptr_t i = 0; i < LOCK_PROFILE_ENTRIES; i++) {
+		LockProfileEntry *entry = profile->entries + ((hash + i) & (LOCK_PROFILE_ENTRIES - 1));
+
+		if (!entry->address) {
+			entry->address = address;
+			entry->spinlock = spinlock;
+			return entry;
+		} else if (entry->address == address && entry->spinlock == spinlock) {
+			return entry;
+		}
+	}
+
+	profile->droppedRecords++;
+	return nullptr;
+}
+
+void LockProfilerAcquired(uintptr_t address, bool spinlock, bool contended, uint64_t waitTicks) {
+	// Disable interrupts so that we don't move processor, or get interrupted by a lock acquired in an IRQ handler.
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+
+	LockProfileEntry *entry = LockProfilerFind(address, spinlock);
+
+	if (entry) {
+		entry->acquisitions++;
+		entry->waitTicks += waitTicks;
+		if (contended) entry->contendedAcquisitions++;
+		if (waitTicks > entry->maxWaitTicks) entry->maxWaitTicks = waitTicks;
+	}
+
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+}
+
+void LockProfilerReleased(uintptr_t address, bool spinlock, uint64_t holdTicks) {
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+
+	LockProfileEntry *entry = LockProfilerFind(address, spinlock);
+	if (entry) entry->holdTicks += holdTicks;
+
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+}
+
+void LockProfilerStart() {
+	lockProfilerMutex.Acquire();
+	Defer(lockProfilerMutex.Release());
+
+	if (lockProfilerEnabled) return;
+
+	// The profiles are never freed, since a processor might still be recording into its profile
+	// after the profiler is disabled.
+	for (uintptr_t i = 0; i < MAX_PROCESSORS; i++) {
+		CPULocalStorage *local = scheduler.localStorage[i];
+		if (!local) continue;
+
+		if (local->lockProfile) {
+			ZeroMemory(local->lockProfile, sizeof(LockProfile));
+		} else {
+			local->lockProfile = (LockProfile *) OSHeapAllocate(sizeof(LockProfile), true);
+		}
+	}
+
+	__sync_synchronize();
+	lockProfilerEnabled = true;
+}
+
+void LockProfilerStop() {
+	lockProfilerMutex.Acquire();
+	Defer(lockProfilerMutex.Release());
+
+	if (!lockProfilerEnabled) return;
+	lockProfilerEnabled = false;
+	__sync_synchronize();
+
+	// The format is parsed by util/analyse_mutex_log.cpp.
+	Print("LockProfile: begin %d\n", timeStampTicksPerMs);
+
+	for (uintptr_t i = 0; i < MAX_PROCESSORS; i++) {
+		CPULocalStorage *local = scheduler.localStorage[i];
+		if (!local || !local->lockProfile) continue;
+		LockProfile *profile = local->lockProfile;
+
+		for (uintptr_t j = 0; j < LOCK_PROFILE_ENTRIES; j++) {
+			LockProfileEntry *entry = profile->entries + j;
+			if (!entry->address) continue;
+
+			Print("LockProfile: %c %x %d %d %d %d %d\n", entry->spinlock ? 'S' : 'M', entry->address,
+					entry->acquisitions, entry->contendedAcquisitions,
+					entry->waitTicks, entry->maxWaitTicks, entry->holdTicks);
+		}
+
+		if (profile->droppedRecords) {
+			Print("LockProfile: dropped %d\n", profile->droppedRecords);
+		}
+	}
+
+	Print("LockProfile: end\n");
+}
+
 void Spinlock::Acquire() {
 	if (scheduler.panic) return;
 
@@ -236,9 +542,28 @@ void Spinlock::Acquire() {
 		temp++;
 	}
 
-	while (__sync_val_compare_and_swap(&state, 0, 1));
+	bool profile = lockProfilerEnabled && storage;
+	uint64_t start = profile ? ProcessorReadTimeStamp() : 0;
+
+	uint16_t ticket = __sync_fetch_and_add(&nextTicket, 1);
+	bool contended = nowServing != ticket;
+
+	if (contended) {
+		if (!start && statistics) start = ProcessorReadTimeStamp();
+		while (nowServing != ticket) __builtin_ia32_pause();
+
+		if (statistics) {
+			statistics->contendedAcquisitions++;
+			statistics->spinTicks += ProcessorReadTimeStamp() - start;
+		}
+	}
+
 	__sync_synchronize();
 
+	if (statistics) {
+		statistics->acquisitions++;
+	}
+
 	interruptsEnabled = _interruptsEnabled;
 
 	if (storage) {
@@ -252,6 +577,11 @@ void Spinlock::Acquire() {
 	}
 
 	acquireAddress = (uintptr_t) __builtin_return_address(0);
+
+	if (profile) {
+		acquireTimeStamp = ProcessorReadTimeStamp();
+		LockProfilerAcquired(acquireAddress, true, contended, acquireTimeStamp - start);
+	}
 }
 
 void Spinlock::Release(bool force) {
@@ -270,8 +600,14 @@ void Spinlock::Release(bool force) {
 	
 	volatile bool wereInterruptsEnabled = interruptsEnabled;
 
+	if (acquireTimeStamp) {
+		LockProfilerReleased(acquireAddress, true, ProcessorReadTimeStamp() - acquireTimeStamp);
+		acquireTimeStamp = 0;
+	}
+
 	owner = nullptr;
-	state = 0;
+	__sync_synchronize();
+	nowServing = nowServing + 1;
 
 	if (wereInterruptsEnabled) ProcessorEnableInterrupts();
 
@@ -283,30 +619,38 @@ void Spinlock::AssertLocked() {
 
 	CPULocalStorage *storage = GetLocalStorage();
 
-	if (!state || ProcessorAreInterruptsEnabled() 
+	if (nextTicket == nowServing || ProcessorAreInterruptsEnabled() 
 			|| (storage && owner != storage->currentThread)) {
 		KernelPanic("Spinlock::AssertLocked - Spinlock not correctly acquired\n"
 				"Return address = %x.\n"
-				"state = %d, ProcessorAreInterruptsEnabled() = %d, owner = %x\n",
-				__builtin_return_address(0), state, 
+				"nextTicket = %d, nowServing = %d, ProcessorAreInterruptsEnabled() = %d, owner = %x\n",
+				__builtin_return_address(0), nextTicket, nowServing,
 				ProcessorAreInterruptsEnabled(), owner);
 	}
 }
 
-void Scheduler::AddActiveThread(Thread *thread, bool start) {
-	if (thread->type == THREAD_ASYNC_TASK) {
-		// An asynchronous task thread was unblocked.
-		// It will be run immediately, so there's no need to add it to the active thread list.
+void Spinlock::EnableStatistics(const char *name) {
+	if (statistics) return;
+
+	uintptr_t index = __sync_fetch_and_add(&spinlockStatisticsCount, 1);
+
+	if (index >= MAX_SPINLOCK_STATISTICS) {
+		KernelLog(LOG_WARNING, "Spinlock::EnableStatistics - Too many spinlocks with statistics; ignoring %z.\n", name);
 		return;
 	}
-	
+
+	spinlockStatistics[index].name = name;
+	statistics = spinlockStatistics + index;
+}
+
+void Scheduler::AddActiveThread(Thread *thread, bool start) {
 	lock.AssertLocked();
 
 	if (thread->state != THREAD_ACTIVE) {
 		KernelPanic("Scheduler::AddActiveThread - Thread %d not active\n", thread->id);
 	} else if (thread->executing) {
 		KernelPanic("Scheduler::AddActiveThread - Thread %d executing\n", thread->id);
-	} else if (thread->type != THREAD_NORMAL) {
+	} else if (thread->type != THREAD_NORMAL && thread->type != THREAD_ASYNC_TASK) {
 		KernelPanic("Scheduler::AddActiveThread - Thread %d has type %d\n", thread->id, thread->type);
 	} else if (thread->item[0].list) {
 		KernelPanic("Scheduler::AddActiveThread - Thread %d is already in queue %x.\n", thread->id, thread->item[0].list);
@@ -316,151 +660,553 @@ void Scheduler::AddActiveThread(Thread *thread, bool start) {
 		// The thread is paused, so we can put it into the paused queue until it is resumed.
 		pausedThreads.InsertStart(&thread->item[0]);
 	} else {
-		if (start) {
-			activeThreads.InsertStart(&thread->item[0]);
-		} else {
-			activeThreads.InsertEnd(&thread->item[0]);
+		// Queue the thread on the processor it last executed on, so its cache is still warm.
+		// New threads, and threads whose last processor is busier than this one, are queued here instead.
+		// The queues' counts are read without their locks, since they're only used to balance the load.
+		CPULocalStorage *local = GetLocalStorage(), *target = CanRunOn(thread, local) ? local : nullptr;
+
+		if (thread->timeSlices && thread->executingProcessorID != (int) local->processorID) {
+			CPULocalStorage *last = localStorage[thread->executingProcessorID];
+
+			if (last && CanRunOn(thread, last) && (!target || QueuedThreadCount(last) <= QueuedThreadCount(target))) {
+				target = last;
+			}
 		}
-	}
-}
 
-void Scheduler::InsertNewThread(Thread *thread, bool addToActiveList, Process *owner) {
-	lock.Acquire();
-	Defer(lock.Release());
+		if (!target) {
+			// The thread can't run on this processor, so queue it on the least busy processor it can run on.
+			for (uintptr_t i = 0; i < MAX_PROCESSORS; i++) {
+				CPULocalStorage *other = localStorage[i];
 
-	// New threads are initialised here.
-	thread->id = nextThreadID++;
-	thread->process = owner;
+				if (other && CanRunOn(thread, other) && (!target || QueuedThreadCount(other) < QueuedThreadCount(target))) {
+					target = other;
+				}
+			}
 
-	owner->handles++; 	// Each thread owns a handles to the owner process.
-				// This makes sure the process isn't destroyed before all its threads have been destroyed.
+			if (!target) {
+				KernelPanic("Scheduler::AddActiveThread - Thread %d cannot run on any processor.\n", thread->id);
+			}
+		}
 
-	thread->processItem.thisItem = thread;
-	owner->threads.InsertEnd(&thread->processItem);
+		LinkedList<Thread> *queue = target->activeThreads + EffectivePriority(thread);
 
-	// KernelLog(LOG_VERBOSE, "Create thread ID %d, type %d, owner process %d\n", thread->id, thread->type, owner->id);
+		target->queueLock.Acquire();
 
-	for (uintptr_t i = 0; i < OS_MAX_WAIT_COUNT; i++) {
-		thread->item[i].thisItem = thread;
+		if (start) {
+			queue->InsertStart(&thread->item[0]);
+		} else {
+			queue->InsertEnd(&thread->item[0]);
+		}
+
+		thread->scheduledProcessor = target;
+
+		// The target's currentThread can't change while its queueLock is held.
+		WakeProcessor(target, thread);
+
+		target->queueLock.Release();
 	}
+}
 
-	thread->allItem.thisItem = thread;
+OSThreadPriority Scheduler::EffectivePriority(Thread *thread) {
+	OSThreadPriority priority = thread->boosted ? OS_THREAD_PRIORITY_HIGH : thread->priority;
 
-	if (addToActiveList) {
-		// Add the thread to the start of the active thread list to make sure that it runs immediately.
-		AddActiveThread(thread, true);
-	} else {
-		// Some threads (such as idle threads) do this themselves.
+	if (thread->inheritsPriority && thread->inheritedPriority < priority) {
+		priority = thread->inheritedPriority;
 	}
 
-	allThreads.InsertStart(&thread->allItem);
+	return priority;
 }
 
-Thread *Scheduler::SpawnThread(uintptr_t startAddress, uintptr_t argument, Process *process, bool userland, bool addToActiveThreads) {
-	scheduler.lock.Acquire();
-	bool terminating = process->terminating;
-	scheduler.lock.Release();
+void Scheduler::RequeueThread(Thread *thread) {
+	lock.AssertLocked();
 
-	if (terminating) return nullptr;
+	// A thread without a scheduledProcessor can't get one without the scheduler's lock.
+	if (thread->state == THREAD_ACTIVE && thread->scheduledProcessor && DequeueThread(thread)) {
+		AddActiveThread(thread, false);
+	}
+}
 
-	Thread *thread = (Thread *) threadPool.Add();
-	// KernelLog(LOG_VERBOSE, "Created thread, %x to start at %x\n", thread, startAddress);
-	thread->isKernelThread = !userland;
+CPULocalStorage *Scheduler::LockThreadProcessor(Thread *thread) {
+	lock.AssertLocked();
 
-	// 2 handles to the thread:
-	// 	One for spawning the thread, 
-	// 	and the other for remaining during the thread's life.
-	thread->handles = 2;
+	while (true) {
+		CPULocalStorage *storage = thread->scheduledProcessor;
 
-	// Allocate the thread's stacks.
-	// TODO Temporarily set very large, revert this?
-	// uintptr_t kernelStackSize = userland ? 0x4000 : 0x10000;
-	uintptr_t kernelStackSize = userland ? 0x20000 : 0x20000;
-	uintptr_t userStackSize = userland ? 0x100000 : 0x10000;
-	uintptr_t stack, kernelStack = (uintptr_t) kernelVMM.Allocate("KernStack", kernelStackSize, VMM_MAP_ALL);
+		if (!storage) {
+			return nullptr;
+		}
 
-	if (userland) {
-		stack = (uintptr_t) process->vmm->Allocate("UserStack", userStackSize, VMM_MAP_LAZY);
-	} else {
-		stack = kernelStack;
-	}
+		storage->queueLock.Acquire();
 
-	// KernelLog(LOG_VERBOSE, "Spawning thread with stacks (k,u): %x->%x, %x->%x\n", kernelStack, kernelStack + kernelStackSize, stack, stack + userStackSize);
+		if (thread->scheduledProcessor == storage) {
+			return storage;
+		}
 
-	thread->kernelStackBase = kernelStack;
-	thread->userStackBase = userland ? stack : 0;
+		// The thread was stolen by another processor before the lock was acquired.
+		storage->queueLock.Release();
+	}
+}
 
-	thread->terminatableState = userland ? THREAD_TERMINATABLE : THREAD_IN_SYSCALL;
-	// KernelLog(LOG_VERBOSE, "Thread %x terminatable = %d (creation)\n", thread, thread->terminatableState);
+bool Scheduler::DequeueThread(Thread *thread) {
+	lock.AssertLocked();
 
-#ifdef ARCH_X86_64
-	InterruptContext *context = ((InterruptContext *) (kernelStack + kernelStackSize - 8)) - 1;
-	thread->interruptContext = context;
-	thread->kernelStack = kernelStack + kernelStackSize - 8;
+	CPULocalStorage *storage = LockThreadProcessor(thread);
+	bool executing = thread->executing;
 
-	if (userland) {
-		context->cs = 0x5B;
-		context->ds = 0x63;
-		context->ss = 0x63;
-	} else {
-		context->cs = 0x48;
-		context->ds = 0x50;
-		context->ss = 0x50;
+	if (!executing && thread->item[0].list) {
+		// The thread is either in its processor's queue, or the paused queue, which is protected by the scheduler's lock.
+		thread->item[0].RemoveFromList();
+		thread->scheduledProcessor = nullptr;
 	}
 
-	context->_check = 0x123456789ABCDEF; // Stack corruption detection.
-	context->flags = 1 << 9; // Interrupt flag
-	context->rip = startAddress;
-	context->rsp = stack + userStackSize - 8; // The stack should be 16-byte aligned before the call instruction.
-	context->rdi = argument;
-#endif
+	if (storage) {
+		storage->queueLock.Release();
+	}
 
-	// KernelLog(LOG_VERBOSE, "Starting off new thread %x at %x\n", thread, startAddress);
+	return !executing;
+}
 
-	InsertNewThread(thread, addToActiveThreads, process);
+LinkedItem<Thread> *Scheduler::HighestPriorityWaiter(LinkedList<Thread> *blockedThreads) {
+	lock.AssertLocked();
 
-	return thread;
+	LinkedItem<Thread> *item = blockedThreads->firstItem, *highest = nullptr;
+
+	while (item) {
+		if (!highest || EffectivePriority(item->thisItem) < EffectivePriority(highest->thisItem)) {
+			highest = item;
+		}
+
+		item = item->nextItem;
+	}
+
+	return highest;
 }
 
-void Scheduler::TerminateProcess(Process *process) {
-	scheduler.lock.Acquire();
-	Defer(scheduler.lock.Release());
+void Scheduler::InheritPriority(Mutex *mutex) {
+	lock.AssertLocked();
 
-	process->terminating = true;
+	// Follow the chain of blocking mutexes.
+	// The depth is limited in case there's a deadlock.
+	for (uintptr_t depth = 0; mutex && depth < 16; depth++) {
+		Thread *owner = mutex->owner;
+		LinkedItem<Thread> *waiter = HighestPriorityWaiter(&mutex->blockedThreads);
 
-	Thread *currentThread = GetCurrentThread();
-	bool isCurrentProcess = process == currentThread->process;
-	bool foundCurrentThread = false;
+		if (!owner || owner == (Thread *) 1 || !waiter) {
+			return;
+		}
 
-	LinkedItem<Thread> *thread = process->threads.firstItem;
+		if (!mutex->contendedItem.list) {
+			mutex->contendedItem.thisItem = mutex;
+			owner->contendedMutexes.InsertEnd(&mutex->contendedItem);
+		}
 
-	while (thread) {
-		Thread *threadObject = thread->thisItem;
-		thread = thread->nextItem;
+		OSThreadPriority priority = EffectivePriority(waiter->thisItem);
 
-		if (threadObject != currentThread) {
-			TerminateThread(threadObject, true);
-		} else if (isCurrentProcess) {
-			foundCurrentThread = true;
-		} else {
-			KernelPanic("Scheduler::TerminateProcess - Found current thread in the wrong process?!\n");
+		if (EffectivePriority(owner) <= priority) {
+			return;
 		}
-	}
 
-	if (!foundCurrentThread && isCurrentProcess) {
-		KernelPanic("Scheduler::TerminateProcess - Could not find current thread in the current process?!\n");
-	} else if (isCurrentProcess) {
-		TerminateThread(currentThread, true);
+		owner->inheritsPriority = true;
+		owner->inheritedPriority = priority;
+		RequeueThread(owner);
+
+		mutex = owner->state == THREAD_WAITING_MUTEX ? owner->blockingMutex : nullptr;
 	}
 }
 
-void Scheduler::TerminateThread(Thread *thread, bool lockAlreadyAcquired) {
-	if (!lockAlreadyAcquired) {
-		scheduler.lock.Acquire();
-	}
+void Scheduler::UpdateInheritedPriority(Thread *thread) {
+	lock.AssertLocked();
 
-	if (thread->terminating) {
-		return;
+	thread->inheritsPriority = false;
+
+	LinkedItem<Mutex> *item = thread->contendedMutexes.firstItem;
+
+	while (item) {
+		LinkedItem<Thread> *waiter = HighestPriorityWaiter(&item->thisItem->blockedThreads);
+
+		if (waiter) {
+			OSThreadPriority priority = EffectivePriority(waiter->thisItem);
+
+			if (!thread->inheritsPriority || priority < thread->inheritedPriority) {
+				thread->inheritsPriority = true;
+				thread->inheritedPriority = priority;
+			}
+		}
+
+		item = item->nextItem;
+	}
+}
+
+size_t Scheduler::QueuedThreadCount(CPULocalStorage *storage) {
+	size_t count = 0;
+
+	for (uintptr_t i = 0; i < OS_THREAD_PRIORITY_COUNT; i++) {
+		count += storage->activeThreads[i].count;
+	}
+
+	return count;
+}
+
+void Scheduler::SetThreadPriority(Thread *thread, OSThreadPriority priority) {
+	lock.Acquire();
+	Defer(lock.Release());
+
+	thread->priority = priority;
+	RequeueThread(thread);
+
+	if (thread->state == THREAD_WAITING_MUTEX && thread->item[0].list) {
+		InheritPriority(thread->blockingMutex);
+	}
+}
+
+bool Scheduler::CanRunOn(Thread *thread, CPULocalStorage *storage) {
+	uint64_t bit = storage->processorID < 64 ? (uint64_t) 1 << storage->processorID : 0;
+	return thread->affinity ? (thread->affinity & bit) : !(reservedProcessors & bit);
+}
+
+void Scheduler::UpdateReservedProcessors() {
+	lock.AssertLocked();
+
+	uint64_t reserved = 0, existing = 0;
+
+	LinkedItem<Thread> *item = allThreads.firstItem;
+
+	while (item) {
+		if (item->thisItem->exclusiveAffinity) reserved |= item->thisItem->affinity;
+		item = item->nextItem;
+	}
+
+	for (uintptr_t i = 0; i < 64; i++) {
+		if (localStorage[i]) existing |= (uint64_t) 1 << i;
+	}
+
+	// Leave at least one processor for everything else.
+	if ((reserved & existing) == existing) reserved = 0;
+
+	// Threads already queued on newly reserved processors will be moved after their next time slice.
+	reservedProcessors = reserved;
+}
+
+OSError Scheduler::SetThreadAffinity(Thread *thread, uint64_t affinity, bool exclusive) {
+	lock.Acquire();
+	Defer(lock.Release());
+
+	uint64_t existing = 0;
+
+	for (uintptr_t i = 0; i < 64; i++) {
+		if (localStorage[i]) existing |= (uint64_t) 1 << i;
+	}
+
+	if (affinity && !(affinity & existing)) {
+		return OS_ERROR_UNKNOWN_OPERATION_FAILURE;
+	}
+
+	if (exclusive && affinity) {
+		// At most half of the processors can be reserved.
+		uint64_t reserved = affinity;
+		LinkedItem<Thread> *item = allThreads.firstItem;
+
+		while (item) {
+			if (item->thisItem->exclusiveAffinity && item->thisItem != thread) reserved |= item->thisItem->affinity;
+			item = item->nextItem;
+		}
+
+		if (__builtin_popcountll(reserved & existing) > __builtin_popcountll(existing) / 2) {
+			return OS_ERROR_PERMISSION_NOT_GRANTED;
+		}
+	}
+
+	bool wasExclusive = thread->exclusiveAffinity;
+	thread->affinity = affinity;
+	thread->exclusiveAffinity = exclusive && affinity;
+
+	if (wasExclusive || thread->exclusiveAffinity) {
+		UpdateReservedProcessors();
+	}
+
+	// Move the thread off processors it can no longer run on.
+	// Holding the queueLock of the thread's processor stops it being queued or stolen while it's checked.
+	CPULocalStorage *storage = LockThreadProcessor(thread);
+
+	if (storage && thread->executing) {
+		if (!CanRunOn(thread, storage)) {
+			// Pre-empt the thread; Scheduler::Yield will queue it on another processor.
+			if (storage == GetLocalStorage()) {
+				storage->timerDeadlineMs = ReadTimeMs() + 1;
+				NextTimer(1);
+			} else {
+				ProcessorSendIPI(YIELD_IPI, false, storage->processorID);
+			}
+		}
+
+		storage->queueLock.Release();
+	} else {
+		if (storage) storage->queueLock.Release();
+		RequeueThread(thread);
+	}
+
+	return OS_SUCCESS;
+}
+
+void Scheduler::WakeProcessor(CPULocalStorage *target, Thread *thread) {
+	lock.AssertLocked();
+
+	CPULocalStorage *local = GetLocalStorage();
+	uint64_t timeMs = ReadTimeMs(), sliceEndMs = timeMs + TIME_SLICE_MS;
+
+	// If the thread has a higher priority than the one executing, then it should be run as soon as possible.
+	bool preempt = target->currentThread->type == THREAD_IDLE 
+		|| EffectivePriority(thread) < EffectivePriority(target->currentThread);
+
+	if (target == local) {
+		// The thread will run when the current thread's time slice ends.
+		uint64_t deadlineMs = preempt ? timeMs + 1 : sliceEndMs;
+
+		if (!local->timerDeadlineMs || local->timerDeadlineMs > deadlineMs) {
+			local->timerDeadlineMs = deadlineMs;
+			NextTimer(preempt ? 1 : TIME_SLICE_MS);
+		}
+
+		return;
+	}
+
+	// Prefer to wake an idle processor, which will run or steal the thread immediately.
+	CPULocalStorage *wake = nullptr;
+
+	if (target->currentThread == target->idleThread) {
+		wake = target;
+	} else {
+		for (uintptr_t i = 0; i < MAX_PROCESSORS; i++) {
+			CPULocalStorage *other = localStorage[i];
+
+			if (other && other != local && other->currentThread == other->idleThread && !QueuedThreadCount(other) && CanRunOn(thread, other)) {
+				wake = other;
+				break;
+			}
+		}
+	}
+
+	if (!wake && (preempt || !target->timerDeadlineMs || target->timerDeadlineMs > sliceEndMs)) {
+		// The target processor won't be interrupted soon enough, so it needs to reschedule.
+		wake = target;
+	}
+
+	if (wake) {
+		// Sent without the IPI lock, so that there is no lock ordering with the scheduler's lock.
+		ProcessorSendIPI(YIELD_IPI, false, wake->processorID);
+	}
+}
+
+Thread *Scheduler::StealThread(CPULocalStorage *local) {
+	// Steal from the busiest queue of the highest priority that has any threads waiting,
+	// that this processor is allowed to run.
+	// The counts are read without the queues' locks to choose the processor to steal from,
+	// and only that processor's queueLock is held while the thread is taken.
+	for (uintptr_t priority = 0; priority < OS_THREAD_PRIORITY_COUNT; priority++) {
+		CPULocalStorage *busiest = nullptr;
+		size_t busiestCount = 0;
+
+		for (uintptr_t i = 0; i < MAX_PROCESSORS; i++) {
+			CPULocalStorage *other = localStorage[i];
+
+			if (other && other != local && other->activeThreads[priority].count > busiestCount) {
+				busiest = other;
+				busiestCount = other->activeThreads[priority].count;
+			}
+		}
+
+		// Try the busiest processor first, and then the rest in order, 
+		// in case none of the busiest processor's threads can run here.
+		for (intptr_t i = -1; busiest && i < MAX_PROCESSORS; i++) {
+			CPULocalStorage *other = i == -1 ? busiest : localStorage[i];
+
+			if (!other || other == local || (i != -1 && other == busiest) || !other->activeThreads[priority].count) {
+				continue;
+			}
+
+			other->queueLock.Acquire();
+
+			// Take the thread nearest the end of the queue, since it won't be run soon on its own processor.
+			LinkedItem<Thread> *item = other->activeThreads[priority].lastItem;
+
+			while (item && !CanRunOn(item->thisItem, local)) {
+				item = item->previousItem;
+			}
+
+			if (item) {
+				// The thread is marked as executing before the lock is released,
+				// so that it's never seen as neither queued nor executing.
+				Thread *thread = item->thisItem;
+				item->RemoveFromList();
+				thread->executing = true;
+				thread->executingProcessorID = local->processorID;
+				thread->scheduledProcessor = local;
+				other->queueLock.Release();
+				return thread;
+			}
+
+			other->queueLock.Release();
+		}
+	}
+
+	return nullptr;
+}
+
+void Scheduler::InsertNewThread(Thread *thread, bool addToActiveList, Process *owner) {
+	lock.Acquire();
+	Defer(lock.Release());
+
+	// New threads are initialised here.
+	thread->id = nextThreadID++;
+	thread->process = owner;
+
+	owner->handles++; 	// Each thread owns a handles to the owner process.
+				// This makes sure the process isn't destroyed before all its threads have been destroyed.
+
+	thread->processItem.thisItem = thread;
+	owner->threads.InsertEnd(&thread->processItem);
+
+	// KernelLog(LOG_VERBOSE, "Create thread ID %d, type %d, owner process %d\n", thread->id, thread->type, owner->id);
+
+	for (uintptr_t i = 0; i < OS_MAX_WAIT_COUNT; i++) {
+		thread->item[i].thisItem = thread;
+	}
+
+	thread->allItem.thisItem = thread;
+	thread->accountingTimeStamp = ProcessorReadTimeStamp();
+
+	if (addToActiveList) {
+		// Add the thread to the start of the active thread list to make sure that it runs immediately.
+		AddActiveThread(thread, true);
+	} else {
+		// Some threads (such as idle threads) do this themselves.
+	}
+
+	allThreads.InsertStart(&thread->allItem);
+}
+
+Thread *Scheduler::SpawnThread(uintptr_t startAddress, uintptr_t argument, Process *process, bool userland, bool addToActiveThreads) {
+	scheduler.lock.Acquire();
+	bool terminating = process->terminating;
+	uintptr_t stack = 0;
+
+	// Reuse the stack of one of the process's terminated threads.
+	if (userland && !terminating && process->userStackCacheCount) {
+		stack = process->userStackCache[--process->userStackCacheCount];
+	}
+
+	scheduler.lock.Release();
+
+	if (terminating) return nullptr;
+
+	Thread *thread = AllocateThread();
+	// KernelLog(LOG_VERBOSE, "Created thread, %x to start at %x\n", thread, startAddress);
+	thread->isKernelThread = !userland;
+
+	// 2 handles to the thread:
+	// 	One for spawning the thread, 
+	// 	and the other for remaining during the thread's life.
+	thread->handles = 2;
+
+	// Allocate the thread's stacks.
+	uintptr_t kernelStackSize = KERNEL_STACK_SIZE;
+	uintptr_t userStackSize = userland ? USER_STACK_SIZE : 0x10000;
+	uintptr_t kernelStack = AllocateKernelStack();
+
+	if (!userland) {
+		stack = kernelStack;
+	} else if (!stack) {
+		stack = (uintptr_t) process->vmm->Allocate("UserStack", userStackSize, VMM_MAP_LAZY);
+	}
+
+	// KernelLog(LOG_VERBOSE, "Spawning thread with stacks (k,u): %x->%x, %x->%x\n", kernelStack, kernelStack + kernelStackSize, stack, stack + userStackSize);
+
+	thread->kernelStackBase = kernelStack;
+	thread->userStackBase = userland ? stack : 0;
+
+	thread->terminatableState = userland ? THREAD_TERMINATABLE : THREAD_IN_SYSCALL;
+	thread->priority = OS_THREAD_PRIORITY_NORMAL;
+	// KernelLog(LOG_VERBOSE, "Thread %x terminatable = %d (creation)\n", thread, thread->terminatableState);
+
+#ifdef ARCH_X86_64
+	InterruptContext *context = ((InterruptContext *) (kernelStack + kernelStackSize - 8)) - 1;
+	thread->interruptContext = context;
+	thread->kernelStack = kernelStack + kernelStackSize - 8;
+
+	if (userland) {
+		context->cs = 0x5B;
+		context->ds = 0x63;
+		context->ss = 0x63;
+	} else {
+		context->cs = 0x48;
+		context->ds = 0x50;
+		context->ss = 0x50;
+	}
+
+	context->_check = 0x123456789ABCDEF; // Stack corruption detection.
+	context->flags = 1 << 9; // Interrupt flag
+	context->rip = startAddress;
+	context->rsp = stack + userStackSize - 8; // The stack should be 16-byte aligned before the call instruction.
+	context->rdi = argument;
+#endif
+
+	// KernelLog(LOG_VERBOSE, "Starting off new thread %x at %x\n", thread, startAddress);
+
+	InsertNewThread(thread, addToActiveThreads, process);
+
+	return thread;
+}
+
+void Scheduler::TerminateProcess(Process *process) {
+	scheduler.lock.Acquire();
+	Defer(scheduler.lock.Release());
+
+	process->terminating = true;
+
+	Thread *currentThread = GetCurrentThread();
+	bool isCurrentProcess = process == currentThread->process;
+	bool foundCurrentThread = false;
+
+	LinkedItem<Thread> *thread = process->threads.firstItem;
+	bool releaseProcessors = false;
+
+	while (thread) {
+		Thread *threadObject = thread->thisItem;
+		thread = thread->nextItem;
+
+		// Release the process's reserved processors now, rather than when its threads are eventually killed.
+		if (threadObject->exclusiveAffinity) {
+			threadObject->exclusiveAffinity = false;
+			releaseProcessors = true;
+		}
+
+		if (threadObject != currentThread) {
+			TerminateThread(threadObject, true);
+		} else if (isCurrentProcess) {
+			foundCurrentThread = true;
+		} else {
+			KernelPanic("Scheduler::TerminateProcess - Found current thread in the wrong process?!\n");
+		}
+	}
+
+	if (releaseProcessors) {
+		UpdateReservedProcessors();
+	}
+
+	if (!foundCurrentThread && isCurrentProcess) {
+		KernelPanic("Scheduler::TerminateProcess - Could not find current thread in the current process?!\n");
+	} else if (isCurrentProcess) {
+		TerminateThread(currentThread, true);
+	}
+}
+
+void Scheduler::TerminateThread(Thread *thread, bool lockAlreadyAcquired) {
+	if (!lockAlreadyAcquired) {
+		scheduler.lock.Acquire();
+	}
+
+	if (thread->terminating) {
+		return;
 	}
 
 	thread->terminating = true;
@@ -475,20 +1221,18 @@ void Scheduler::TerminateThread(Thread *thread, bool lockAlreadyAcquired) {
 		KernelPanic("Scheduler::TerminateThread - ProcessorFakeTimerInterrupt returned.\n");
 	} else {
 		if (thread->terminatableState == THREAD_TERMINATABLE) {
-			if (thread->executing) {
+			if (thread->state != THREAD_ACTIVE && !thread->executing) {
+				KernelPanic("Scheduler::TerminateThread - Terminatable thread non-active.\n");
+			}
+
+			if (!DequeueThread(thread)) {
 				// The thread is executing, so the next time it tries to make a system call or
 				// is pre-empted, it will be terminated.
 				if (!lockAlreadyAcquired) scheduler.lock.Release();
 			} else {
-				if (thread->state != THREAD_ACTIVE) {
-					KernelPanic("Scheduler::TerminateThread - Terminatable thread non-active.\n");
-				}
-
 				// The thread is terminatable and it isn't executing.
-				// Remove it from its queue, and then remove the thread.
-				if (!thread->paused) 	activeThreads.Remove(&thread->item[0]);
-				else			pausedThreads.Remove(&thread->item[0]);
-				RegisterAsyncTask(KillThread, thread, thread->process, true);
+				// It has been removed from its queue, so now remove the thread.
+				RegisterAsyncTask(&thread->killTask, KillThread, thread, thread->process);
 				if (!lockAlreadyAcquired) scheduler.lock.Release();
 			}
 		} else if (thread->terminatableState == THREAD_USER_BLOCK_REQUEST) {
@@ -587,6 +1331,9 @@ void Scheduler::Initialise() {
 	threadPool.Initialise(sizeof(Thread));
 	processPool.Initialise(sizeof(Process));
 
+	lock.EnableStatistics("Scheduler");
+	ipiLock.EnableStatistics("IPI");
+
 	char *kernelProcessPath = (char *) "Kernel";
 	kernelProcess = SpawnProcess(kernelProcessPath, CStringLength(kernelProcessPath), true);
 	kernelProcess->vmm = &kernelVMM;
@@ -596,26 +1343,155 @@ void Scheduler::Initialise() {
 
 unsigned currentProcessorID = 0;
 
-void AsyncTaskThread() {
-	CPULocalStorage *local = GetLocalStorage();
+void AsyncTaskQueue::Initialise() {
+	head = tail = &stub;
+	stub.next = nullptr;
+	available.autoReset = true;
+}
+
+void AsyncTaskQueue::Push(AsyncTask *task) {
+	task->next = nullptr;
+	AsyncTask *previous = (AsyncTask *) __sync_lock_test_and_set(&head, task);
+	previous->next = task;
+}
+
+AsyncTask *AsyncTaskQueue::Pop() {
+	consumerLock.Acquire();
+	Defer(consumerLock.Release());
+
+	AsyncTask *task = tail, *next = task->next;
+
+	if (task == &stub) {
+		// Skip over the stub.
+		if (!next) return nullptr;
+		tail = task = next;
+		next = next->next;
+	}
+
+	if (next) {
+		tail = next;
+		return task;
+	}
+
+	if (task != head) {
+		// A task is being pushed, but it hasn't been linked yet.
+		// The producer will set the available event after it's done.
+		return nullptr;
+	}
+
+	// This is the last task in the queue.
+	// Put the stub back behind it, so that the tail never becomes empty.
+	Push(&stub);
+	next = task->next;
+
+	if (next) {
+		tail = next;
+		return task;
+	}
+
+	return nullptr;
+}
+
+void AsyncTaskReserveReturn(AsyncTask *task) {
+	while (true) {
+		AsyncTask *first = asyncTaskReserve;
+		task->next = first;
+		if (__sync_bool_compare_and_swap(&asyncTaskReserve, first, task)) break;
+	}
+
+	__sync_fetch_and_add(&asyncTaskReserveCount, 1);
+}
+
+AsyncTask *AsyncTaskReserveTake() {
+	// Tasks are only taken with the scheduler's lock acquired,
+	// so the first task can't be taken and returned before we compare it.
+	scheduler.lock.AssertLocked();
+
+	while (true) {
+		AsyncTask *first = asyncTaskReserve;
+		if (!first) return nullptr;
+
+		if (__sync_bool_compare_and_swap(&asyncTaskReserve, first, first->next)) {
+			__sync_fetch_and_sub(&asyncTaskReserveCount, 1);
+			return first;
+		}
+	}
+}
+
+void AsyncTaskReserveRefill(size_t increaseTarget) {
+	asyncTaskReserveMutex.Acquire();
+	Defer(asyncTaskReserveMutex.Release());
+
+	asyncTaskReserveTarget += increaseTarget;
+
+	if (asyncTaskReserveExhausted) {
+		asyncTaskReserveExhausted = false;
+		asyncTaskReserveTarget *= 2;
+	}
+
+	size_t count = asyncTaskReserveCount;
+	if (count >= asyncTaskReserveTarget) return;
+	count = asyncTaskReserveTarget - count;
+
+	AsyncTask *tasks = (AsyncTask *) OSHeapAllocate(sizeof(AsyncTask) * count, true);
+	if (!tasks) return;
+
+	for (uintptr_t i = 0; i < count; i++) {
+		AsyncTaskReserveReturn(tasks + i);
+	}
+}
+
+void AsyncTaskThread(AsyncTaskQueue *queue) {
+	Thread *thread = GetCurrentThread();
 
 	while (true) {
-		if (local->asyncTasksRead == local->asyncTasksWrite) {
-			ProcessorFakeTimerInterrupt();
+		AsyncTask *task = queue->Pop();
+
+		if (!task) {
+			queue->available.Wait(OS_WAIT_NO_TIMEOUT);
+			continue;
+		}
+
+		// An embedded task's object might be freed by the callback, so the task must not be accessed after it's called.
+		// Clearing queued first means the task can be registered again while the callback is running.
+		AsyncTaskCallback callback = task->callback;
+		void *argument = task->argument;
+		VirtualAddressSpace *addressSpace = task->addressSpace;
+
+		if (task->storage == ASYNC_TASK_FROM_RESERVE) {
+			AsyncTaskReserveReturn(task);
+		} else if (task->storage == ASYNC_TASK_FROM_HEAP) {
+			OSHeapFree(task, sizeof(AsyncTask));
 		} else {
-			volatile AsyncTask *task = local->asyncTasks + local->asyncTasksRead;
+			__sync_synchronize();
+			task->queued = false;
+		}
 
-			if (task->addressSpace) {
-				local->currentThread->asyncTempAddressSpace = task->addressSpace;
-				ProcessorSetAddressSpace(VIRTUAL_ADDRESS_SPACE_IDENTIFIER(task->addressSpace));
-			}
+		if (addressSpace) {
+			thread->asyncTempAddressSpace = addressSpace;
+			ProcessorSwitchAddressSpace(addressSpace);
+		}
+
+		callback(argument);
+		thread->asyncTempAddressSpace = nullptr;
+		ProcessorSwitchAddressSpace(kernelVMM.virtualAddressSpace);
+
+		if (asyncTaskReserveExhausted || asyncTaskReserveCount < asyncTaskReserveTarget / 2) {
+			AsyncTaskReserveRefill(0);
+		}
+	}
+}
 
-			task->callback(task->argument);
-			local->currentThread->asyncTempAddressSpace = nullptr;
-			ProcessorSetAddressSpace(VIRTUAL_ADDRESS_SPACE_IDENTIFIER(kernelVMM.virtualAddressSpace));
+void WorkerThread(AsyncTaskQueue *queue) {
+	while (true) {
+		AsyncTask *task = queue->Pop();
 
-			local->asyncTasksRead++;
+		if (!task) {
+			queue->available.Wait(OS_WAIT_NO_TIMEOUT);
+			continue;
 		}
+
+		task->callback(task->argument);
 	}
 }
 
@@ -641,12 +1517,35 @@ void Scheduler::CreateProcessorThreads() {
 	// Force release the lock because we've changed our currentThread value.
 	lock.Release(true);
 
+	local->timerWheel = (TimerWheel *) OSHeapAllocate(sizeof(TimerWheel), true);
+	local->asyncTasks.Initialise();
+	local->workQueue.Initialise();
+	AsyncTaskReserveRefill(ASYNC_TASK_RESERVE);
 	localStorage[local->processorID] = local;
 
 	InsertNewThread(idleThread, false, kernelProcess);
 
-	local->asyncTaskThread = SpawnThread((uintptr_t) AsyncTaskThread, 0, kernelProcess, false, false);
-	local->asyncTaskThread->type = THREAD_ASYNC_TASK;
+	for (uintptr_t i = 0; i < ASYNC_TASK_THREADS; i++) {
+		Thread *thread = SpawnThread((uintptr_t) AsyncTaskThread, (uintptr_t) &local->asyncTasks, kernelProcess, false, false);
+		thread->type = THREAD_ASYNC_TASK;
+		thread->priority = OS_THREAD_PRIORITY_HIGH;
+		local->asyncTaskThreads[i] = thread;
+
+		lock.Acquire();
+		AddActiveThread(thread, false);
+		lock.Release();
+	}
+
+	{
+		Thread *thread = SpawnThread((uintptr_t) WorkerThread, (uintptr_t) &local->workQueue, kernelProcess, false, false);
+		thread->physicalMemoryWindow = kernelVMM.Allocate("PMMR", PHYSICAL_MEMORY_MANIPULATION_REGION_PAGES * PAGE_SIZE, VMM_MAP_STRICT, 
+				VMM_REGION_PHYSICAL, 0, VMM_REGION_FLAG_OVERWRITABLE | VMM_REGION_FLAG_CACHABLE, nullptr); 
+		local->workerThread = thread;
+
+		lock.Acquire();
+		AddActiveThread(thread, false);
+		lock.Release();
+	}
 }
 
 void Scheduler::InitialiseAP() {
@@ -655,24 +1554,23 @@ void Scheduler::InitialiseAP() {
 	local->schedulerReady = true; // The processor can now be pre-empted.
 }
 
-void RegisterAsyncTask(AsyncTaskCallback callback, void *argument, Process *targetProcess, bool needed) {
+void RegisterAsyncTask(AsyncTask *task, AsyncTaskCallback callback, void *argument, Process *targetProcess, int processorID) {
 	scheduler.lock.AssertLocked();
 
 	if (targetProcess == nullptr) {
 		targetProcess = kernelProcess;
 	}
 
-	CPULocalStorage *local = GetLocalStorage();
-
-	int difference = local->asyncTasksWrite - local->asyncTasksRead;
-	if (difference < 0) difference += MAX_ASYNC_TASKS;
+	CPULocalStorage *local = processorID == -1 ? GetLocalStorage() : scheduler.localStorage[processorID];
 
-	if (difference >= MAX_ASYNC_TASKS / 2 && !needed) {
-		return;
+	if (!local) {
+		KernelPanic("RegisterAsyncTask - Processor %d does not exist.\n", processorID);
 	}
 
-	if (difference == MAX_ASYNC_TASKS - 1) {
-		KernelPanic("RegisterAsyncTask - Maximum number of queued asynchronous tasks reached.\n");
+	if (task->storage == ASYNC_TASK_EMBEDDED) {
+		// The task is already queued, and will run after this.
+		if (task->queued) return;
+		task->queued = true;
 	}
 
 	// We need to register tasks for terminating processes.
@@ -682,11 +1580,38 @@ void RegisterAsyncTask(AsyncTaskCallback callback, void *argument, Process *targ
 	}
 #endif
 
-	volatile AsyncTask *task = local->asyncTasks + local->asyncTasksWrite;
 	task->callback = callback;
 	task->argument = argument;
 	task->addressSpace = targetProcess->vmm->virtualAddressSpace;
-	local->asyncTasksWrite++;
+	local->asyncTasks.Push(task);
+	local->asyncTasks.available.Set(true, true);
+}
+
+AsyncTask *AllocateAsyncTask() {
+	AsyncTask *task = (AsyncTask *) OSHeapAllocate(sizeof(AsyncTask), true);
+	task->storage = ASYNC_TASK_FROM_HEAP;
+	return task;
+}
+
+void RegisterAsyncTask(AsyncTaskCallback callback, void *argument, Process *targetProcess, int processorID) {
+	scheduler.lock.AssertLocked();
+
+	// Keep the rest of the reserve for tasks registered while it is being refilled.
+	if (asyncTaskReserveCount < asyncTaskReserveTarget / 2) {
+		asyncTaskReserveExhausted = true;
+		return;
+	}
+
+	AsyncTask *task = AsyncTaskReserveTake();
+
+	if (!task) {
+		// The worker threads will double the size of the reserve.
+		asyncTaskReserveExhausted = true;
+		return;
+	}
+
+	task->storage = ASYNC_TASK_FROM_RESERVE;
+	RegisterAsyncTask(task, callback, argument, targetProcess, processorID);
 }
 
 void Scheduler::RemoveProcess(Process *process) {
@@ -701,6 +1626,7 @@ void Scheduler::RemoveProcess(Process *process) {
 
 	// Free all the remaining messages in the message queue.
 	OSHeapFree(process->messageQueue.messages);
+	CompletionPortDetach(&process->messageQueue.notEmpty);
 
 	// Destroy the virtual memory manager.
 	process->vmm->Destroy();
@@ -717,7 +1643,67 @@ void Scheduler::RemoveThread(Thread *thread) {
 
 	// KernelLog(LOG_INFO, "Removing thread %d.\n", thread->id);
 
-	scheduler.threadPool.Remove(thread);
+	// Make sure that a new thread at the same address isn't mistaken for the owner of a processor's FPU state.
+	for (uintptr_t i = 0; i < MAX_PROCESSORS; i++) {
+		if (localStorage[i]) __sync_bool_compare_and_swap(&localStorage[i]->fpuOwner, thread, nullptr);
+	}
+
+	FreeThread(thread);
+}
+
+Thread *Scheduler::AllocateThread() {
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+	CPULocalStorage *local = GetLocalStorage();
+	Thread *thread = local && local->threadCacheCount ? local->threadCache[--local->threadCacheCount] : nullptr;
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+
+	if (thread) {
+		ZeroMemory(thread, sizeof(Thread));
+		return thread;
+	}
+
+	return (Thread *) threadPool.Add();
+}
+
+void Scheduler::FreeThread(Thread *thread) {
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+	CPULocalStorage *local = GetLocalStorage();
+	bool cached = local && local->threadCacheCount != THREAD_CACHE_SIZE;
+	if (cached) local->threadCache[local->threadCacheCount++] = thread;
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+
+	if (!cached) {
+		threadPool.Remove(thread);
+	}
+}
+
+uintptr_t Scheduler::AllocateKernelStack() {
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+	CPULocalStorage *local = GetLocalStorage();
+	uintptr_t stack = local && local->kernelStackCacheCount ? local->kernelStackCache[--local->kernelStackCacheCount] : 0;
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+
+	if (stack) {
+		return stack;
+	}
+
+	return (uintptr_t) kernelVMM.Allocate("KernStack", KERNEL_STACK_SIZE, VMM_MAP_ALL);
+}
+
+void Scheduler::FreeKernelStack(uintptr_t stack) {
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+	CPULocalStorage *local = GetLocalStorage();
+	bool cached = local && local->kernelStackCacheCount != THREAD_CACHE_SIZE;
+	if (cached) local->kernelStackCache[local->kernelStackCacheCount++] = stack;
+	if (interruptsEnabled) ProcessorEnableInterrupts();
+
+	if (!cached) {
+		kernelVMM.Free((void *) stack);
+	}
 }
 
 void Scheduler::CrashProcess(Process *process, OSCrashReason &crashReason) {
@@ -781,7 +1767,7 @@ void Scheduler::PauseThread(Thread *thread, bool resume, bool lockAlreadyAcquire
 
 	if (!resume && thread->terminatableState == THREAD_TERMINATABLE) {
 		if (thread->state == THREAD_ACTIVE) {
-			if (thread->executing) {
+			if (!DequeueThread(thread)) {
 				if (thread == GetCurrentThread()) {
 					lock.Release();
 
@@ -800,8 +1786,7 @@ void Scheduler::PauseThread(Thread *thread, bool resume, bool lockAlreadyAcquire
 					// TODO The interrupt context might not be set at this point.
 				}
 			} else {
-				// Remove the thread from the active queue, and put it into the paused queue.
-				activeThreads.Remove(thread->item);
+				// The thread was removed from its processor's queue, so put it into the paused queue.
 				AddActiveThread(thread, false);
 			}
 		} else {
@@ -895,6 +1880,16 @@ void KillThread(void *_thread) {
 	scheduler.lock.Acquire();
 	scheduler.allThreads.Remove(&thread->allItem);
 	thread->process->threads.Remove(&thread->processItem);
+	if (thread->exclusiveAffinity) scheduler.UpdateReservedProcessors();
+
+	Process *process = thread->process;
+
+	if (thread->userStackBase && process->threads.count && !process->terminating 
+			&& process->userStackCacheCount != PROCESS_USER_STACK_CACHE) {
+		// Keep the stack for the next thread the process spawns.
+		process->userStackCache[process->userStackCacheCount++] = thread->userStackBase;
+		thread->userStackBase = 0;
+	}
 
 	// KernelLog(LOG_VERBOSE, "Killing thread %x...\n", _thread);
 
@@ -922,7 +1917,7 @@ void KillThread(void *_thread) {
 		scheduler.lock.Release();
 	}
 
-	kernelVMM.Free((void *) thread->kernelStackBase);
+	scheduler.FreeKernelStack(thread->kernelStackBase);
 	if (thread->userStackBase) thread->process->vmm->Free((void *) thread->userStackBase);
 
 	thread->killedEvent.Set();
@@ -954,165 +1949,262 @@ void Scheduler::Yield(InterruptContext *context) {
 	local->currentThread->interruptContext = context;
 
 	ProcessorDisableInterrupts(); // We don't want interrupts to get reenabled after the context switch.
-	lock.Acquire();
 
-	if (lock.interruptsEnabled) {
-		KernelPanic("Scheduler::Yield - Interrupts were enabled when scheduler lock was acquired.\n");
+	// Notify any triggered timers.
+	// This is done before acquiring any locks, so that they aren't held while the wheel is advanced.
+	local->timerWheel->Expire(ReadTimeMs());
+
+	Thread *previousThread = local->currentThread;
+	bool voluntarySwitch = previousThread->state != THREAD_ACTIVE; // The thread is blocking.
+
+	// Most context switches only need this processor's queue lock.
+	// The scheduler's lock is needed to block or kill the thread, or to queue it on another processor or the paused queue.
+	bool killThread = previousThread->terminatableState == THREAD_TERMINATABLE && previousThread->terminating;
+	bool moveThread = previousThread != local->idleThread && (previousThread->paused || !CanRunOn(previousThread, local));
+	bool locked = voluntarySwitch || killThread || moveThread;
+
+	if (!locked) {
+		local->queueLock.Acquire();
+
+		// The thread is paused or has its affinity changed before the queue lock of its processor is acquired,
+		// so if this doesn't see the change, then the thread will be found in the queue afterwards.
+		if (previousThread != local->idleThread && (previousThread->paused || !CanRunOn(previousThread, local))) {
+			local->queueLock.Release();
+			locked = true;
+		}
 	}
 
-	local->currentThread->executing = false;
+	if (locked) {
+		lock.Acquire();
 
-	bool killThread = local->currentThread->terminatableState == THREAD_TERMINATABLE 
-		&& local->currentThread->terminating;
-	bool keepThreadAlive = local->currentThread->terminatableState == THREAD_USER_BLOCK_REQUEST
-		&& local->currentThread->terminating; // The user can't make the thread block if it is terminating.
+		if (lock.interruptsEnabled) {
+			KernelPanic("Scheduler::Yield - Interrupts were enabled when scheduler lock was acquired.\n");
+		}
 
-	if (killThread) {
-		local->currentThread->state = THREAD_TERMINATED;
-		// KernelLog(LOG_VERBOSE, "terminated yielded thread %x\n", local->currentThread);
-		RegisterAsyncTask(KillThread, local->currentThread, local->currentThread->process, true);
-	}
+		local->yieldLocked = true;
 
-	// If the thread is waiting for an object to be notified, put it in the relevant blockedThreads list.
-	// But if the object has been notified yet hasn't made itself active yet, do that for it.
+		killThread = local->currentThread->terminatableState == THREAD_TERMINATABLE 
+			&& local->currentThread->terminating;
+		bool keepThreadAlive = local->currentThread->terminatableState == THREAD_USER_BLOCK_REQUEST
+			&& local->currentThread->terminating; // The user can't make the thread block if it is terminating.
 
-	else if (local->currentThread->state == THREAD_WAITING_MUTEX) {
-		if (!keepThreadAlive && local->currentThread->blockingMutex->owner) {
-			local->currentThread->blockingMutex->blockedThreads.InsertEnd(&local->currentThread->item[0]);
-		} else {
-			local->currentThread->state = THREAD_ACTIVE;
+		if (killThread) {
+			local->currentThread->state = THREAD_TERMINATED;
+			// KernelLog(LOG_VERBOSE, "terminated yielded thread %x\n", local->currentThread);
+			RegisterAsyncTask(&local->currentThread->killTask, KillThread, local->currentThread, local->currentThread->process);
 		}
-	}
 
-	else if (local->currentThread->state == THREAD_WAITING_EVENT) {
-		if (keepThreadAlive) {
-			local->currentThread->state = THREAD_ACTIVE;
-		} else {
-			bool unblocked = false;
+		// If the thread is waiting for an object to be notified, put it in the relevant blockedThreads list.
+		// But if the object has been notified yet hasn't made itself active yet, do that for it.
 
-			for (uintptr_t i = 0; i < local->currentThread->blockingEventCount; i++) {
-				if (local->currentThread->blockingEvents[i]->state) {
-					local->currentThread->state = THREAD_ACTIVE;
-					unblocked = true;
-					break;
-				}
+		else if (local->currentThread->state == THREAD_WAITING_MUTEX) {
+			if (!keepThreadAlive && local->currentThread->blockingMutex->owner) {
+				local->currentThread->blockingMutex->blockedThreads.InsertEnd(&local->currentThread->item[0]);
+				InheritPriority(local->currentThread->blockingMutex);
+			} else {
+				local->currentThread->state = THREAD_ACTIVE;
 			}
+		}
+
+		else if (local->currentThread->state == THREAD_WAITING_EVENT) {
+			if (keepThreadAlive) {
+				local->currentThread->state = THREAD_ACTIVE;
+			} else {
+				bool unblocked = false;
 
-			if (!unblocked) {
 				for (uintptr_t i = 0; i < local->currentThread->blockingEventCount; i++) {
-					local->currentThread->blockingEvents[i]->blockedThreads.InsertEnd(&local->currentThread->item[i]);
+					if (local->currentThread->blockingEvents[i]->state) {
+						local->currentThread->state = THREAD_ACTIVE;
+						unblocked = true;
+						break;
+					}
+				}
+
+				if (!unblocked) {
+					for (uintptr_t i = 0; i < local->currentThread->blockingEventCount; i++) {
+						local->currentThread->blockingEvents[i]->blockedThreads.InsertEnd(&local->currentThread->item[i]);
+					}
 				}
 			}
 		}
+
+		// Acquired after the blocking, since InheritPriority might need to requeue a thread on this processor.
+		local->queueLock.Acquire();
+		moveThread = previousThread != local->idleThread && (previousThread->paused || !CanRunOn(previousThread, local));
 	}
 
-	// Put the current thread at the end of the activeThreads list.
+	if (local->queueLock.interruptsEnabled) {
+		KernelPanic("Scheduler::Yield - Interrupts were enabled when queue lock was acquired.\n");
+	}
+
+	// Update the scheduler's time.
+	// Any processor can do this, since it is read from the time stamp counter.
+	timeMs = ReadTimeMs();
+	local->timerDeadlineMs = 0;
+
+	local->currentThread->executing = false;
+	local->currentThread->boosted = false; // The thread has used its boost.
+
+	// Account the time the thread was executing.
+	uint64_t timeStamp = ProcessorReadTimeStamp();
+
+	if (previousThread == local->idleThread) {
+		local->idleTicks += timeStamp - previousThread->accountingTimeStamp;
+		previousThread->accountingTimeStamp = timeStamp;
+	} else {
+		AccountTime(previousThread, CPU_TIME_RUN, timeStamp);
+	}
+
+	// Put the current thread at the end of the processor's queue.
 	if (!killThread && local->currentThread->state == THREAD_ACTIVE) {
-		if (local->currentThread->type == THREAD_NORMAL) {
-			AddActiveThread(local->currentThread, false);
-		} else if (local->currentThread->type == THREAD_IDLE || local->currentThread->type == THREAD_ASYNC_TASK) {
+		if (local->currentThread->type == THREAD_NORMAL || local->currentThread->type == THREAD_ASYNC_TASK) {
+			if (moveThread) {
+				// Another processor could run the thread as soon as it's queued there, 
+				// so PostContextSwitch queues it once its stack is no longer in use.
+				local->currentThread->scheduledProcessor = nullptr;
+				local->requeueThread = local->currentThread;
+			} else {
+				local->activeThreads[EffectivePriority(local->currentThread)].InsertEnd(&local->currentThread->item[0]);
+			}
+		} else if (local->currentThread->type == THREAD_IDLE) {
 			// Do nothing.
 		} else {
 			KernelPanic("Scheduler::Yield - Unrecognised thread type\n");
 		}
+	} else {
+		// The thread has blocked or been killed, so it isn't on any processor until it's queued again.
+		local->currentThread->scheduledProcessor = nullptr;
 	}
 
-	// Notify any triggered timers.
-	
-	LinkedItem<Timer> *_timer = activeTimers.firstItem;
+	// Get a thread from the start of the processor's highest priority queue.
+	// If they are all empty, steal a thread from another processor.
+	LinkedItem<Thread> *firstThreadItem = nullptr;
+	Thread *newThread = nullptr;
 
-	while (_timer) {
-		Timer *timer = _timer->thisItem;
-		LinkedItem<Timer> *next = _timer->nextItem;
+	for (uintptr_t i = 0; i < OS_THREAD_PRIORITY_COUNT && !firstThreadItem; i++) {
+		firstThreadItem = local->activeThreads[i].firstItem;
+	}
 
-		if (timer->triggerTimeMs <= timeMs) {
-			activeTimers.Remove(_timer);
-			timer->event.Set(true); // The scheduler is already locked at this point.
+	if (firstThreadItem) {
+		newThread = (Thread *) firstThreadItem->thisItem;
 
-			if (timer->callback) {
-				RegisterAsyncTask(timer->callback, timer->argument, nullptr, true);
-			}
+		if (newThread->executing) {
+			KernelPanic("Scheduler::Yield - Thread (ID %d) in active queue already executing with state %d, type %d\n", newThread->id, newThread->state, newThread->type);
 		}
 
-		_timer = next;
-	}
-
-	// Get a thread from the start of the list.
-	LinkedItem<Thread> *firstThreadItem = activeThreads.firstItem;
-	Thread *newThread;
-	bool newThreadIsAsyncTask = false;
-
-	if (local->asyncTasksRead != local->asyncTasksWrite && local->asyncTaskThread->state == THREAD_ACTIVE) {
-		firstThreadItem = nullptr;
-		newThread = local->currentThread = local->asyncTaskThread;
-		newThreadIsAsyncTask = true;
-	} else if (!firstThreadItem) {
-		newThread = local->currentThread = local->idleThread;
+		// Remove the thread we're now executing.
+		firstThreadItem->RemoveFromList();
 	} else {
-		newThread = local->currentThread = (Thread *) firstThreadItem->thisItem;
+		// Only one queue lock is held at a time, so release this processor's while stealing.
+		// The previous thread can't be taken from it, since the queue is empty.
+		local->queueLock.Release();
+		newThread = StealThread(local);
+		local->queueLock.Acquire();
 	}
 
-	if (newThread->executing) {
-		KernelPanic("Scheduler::Yield - Thread (ID %d) in active queue already executing with state %d, type %d\n", local->currentThread->id, local->currentThread->state, local->currentThread->type);
+	if (!newThread) {
+		newThread = local->idleThread;
 	}
 
-	// Remove the thread we're now executing.
-	if (firstThreadItem) activeThreads.Remove(firstThreadItem);
+	local->currentThread = newThread;
 
 	// Store information about the thread.
 	newThread->executing = true;
 	newThread->executingProcessorID = local->processorID;
 	newThread->timeSlices++;
 
+	if (newThread != previousThread) {
+		local->contextSwitches++;
+
+		if (previousThread != local->idleThread) {
+			if (voluntarySwitch) {
+				previousThread->cpuTimes.voluntarySwitches++;
+				__sync_fetch_and_add(&previousThread->process->cpuTimes.voluntarySwitches, 1);
+			} else {
+				previousThread->cpuTimes.involuntarySwitches++;
+				__sync_fetch_and_add(&previousThread->process->cpuTimes.involuntarySwitches, 1);
+			}
+		}
+	}
+
+	if (newThread == local->idleThread) {
+		newThread->accountingTimeStamp = timeStamp;
+	} else {
+		AccountTime(newThread, CPU_TIME_WAIT, timeStamp);
+	}
+
 	// Prepare the next timer interrupt.
-	uint64_t time = 10;
-	NextTimer(time);
+	// If no other threads are waiting for this processor and no timers are pending, 
+	// then it doesn't need to be interrupted until another processor wakes it.
+	uint64_t deadlineMs = QueuedThreadCount(local) ? timeMs + TIME_SLICE_MS : 0;
+	uint64_t nextTimerMs = local->timerWheel->NextExpiryMs();
+
+	if (nextTimerMs && (!deadlineMs || nextTimerMs < deadlineMs)) {
+		deadlineMs = nextTimerMs;
+	}
 
-	if (!local->processorID) {
-		// Update the scheduler's time.
-		timeMs += time; 
+	local->timerDeadlineMs = deadlineMs;
+	NextTimer(deadlineMs ? (deadlineMs > timeMs ? deadlineMs - timeMs : 1) : 0);
+
+	// If a thread used the FPU during its time slice, save its state.
+	// The state is left in the registers, so that it needn't be loaded again
+	// if the thread is the next to use the FPU on this processor.
+	if (!ProcessorIsTaskSwitched() && local->fpuOwner) {
+		ProcessorSaveFPU(FPU_STATE(local->fpuOwner));
+	}
+
+	if (local->fpuOwner == newThread && newThread->fpuLoadedProcessor == (int) local->processorID) {
+		ProcessorClearTaskSwitched();
+	} else {
+		ProcessorSetTaskSwitched();
 	}
 
 	InterruptContext *newContext = newThread->interruptContext;
 	VirtualAddressSpace *addressSpace = newThread->process->vmm->virtualAddressSpace;
-	if (newThreadIsAsyncTask && newThread->asyncTempAddressSpace) addressSpace = newThread->asyncTempAddressSpace;
+	if (newThread->type == THREAD_ASYNC_TASK && newThread->asyncTempAddressSpace) addressSpace = newThread->asyncTempAddressSpace;
 #if 0
 	KernelLog(LOG_VERBOSE, "%x/%d/%d\n", VIRTUAL_ADDRESS_SPACE_IDENTIFIER(addressSpace), newThread->id, newThread->type);
 #endif
-	DoContextSwitch(newContext, VIRTUAL_ADDRESS_SPACE_IDENTIFIER(addressSpace), newThread->kernelStack, newThread);
+	DoContextSwitch(newContext, VIRTUAL_ADDRESS_SPACE_SWITCH_VALUE(addressSpace), newThread->kernelStack, newThread);
 
 #define Defer(code) OSDefer(code)
 }
 
-void Scheduler::WaitMutex(Mutex *mutex) {
+bool Scheduler::WaitMutex(Mutex *mutex) {
 	Thread *thread = GetCurrentThread();
 
 	if (thread->state != THREAD_ACTIVE) {
 		KernelPanic("Scheduler::WaitMutex - Attempting to wait on a mutex in a non-active thread.\n");
 	}
 
-	lock.Acquire();
-
-	thread->state = THREAD_WAITING_MUTEX;
-	thread->blockingMutex = mutex;
-
 	// Is the owner of this mutex executing?
-	// If not, there's no point in spinning on it.
-	bool spin = mutex && mutex->owner && mutex->owner->executing;
-	// bool spin = false;
+	// If it is, then it'll probably release the mutex soon,
+	// so spin for a while instead of paying for a context switch.
+	for (uintptr_t i = 0; i < MUTEX_SPIN_COUNT; i++) {
+		Thread *owner = mutex->owner;
 
-	lock.Release();
+		if (!owner) {
+			return false;
+		} else if (owner == (Thread *) 1 || !owner->executing) {
+			break;
+		}
 
-	if (!spin) {
-		ProcessorFakeTimerInterrupt();
+		_mm_pause();
 	}
 
+	thread->blockingMutex = mutex;
+	bool blocked = false;
+
 	// Early exit if this is a user request to block the thread and the thread is terminating.
-	while ((!thread->terminating || thread->terminatableState != THREAD_USER_BLOCK_REQUEST) && thread->blockingMutex->owner) {
+	while ((!thread->terminating || thread->terminatableState != THREAD_USER_BLOCK_REQUEST) && mutex->owner) {
+		// Scheduler::Yield will put the thread in the mutex's blockedThreads list if it's still owned.
 		thread->state = THREAD_WAITING_MUTEX;
+		ProcessorFakeTimerInterrupt();
+		blocked = true;
 	}
 
 	thread->state = THREAD_ACTIVE;
+	return blocked;
 }
 
 uintptr_t Scheduler::WaitEvents(Event **events, size_t count) {
@@ -1151,6 +2243,11 @@ uintptr_t Scheduler::WaitEvents(Event **events, size_t count) {
 				}
 			}
 		}
+
+		// None of the events were set, so block until we're notified.
+		// Scheduler::Yield checks the events again with its lock acquired, 
+		// so we won't miss a notification.
+		ProcessorFakeTimerInterrupt();
 	}
 
 	return -1; // Exited from termination.
@@ -1173,12 +2270,55 @@ void Scheduler::UnblockThread(Thread *unblockedThread) {
 	unblockedThread->state = THREAD_ACTIVE;
 
 	if (!unblockedThread->executing) {
-		// Put the unblocked thread at the start of the activeThreads list
+		AccountTime(unblockedThread, CPU_TIME_BLOCKED, ProcessorReadTimeStamp());
+
+		// Put the unblocked thread at the start of its processor's queue
 		// so that it is immediately executed when the scheduler yields.
 		AddActiveThread(unblockedThread, true);
 	} 
 }
 
+void Scheduler::AccountTime(Thread *thread, CPUTimeType type, uint64_t timeStamp) {
+	// The thread's times are only updated by the processor that has it, but 
+	// Scheduler::Yield doesn't always hold the scheduler's lock, so the process's times are updated atomically.
+	uint64_t ticks = timeStamp > thread->accountingTimeStamp ? timeStamp - thread->accountingTimeStamp : 0;
+	thread->accountingTimeStamp = timeStamp;
+	thread->cpuTimes.ticks[type] += ticks;
+	__sync_fetch_and_add(&thread->process->cpuTimes.ticks[type], ticks);
+}
+
+void Scheduler::GetCPUStatistics(CPUTimes *times, OSCPUStatistics *statistics) {
+	lock.Acquire();
+	Defer(lock.Release());
+
+	statistics->timeStamp = ProcessorReadTimeStamp();
+	statistics->timeStampTicksPerMs = timeStampTicksPerMs;
+
+	if (times) {
+		statistics->runTicks = times->ticks[CPU_TIME_RUN];
+		statistics->waitTicks = times->ticks[CPU_TIME_WAIT];
+		statistics->blockedTicks = times->ticks[CPU_TIME_BLOCKED];
+		statistics->voluntarySwitches = times->voluntarySwitches;
+		statistics->involuntarySwitches = times->involuntarySwitches;
+	}
+
+	for (uintptr_t i = 0; i < MAX_PROCESSORS && i < OS_STATISTICS_MAX_PROCESSORS; i++) {
+		CPULocalStorage *storage = localStorage[i];
+		if (!storage) continue;
+
+		uint64_t idleTicks = storage->idleTicks;
+
+		if (storage->currentThread == storage->idleThread && statistics->timeStamp > storage->idleThread->accountingTimeStamp) {
+			// Include the time since the processor last became idle.
+			idleTicks += statistics->timeStamp - storage->idleThread->accountingTimeStamp;
+		}
+
+		statistics->processors[i].idleTicks = idleTicks;
+		statistics->processors[i].contextSwitches = storage->contextSwitches;
+		statistics->processorCount = i + 1;
+	}
+}
+
 void Scheduler::NotifyObject(LinkedList<Thread> *blockedThreads, bool schedulerAlreadyLocked, bool unblockAll) {
 	if (schedulerAlreadyLocked == false) lock.Acquire();
 	lock.AssertLocked();
@@ -1232,14 +2372,20 @@ void Mutex::Acquire() {
 		KernelPanic("Mutex::Acquire - Trying to wait on a mutex while interrupts are disabled.\n");
 	}
 
+	bool waited = false, contended = false;
+	uint64_t start = lockProfilerEnabled ? ProcessorReadTimeStamp() : 0;
+
 	while (__sync_val_compare_and_swap(&owner, nullptr, currentThread)) {
+		contended = true;
 		__sync_synchronize();
 
 		if (GetLocalStorage() && GetLocalStorage()->schedulerReady) {
 			// Instead of spinning on the lock, 
 			// let's tell the scheduler to not schedule this thread
 			// until it's released.
-			scheduler.WaitMutex(this);
+			if (scheduler.WaitMutex(this)) {
+				waited = true;
+			}
 
 			if (currentThread->terminating && currentThread->terminatableState == THREAD_USER_BLOCK_REQUEST) {
 				// We didn't acquire the mutex because the thread is terminating.
@@ -1254,9 +2400,21 @@ void Mutex::Acquire() {
 		KernelPanic("Mutex::Acquire - Invalid owner thread (%x, expected %x).\n", owner, currentThread);
 	}
 
+	if (waited) {
+		// Other threads may still be blocking on the mutex, so we should inherit their priority.
+		scheduler.lock.Acquire();
+		scheduler.InheritPriority(this);
+		scheduler.lock.Release();
+	}
+
 	acquireAddress = (uintptr_t) __builtin_return_address(0);
 	AssertLocked();
 
+	if (start) {
+		acquireTimeStamp = ProcessorReadTimeStamp();
+		LockProfilerAcquired(acquireAddress, false, contended, acquireTimeStamp - start);
+	}
+
 	// Print("%x:%x:1\n", owner, this);
 }
 
@@ -1267,6 +2425,11 @@ void Mutex::Release() {
 
 	AssertLocked();
 
+	if (acquireTimeStamp) {
+		LockProfilerReleased(acquireAddress, false, ProcessorReadTimeStamp() - acquireTimeStamp);
+		acquireTimeStamp = 0;
+	}
+
 	Thread *currentThread = GetCurrentThread();
 
 	scheduler.lock.Acquire();
@@ -1280,8 +2443,23 @@ void Mutex::Release() {
 		owner = nullptr;
 	}
 
+	if (contendedItem.list) {
+		contendedItem.RemoveFromList();
+	}
+
+	if (currentThread && currentThread->inheritsPriority) {
+		// Drop the priority we inherited from this mutex's waiters.
+		scheduler.UpdateInheritedPriority(currentThread);
+	}
+
 	if (scheduler.started) {
-		scheduler.NotifyObject(&blockedThreads, true);
+		// Wake the highest priority thread waiting for the mutex.
+		LinkedItem<Thread> *unblockedItem = scheduler.HighestPriorityWaiter(&blockedThreads);
+
+		if (unblockedItem) {
+			blockedThreads.Remove(unblockedItem);
+			scheduler.UnblockThread(unblockedItem->thisItem);
+		}
 	}
 
 	scheduler.lock.Release();
@@ -1306,6 +2484,115 @@ void Mutex::AssertLocked() {
 	}
 }
 
+static void RWLockWait(Event *event) {
+	if (GetLocalStorage() && GetLocalStorage()->schedulerReady) {
+		event->Wait(OS_WAIT_NO_TIMEOUT);
+	} else {
+		// We can't block during initialisation.
+		while (!event->state) _mm_pause();
+	}
+}
+
+void RWLock::AcquireShared() {
+	if (scheduler.panic) return;
+
+	if (!ProcessorAreInterruptsEnabled()) {
+		KernelPanic("RWLock::AcquireShared - Trying to wait on a lock while interrupts are disabled.\n");
+	}
+
+	while (true) {
+		lock.Acquire();
+
+		if (!writers) {
+			readers++;
+			lock.Release();
+			break;
+		}
+
+		lock.Release();
+
+		// noWriters is reset while writers is non-zero, so this blocks until the last writer leaves.
+		RWLockWait(&noWriters);
+	}
+
+	sharedAcquireAddress = (uintptr_t) __builtin_return_address(0);
+}
+
+void RWLock::ReleaseShared() {
+	if (scheduler.panic) return;
+
+	lock.Acquire();
+
+	if (!readers) {
+		KernelPanic("RWLock::ReleaseShared - Lock not acquired shared (%x).\n", this);
+	}
+
+	readers--;
+
+	if (!readers && writers) {
+		noReaders.Set(false, true);
+	}
+
+	lock.Release();
+
+	sharedReleaseAddress = (uintptr_t) __builtin_return_address(0);
+}
+
+void RWLock::AcquireExclusive() {
+	if (scheduler.panic) return;
+
+	// Stop new readers from acquiring the lock.
+	lock.Acquire();
+	if (!writers++) noWriters.Reset();
+	lock.Release();
+
+	writerMutex.Acquire();
+
+	// Wait for the existing readers to leave.
+	while (true) {
+		lock.Acquire();
+
+		if (!readers) {
+			lock.Release();
+			break;
+		}
+
+		noReaders.Reset();
+		lock.Release();
+
+		RWLockWait(&noReaders);
+	}
+
+	writerMutex.acquireAddress = (uintptr_t) __builtin_return_address(0);
+}
+
+void RWLock::ReleaseExclusive() {
+	if (scheduler.panic) return;
+
+	writerMutex.Release();
+
+	lock.Acquire();
+	if (!--writers) noWriters.Set(false, true);
+	lock.Release();
+
+	writerMutex.releaseAddress = (uintptr_t) __builtin_return_address(0);
+}
+
+void RWLock::AssertShared() {
+	if (scheduler.panic) return;
+	if (readers) return;
+	AssertExclusive();
+}
+
+void RWLock::AssertExclusive() {
+	if (scheduler.panic) return;
+	writerMutex.AssertLocked();
+
+	if (readers) {
+		KernelPanic("RWLock::AssertExclusive - Lock %x has %d readers.\n", this, readers);
+	}
+}
+
 void Semaphore::Take(uintptr_t u) {
 	while (u) {
 		available.Wait(OS_WAIT_NO_TIMEOUT);
@@ -1334,6 +2621,147 @@ void Semaphore::Set(uintptr_t u) {
 	mutex.Release();
 }
 
+volatile uintptr_t nextWorkProcessor;
+
+void WorkJobRun(void *argument) {
+	WorkJob *job = (WorkJob *) argument;
+	WorkGroup *group = job->group;
+
+	if (job->rangeCallback) {
+		job->rangeCallback(job->argument, job->start, job->end);
+	} else {
+		job->callback(job->argument);
+	}
+
+	OSHeapFree(job, sizeof(WorkJob));
+
+	// The group might be on the waiter's stack, so it must not be accessed after the scheduler's lock is released;
+	// WorkGroup::Wait only returns once it has acquired the lock and seen that there are no pending jobs.
+	scheduler.lock.Acquire();
+
+	if (!__sync_sub_and_fetch(&group->pendingJobs, 1)) {
+		group->complete.Set(true, true);
+	}
+
+	scheduler.lock.Release();
+}
+
+void WorkGroupQueue(WorkGroup *group, WorkJob *job) {
+	job->group = group;
+	job->task.callback = WorkJobRun;
+	job->task.argument = job;
+
+	// Distribute jobs between the processors.
+	CPULocalStorage *target = nullptr;
+
+	while (!target) {
+		target = scheduler.localStorage[__sync_fetch_and_add(&nextWorkProcessor, 1) % currentProcessorID];
+	}
+
+	group->complete.autoReset = true;
+	__sync_fetch_and_add(&group->pendingJobs, 1);
+	target->workQueue.Push(&job->task);
+	target->workQueue.available.Set(false, true);
+}
+
+void WorkGroup::Submit(AsyncTaskCallback callback, void *argument) {
+	WorkJob *job = (WorkJob *) OSHeapAllocate(sizeof(WorkJob), true);
+	job->callback = callback;
+	job->argument = argument;
+	WorkGroupQueue(this, job);
+}
+
+void WorkGroup::ParallelFor(WorkRangeCallback callback, void *argument, uintptr_t count, uintptr_t batch) {
+	if (!batch) {
+		batch = (count + currentProcessorID - 1) / currentProcessorID;
+		if (!batch) return;
+	}
+
+	for (uintptr_t start = 0; start < count; start += batch) {
+		WorkJob *job = (WorkJob *) OSHeapAllocate(sizeof(WorkJob), true);
+		job->rangeCallback = callback;
+		job->argument = argument;
+		job->start = start;
+		job->end = start + batch > count ? count : start + batch;
+		WorkGroupQueue(this, job);
+	}
+}
+
+void WorkGroup::Wait() {
+	while (true) {
+		scheduler.lock.Acquire();
+		bool finished = !pendingJobs;
+		scheduler.lock.Release();
+
+		if (finished) {
+			break;
+		}
+
+		complete.Wait(OS_WAIT_NO_TIMEOUT);
+	}
+}
+
+FutexBucket *FutexGetBucket(VMM *vmm, uintptr_t address) {
+	uintptr_t hash = (address >> 2) ^ ((uintptr_t) vmm >> 4);
+	return futexBuckets + (hash % FUTEX_BUCKET_COUNT);
+}
+
+OSError FutexWait(volatile int32_t *address, int32_t expectedValue, uint64_t timeoutMs) {
+	VMM *vmm = GetCurrentThread()->process->vmm;
+	FutexBucket *bucket = FutexGetBucket(vmm, (uintptr_t) address);
+
+	FutexWaiter waiter = {};
+	waiter.item.thisItem = &waiter;
+	waiter.vmm = vmm;
+	waiter.address = (uintptr_t) address;
+
+	bucket->mutex.Acquire();
+
+	// Check the value with the bucket's mutex acquired,
+	// so that we can't miss a wake from a thread that's just changed it.
+	if (*address != expectedValue) {
+		bucket->mutex.Release();
+		return OS_SUCCESS;
+	}
+
+	bucket->waiters.InsertEnd(&waiter.item);
+	bucket->mutex.Release();
+
+	bool woken = waiter.woken.Wait(timeoutMs);
+
+	// Remove ourselves from the bucket if we weren't woken.
+	// This also makes sure that FutexWake has finished setting our event before it goes out of scope.
+	bucket->mutex.Acquire();
+	if (waiter.item.list) bucket->waiters.Remove(&waiter.item);
+	bucket->mutex.Release();
+
+	return woken ? OS_SUCCESS : OS_ERROR_TIMEOUT_REACHED;
+}
+
+size_t FutexWake(volatile int32_t *address, size_t count) {
+	VMM *vmm = GetCurrentThread()->process->vmm;
+	FutexBucket *bucket = FutexGetBucket(vmm, (uintptr_t) address);
+	size_t woken = 0;
+
+	bucket->mutex.Acquire();
+	Defer(bucket->mutex.Release());
+
+	LinkedItem<FutexWaiter> *item = bucket->waiters.firstItem;
+
+	while (item && woken < count) {
+		FutexWaiter *waiter = item->thisItem;
+		item = item->nextItem;
+
+		if (waiter->vmm == vmm && waiter->address == (uintptr_t) address) {
+			bucket->waiters.Remove(&waiter->item);
+			waiter->woken.Set();
+			woken++;
+		}
+	}
+
+	return woken;
+}
+
 void Event::Set(bool schedulerAlreadyLocked, bool maybeAlreadySet) {
 	if (state && !maybeAlreadySet) {
 		KernelLog(LOG_WARNING, "Event::Set - Attempt to set a event that had already been set\n");
@@ -1349,6 +2777,12 @@ void Event::Set(bool schedulerAlreadyLocked, bool maybeAlreadySet) {
 		scheduler.NotifyObject(&blockedThreads, true, !autoReset /*If this is a manually reset event, unblock all the waiting threads.*/);
 	}
 
+	if (completion && !completion->queueItem.list) {
+		CompletionPort *port = completion->port;
+		port->queue.InsertEnd(&completion->queueItem);
+		port->available.Set(true, true);
+	}
+
 	if (!schedulerAlreadyLocked) {
 		scheduler.lock.Release();
 	}
@@ -1382,40 +2816,295 @@ bool Event::Wait(uint64_t timeoutMs) {
 		timer.Set(timeoutMs, false);
 		events[1] = &timer.event;
 		int index = scheduler.WaitEvents(events, 2);
-		
-		if (index == 1) {
-			return false;
-		} else {
-			timer.Remove();
-			return true;
+
+		// Even if the timer expired, it might still be being notified on another processor.
+		timer.Remove();
+		return index != 1;
+	}
+}
+
+bool CompletionPort::Associate(Event *event, uintptr_t key, CompletionPortAssociation *association) {
+	scheduler.lock.AssertLocked();
+
+	if (event->completion) {
+		return false;
+	}
+
+	association->item.thisItem = association;
+	association->queueItem.thisItem = association;
+	association->port = this;
+	association->event = event;
+	association->key = key;
+
+	event->completion = association;
+	associations.InsertEnd(&association->item);
+
+	if (event->state) {
+		// The event was set before it was associated.
+		queue.InsertEnd(&association->queueItem);
+		available.Set(true, true);
+	}
+
+	return true;
+}
+
+size_t CompletionPort::Dequeue(uintptr_t *keys, size_t count) {
+	scheduler.lock.AssertLocked();
+
+	uintptr_t i = 0;
+
+	while (i < count && queue.firstItem) {
+		CompletionPortAssociation *association = queue.firstItem->thisItem;
+		queue.Remove(&association->queueItem);
+		keys[i++] = association->key;
+
+		if (association->event->autoReset) {
+			// Consume the event, as waiting on it would have.
+			association->event->state = false;
 		}
 	}
+
+	if (!queue.firstItem) {
+		available.Reset();
+	}
+
+	return i;
 }
 
-void Timer::Set(uint64_t triggerInMs, bool autoReset, AsyncTaskCallback _callback, void *_argument) {
+void CompletionPortRemoveAssociation(CompletionPortAssociation *association) {
+	scheduler.lock.AssertLocked();
+
+	CompletionPort *port = association->port;
+	association->event->completion = nullptr;
+	port->associations.Remove(&association->item);
+	if (association->queueItem.list) port->queue.Remove(&association->queueItem);
+}
+
+void CompletionPortDetach(Event *event) {
 	scheduler.lock.Acquire();
-	Defer(scheduler.lock.Release());
+	CompletionPortAssociation *association = event->completion;
+	if (association) CompletionPortRemoveAssociation(association);
+	scheduler.lock.Release();
+
+	if (association) {
+		OSHeapFree(association, sizeof(CompletionPortAssociation));
+	}
+}
+
+void CompletionPort::Destroy() {
+	// The associations can't be freed with the scheduler's lock held, so remove them one at a time.
+
+	while (true) {
+		scheduler.lock.Acquire();
+		CompletionPortAssociation *association = associations.firstItem ? associations.firstItem->thisItem : nullptr;
+		if (association) CompletionPortRemoveAssociation(association);
+		scheduler.lock.Release();
+
+		if (!association) break;
+		OSHeapFree(association, sizeof(CompletionPortAssociation));
+	}
+
+	OSHeapFree(this, sizeof(CompletionPort));
+}
+
+void TimerWheel::Insert(Timer *timer) {
+	lock.AssertLocked();
+
+	uint64_t triggerTimeMs = timer->triggerTimeMs;
+
+	if (triggerTimeMs < currentMs) {
+		// Expire the timer as soon as possible.
+		triggerTimeMs = currentMs;
+	}
+
+	uintptr_t level = 0;
+
+	while (level < TIMER_WHEEL_LEVELS - 1 
+			&& triggerTimeMs - currentMs >= ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+		level++;
+	}
+
+	if (level == TIMER_WHEEL_LEVELS - 1 
+			&& triggerTimeMs - currentMs >= ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))) {
+		// The timer is beyond the end of the wheel.
+		// Put it in the furthest slot; it'll be reinserted when that is reached.
+		triggerTimeMs = currentMs + ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	}
+
+	uintptr_t slot = (triggerTimeMs >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+	slots[level][slot].InsertEnd(&timer->item);
+	levelCounts[level]++;
+}
+
+void TimerWheel::Expire(uint64_t timeMs) {
+	lock.Acquire();
+
+	while (currentMs <= timeMs) {
+		// Notify the timers in the current slot.
+		LinkedList<Timer> *slot = &slots[0][currentMs & (TIMER_WHEEL_SLOTS - 1)];
+
+		while (slot->firstItem) {
+			Timer *timer = slot->firstItem->thisItem;
+			slot->Remove(&timer->item);
+			levelCounts[0]--;
+
+			// Notify the timer without the wheel's lock, so that the scheduler's lock isn't acquired within it.
+			// Timer::Remove will wait until we're done.
+			expiringTimer = timer;
+			lock.Release();
+
+			scheduler.lock.Acquire();
+			timer->event.Set(true);
+
+			if (timer->callback) {
+				RegisterAsyncTask(&timer->callbackTask, timer->callback, timer->argument, nullptr);
+			}
+
+			scheduler.lock.Release();
+
+			lock.Acquire();
+			expiringTimer = nullptr;
+		}
+
+		// Move to the next millisecond.
+		// If the lower levels are empty, we can skip straight to the next slot in a higher level.
+		uintptr_t emptyLevels = 0;
+
+		while (emptyLevels < TIMER_WHEEL_LEVELS && !levelCounts[emptyLevels]) {
+			emptyLevels++;
+		}
+
+		if (emptyLevels == TIMER_WHEEL_LEVELS) {
+			currentMs = timeMs + 1;
+			break;
+		}
+
+		uint64_t nextMs = ((currentMs >> (TIMER_WHEEL_SLOT_BITS * emptyLevels)) + 1) << (TIMER_WHEEL_SLOT_BITS * emptyLevels);
+
+		if (nextMs > timeMs + 1) {
+			// We don't reach the next slot boundary yet.
+			currentMs = timeMs + 1;
+			break;
+		}
+
+		currentMs = nextMs;
+
+		// Move the timers down from the levels whose slot boundary we've reached.
+		for (uintptr_t level = TIMER_WHEEL_LEVELS - 1; level >= 1; level--) {
+			if (currentMs & (((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) {
+				continue;
+			}
+
+			LinkedList<Timer> *slot = &slots[level][(currentMs >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+			LinkedList<Timer> cascade = {};
+
+			while (slot->firstItem) {
+				LinkedItem<Timer> *item = slot->firstItem;
+				slot->Remove(item);
+				levelCounts[level]--;
+				cascade.InsertEnd(item);
+			}
+
+			while (cascade.firstItem) {
+				LinkedItem<Timer> *item = cascade.firstItem;
+				cascade.Remove(item);
+				Insert(item->thisItem);
+			}
+		}
+	}
+
+	lock.Release();
+}
+
+uint64_t TimerWheel::NextExpiryMs() {
+	lock.Acquire();
+	Defer(lock.Release());
+
+	uint64_t nextMs = 0;
+
+	for (uintptr_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (!levelCounts[level]) {
+			continue;
+		}
+
+		// For the higher levels, this is when the slot's timers will be moved down a level,
+		// and so the processor will need to be interrupted again afterwards.
+		uint64_t block = currentMs >> (TIMER_WHEEL_SLOT_BITS * level);
+
+		for (uintptr_t i = level ? 1 : 0; i <= TIMER_WHEEL_SLOTS; i++) {
+			if (slots[level][(block + i) & (TIMER_WHEEL_SLOTS - 1)].firstItem) {
+				uint64_t slotMs = (block + i) << (TIMER_WHEEL_SLOT_BITS * level);
+				if (!nextMs || slotMs < nextMs) nextMs = slotMs;
+				break;
+			}
+		}
+	}
+
+	return nextMs;
+}
+
+void Timer::Set(uint64_t triggerInMs, bool autoReset, AsyncTaskCallback _callback, void *_argument) {
+	// The thread mustn't move to another processor until NextTimer has been called,
+	// otherwise the timer would be inserted into one processor's wheel but arm another's LAPIC.
+	bool interruptsEnabled = ProcessorAreInterruptsEnabled();
+	ProcessorDisableInterrupts();
+	Defer(if (interruptsEnabled) ProcessorEnableInterrupts());
+
+	CPULocalStorage *local = GetLocalStorage();
+
+	if (!local || !local->timerWheel) {
+		KernelPanic("Timer::Set - The processor has no timer wheel.\n");
+	}
+
+	local->timerWheel->lock.Acquire();
+	Defer(local->timerWheel->lock.Release());
 
 	if (item.list) {
 		KernelPanic("Timer::Set - Setting a timer that hasn't been reset.");
 	}
 
+	uint64_t timeMs = ReadTimeMs();
+	wheel = local->timerWheel;
+
+	if (!wheel->levelCounts[0] && !wheel->levelCounts[1] && !wheel->levelCounts[2] && !wheel->levelCounts[3] && wheel->currentMs < timeMs) {
+		// The wheel is empty, so it doesn't need to catch up to the current time.
+		wheel->currentMs = timeMs;
+	}
+
 	event.Reset();
 	event.autoReset = autoReset;
-	triggerTimeMs = triggerInMs + scheduler.timeMs;
+	triggerTimeMs = triggerInMs + timeMs;
 	callback = _callback;
 	argument = _argument;
 	item.thisItem = this;
-	scheduler.activeTimers.InsertStart(&item);
+	wheel->Insert(this);
+
+	// Make sure this processor is interrupted when the timer expires.
+	if (!local->timerDeadlineMs || local->timerDeadlineMs > triggerTimeMs) {
+		local->timerDeadlineMs = triggerTimeMs;
+		NextTimer(triggerInMs ? triggerInMs : 1);
+	}
 }
 
 void Timer::Remove() {
-	scheduler.lock.Acquire();
-	Defer(scheduler.lock.Release());
+	if (!wheel) {
+		return;
+	}
+
+	wheel->lock.Acquire();
 
 	if (item.list) {
-		scheduler.activeTimers.Remove(&item);
+		wheel->levelCounts[(item.list - &wheel->slots[0][0]) / TIMER_WHEEL_SLOTS]--;
+		item.list->Remove(&item);
+	}
+
+	while (wheel->expiringTimer == this) {
+		// The timer is being notified on another processor.
+		wheel->lock.Release();
+		wheel->lock.Acquire();
 	}
+
+	wheel->lock.Release();
 }
 
 #endif
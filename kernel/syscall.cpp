@@ -41,6 +41,24 @@ bool MessageQueue::SendMessage(OSMessage &_message) {
 
 	done:;
 
+	if (_message.type == OS_MESSAGE_MOUSE_MOVED || _message.type == OS_MESSAGE_KEY_PRESSED || _message.type == OS_MESSAGE_KEY_RELEASED
+			|| _message.type == OS_MESSAGE_MOUSE_LEFT_PRESSED || _message.type == OS_MESSAGE_MOUSE_LEFT_RELEASED
+			|| _message.type == OS_MESSAGE_MOUSE_RIGHT_PRESSED || _message.type == OS_MESSAGE_MOUSE_RIGHT_RELEASED
+			|| _message.type == OS_MESSAGE_MOUSE_MIDDLE_PRESSED || _message.type == OS_MESSAGE_MOUSE_MIDDLE_RELEASED) {
+		// Boost the threads waiting for input, 
+		// so that they don't have to wait behind the other threads of their priority.
+		scheduler.lock.Acquire();
+
+		LinkedItem<Thread> *item = notEmpty.blockedThreads.firstItem;
+
+		while (item) {
+			item->thisItem->boosted = true;
+			item = item->nextItem;
+		}
+
+		scheduler.lock.Release();
+	}
+
 	if (!notEmpty.Poll()) {
 		notEmpty.Set();
 	}
@@ -447,6 +465,23 @@ uintptr_t DoSyscall(OSSyscallType index,
 			SYSCALL_RETURN(OS_SUCCESS, false);
 		} break;
 
+		case OS_SYSCALL_FUTEX_WAIT: {
+			if (argument0 & 3) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_BUFFER, true);
+			SYSCALL_BUFFER(argument0, sizeof(int32_t), 1);
+
+			if (!fromKernel) currentThread->terminatableState = THREAD_USER_BLOCK_REQUEST;
+			OSError error = FutexWait((volatile int32_t *) argument0, (int32_t) argument1, argument2);
+			currentThread->terminatableState = THREAD_IN_SYSCALL;
+			SYSCALL_RETURN(error, false);
+		} break;
+
+		case OS_SYSCALL_FUTEX_WAKE: {
+			if (argument0 & 3) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_BUFFER, true);
+			SYSCALL_BUFFER(argument0, sizeof(int32_t), 1);
+
+			SYSCALL_RETURN(FutexWake((volatile int32_t *) argument0, argument1), false);
+		} break;
+
 		case OS_SYSCALL_RELEASE_MUTEX: {
 			KernelObjectType type = KERNEL_OBJECT_MUTEX;
 			Mutex *mutex = (Mutex *) currentProcess->handleTable.ResolveHandle(argument0, type);
@@ -983,19 +1018,19 @@ uintptr_t DoSyscall(OSSyscallType index,
 			OSRectangle *rectangle = (OSRectangle *) argument1;
 			SYSCALL_BUFFER(argument1, sizeof(OSRectangle), 1);
 
-			windowManager.mutex.Acquire();
+			windowManager.lock.AcquireShared();
 			rectangle->left = window->position.x;
 			rectangle->top = window->position.y;
 			rectangle->right = window->position.x + window->width;
 			rectangle->bottom = window->position.y + window->height;
-			windowManager.mutex.Release();
+			windowManager.lock.ReleaseShared();
 			SYSCALL_RETURN(OS_SUCCESS, false);
 		} break;
 
 		case OS_SYSCALL_REDRAW_ALL: {
-			windowManager.mutex.Acquire();
+			windowManager.lock.AcquireExclusive();
 			windowManager.Redraw(OS_MAKE_POINT(0, 0), graphics.frameBuffer.resX, graphics.frameBuffer.resY, nullptr);
-			windowManager.mutex.Release();
+			windowManager.lock.ReleaseExclusive();
 			graphics.UpdateScreen();
 			SYSCALL_RETURN(OS_SUCCESS, false);
 		} break;
@@ -1035,6 +1070,205 @@ uintptr_t DoSyscall(OSSyscallType index,
 			SYSCALL_RETURN(thread->id, false);
 		} break;
 
+		case OS_SYSCALL_SET_THREAD_PRIORITY: {
+			KernelObjectType type = KERNEL_OBJECT_THREAD;
+			Thread *thread = (Thread *) currentProcess->handleTable.ResolveHandle(argument0, type);
+			if (!type) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_HANDLE, true);
+			Defer(currentProcess->handleTable.CompleteHandle(thread, argument0));
+
+			if (argument1 >= OS_THREAD_PRIORITY_COUNT) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_THREAD_PRIORITY, true);
+
+			// The scheduler always runs high priority threads first, so they could starve every other thread.
+			if (argument1 == OS_THREAD_PRIORITY_HIGH && !fromKernel && currentProcess != desktopProcess) {
+				SYSCALL_RETURN(OS_ERROR_PERMISSION_NOT_GRANTED, false);
+			}
+
+			scheduler.SetThreadPriority(thread, (OSThreadPriority) argument1);
+			SYSCALL_RETURN(OS_SUCCESS, false);
+		} break;
+
+		case OS_SYSCALL_SET_THREAD_AFFINITY: {
+			KernelObjectType type = KERNEL_OBJECT_THREAD;
+			Thread *thread = (Thread *) currentProcess->handleTable.ResolveHandle(argument0, type);
+			if (!type) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_HANDLE, true);
+			Defer(currentProcess->handleTable.CompleteHandle(thread, argument0));
+
+			// Reserving processors takes them away from every other process.
+			if (argument1 && argument2 && !fromKernel && currentProcess != desktopProcess) SYSCALL_RETURN(OS_ERROR_PERMISSION_NOT_GRANTED, false);
+
+			OSError error = scheduler.SetThreadAffinity(thread, argument1, argument2);
+			if (error == OS_ERROR_UNKNOWN_OPERATION_FAILURE) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_THREAD_AFFINITY, true);
+			SYSCALL_RETURN(error, false);
+		} break;
+
+		case OS_SYSCALL_GET_CPU_STATISTICS: {
+			KernelObjectType type = (KernelObjectType) (KERNEL_OBJECT_THREAD | KERNEL_OBJECT_PROCESS | KERNEL_OBJECT_NONE);
+			void *object = currentProcess->handleTable.ResolveHandle(argument0, type);
+			if (!type) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_HANDLE, true);
+			Defer(if (object) currentProcess->handleTable.CompleteHandle(object, argument0));
+
+			SYSCALL_BUFFER(argument1, sizeof(OSCPUStatistics), 1);
+
+			CPUTimes *times = nullptr;
+			if (type == KERNEL_OBJECT_THREAD) times = &((Thread *) object)->cpuTimes;
+			if (type == KERNEL_OBJECT_PROCESS) times = &((Process *) object)->cpuTimes;
+
+			// Don't write to the user's buffer with the scheduler's lock acquired.
+			OSCPUStatistics statistics = {};
+			scheduler.GetCPUStatistics(times, &statistics);
+			CopyMemory((void *) argument1, &statistics, sizeof(OSCPUStatistics));
+
+			SYSCALL_RETURN(OS_SUCCESS, false);
+		} break;
+
+		case OS_SYSCALL_SET_LOCK_PROFILER_ENABLED: {
+			if (argument0) LockProfilerStart();
+			else LockProfilerStop();
+			SYSCALL_RETURN(OS_SUCCESS, false);
+		} break;
+
+		case OS_SYSCALL_GET_SPINLOCK_STATISTICS: {
+			size_t available = spinlockStatisticsCount;
+			if (available > MAX_SPINLOCK_STATISTICS) available = MAX_SPINLOCK_STATISTICS;
+			if (argument1 > available) argument1 = available;
+
+			SYSCALL_BUFFER_ALLOW_NULL(argument0, argument1 * sizeof(OSSpinlockStatistics), 0);
+			if (argument1 && !region0.vmm) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_BUFFER, true);
+
+			OSSpinlockStatistics *buffer = (OSSpinlockStatistics *) argument0;
+
+			for (uintptr_t i = 0; i < argument1; i++) {
+				SpinlockStatistics *source = spinlockStatistics + i;
+				OSSpinlockStatistics statistics = {};
+
+				size_t nameLength = CStringLength((char *) source->name);
+				if (nameLength >= OS_SPINLOCK_STATISTICS_NAME_LENGTH) nameLength = OS_SPINLOCK_STATISTICS_NAME_LENGTH - 1;
+				CopyMemory(statistics.name, (void *) source->name, nameLength);
+
+				statistics.acquisitions = source->acquisitions;
+				statistics.contendedAcquisitions = source->contendedAcquisitions;
+				statistics.spinTicks = source->spinTicks;
+
+				CopyMemory(buffer + i, &statistics, sizeof(OSSpinlockStatistics));
+			}
+
+			SYSCALL_RETURN(available, false);
+		} break;
+
+		case OS_SYSCALL_CREATE_COMPLETION_PORT: {
+			CompletionPort *port = (CompletionPort *) OSHeapAllocate(sizeof(CompletionPort), true);
+			if (!port) SYSCALL_RETURN(OS_ERROR_UNKNOWN_OPERATION_FAILURE, false);
+			port->handles = 1;
+			Handle handle = {};
+			handle.type = KERNEL_OBJECT_COMPLETION_PORT;
+			handle.object = port;
+			SYSCALL_RETURN(currentProcess->handleTable.OpenHandle(handle), false);
+		} break;
+
+		case OS_SYSCALL_ASSOCIATE_COMPLETION_PORT: {
+			KernelObjectType type = KERNEL_OBJECT_COMPLETION_PORT;
+			CompletionPort *port = (CompletionPort *) currentProcess->handleTable.ResolveHandle(argument0, type);
+			if (!type) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_HANDLE, true);
+			Defer(currentProcess->handleTable.CompleteHandle(port, argument0));
+
+			Event *event;
+			void *object = nullptr;
+
+			if (argument1 == OS_CURRENT_PROCESS) {
+				event = &currentProcess->messageQueue.notEmpty;
+			} else {
+				type = (KernelObjectType) (KERNEL_OBJECT_EVENT | KERNEL_OBJECT_IO_REQUEST);
+				object = currentProcess->handleTable.ResolveHandle(argument1, type);
+				if (!type) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_HANDLE, true);
+				event = type == KERNEL_OBJECT_EVENT ? (Event *) object : &((IORequest *) object)->complete;
+			}
+
+			Defer(if (object) currentProcess->handleTable.CompleteHandle(object, argument1));
+
+			CompletionPortAssociation *association = (CompletionPortAssociation *) OSHeapAllocate(sizeof(CompletionPortAssociation), true);
+			if (!association) SYSCALL_RETURN(OS_ERROR_UNKNOWN_OPERATION_FAILURE, false);
+
+			scheduler.lock.Acquire();
+			bool associated = port->Associate(event, argument2, association);
+			scheduler.lock.Release();
+
+			if (!associated) {
+				OSHeapFree(association, sizeof(CompletionPortAssociation));
+				SYSCALL_RETURN(OS_ERROR_ALREADY_ASSOCIATED, false);
+			}
+
+			SYSCALL_RETURN(OS_SUCCESS, false);
+		} break;
+
+		case OS_SYSCALL_DEQUEUE_COMPLETIONS: {
+			KernelObjectType type = KERNEL_OBJECT_COMPLETION_PORT;
+			CompletionPort *port = (CompletionPort *) currentProcess->handleTable.ResolveHandle(argument0, type);
+			if (!type) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_HANDLE, true);
+			Defer(currentProcess->handleTable.CompleteHandle(port, argument0));
+
+			if (!argument2 || argument2 > (uintptr_t) -1 / sizeof(uintptr_t)) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_BUFFER, true);
+			SYSCALL_BUFFER(argument1, argument2 * sizeof(uintptr_t), 1);
+
+			if (region1.vmm) {
+				// Keys are removed from the port before they are copied, so check the copy can't fault.
+				currentVMM->lock.AcquireShared();
+				bool readOnly = region1.vmm->regions[region1.index].flags & VMM_REGION_FLAG_READ_ONLY;
+				currentVMM->lock.ReleaseShared();
+				if (readOnly) SYSCALL_RETURN(OS_FATAL_ERROR_INVALID_BUFFER, true);
+			}
+
+			uintptr_t *keys = (uintptr_t *) argument1;
+			size_t dequeued = 0;
+
+			Timer *timer = nullptr;
+			Timer _timer = {};
+
+			if (argument3 != (uintptr_t) OS_WAIT_NO_TIMEOUT && argument3) {
+				_timer.Set(argument3, false);
+				timer = &_timer;
+			}
+
+			while (true) {
+				// Dequeue in batches, so that the user's buffer isn't accessed with the scheduler's lock held.
+				uintptr_t batch[OS_MAX_WAIT_COUNT];
+				size_t batchCount;
+
+				do {
+					size_t count = argument2 - dequeued;
+					if (count > OS_MAX_WAIT_COUNT) count = OS_MAX_WAIT_COUNT;
+
+					scheduler.lock.Acquire();
+					batchCount = port->Dequeue(batch, count);
+					scheduler.lock.Release();
+
+					CopyMemory(keys + dequeued, batch, batchCount * sizeof(uintptr_t));
+					dequeued += batchCount;
+				} while (batchCount == OS_MAX_WAIT_COUNT && dequeued < argument2);
+
+				if (dequeued || !argument3) {
+					break;
+				}
+
+				// Another thread may take the completions before this one runs, so wait again if the queue is empty.
+				Event *events[2] = { &port->available, timer ? &timer->event : nullptr };
+
+				if (!fromKernel) currentThread->terminatableState = THREAD_USER_BLOCK_REQUEST;
+				uintptr_t index = scheduler.WaitEvents(events, timer ? 2 : 1);
+				currentThread->terminatableState = THREAD_IN_SYSCALL;
+
+				if (index == 1 || index == (uintptr_t) -1) {
+					// The timeout was reached, or the thread is being terminated.
+					break;
+				}
+			}
+
+			if (timer) {
+				timer->Remove();
+			}
+
+			SYSCALL_RETURN(dequeued ? dequeued : OS_ERROR_TIMEOUT_REACHED, false);
+		} break;
+
 		case OS_SYSCALL_ENUMERATE_DIRECTORY_CHILDREN: {
 			KernelObjectType type = KERNEL_OBJECT_NODE;
 			Node *node = (Node *) currentProcess->handleTable.ResolveHandle(argument0, type);
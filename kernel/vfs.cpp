@@ -33,6 +33,7 @@ struct Node {
 	void Write(struct IOPacket *packet, bool canResize);
 	bool Resize(uint64_t newSize);
 	void Complete(struct IOPacket *packet);
+	void UpdateReadahead(uint64_t offset, uint64_t count);
 
 	// Directories:
 	bool EnumerateChildren(OSDirectoryChild *buffer, size_t bufferCount);
@@ -64,9 +65,48 @@ struct Node {
 	// We keep a couple nodes around that have no handles, so they can be quickly accessed later.
 	LinkedItem<Node> noHandleCacheItem; 
 
-	SharedMemoryRegion region;
+	SharedMemoryRegion region; // Also the file's cache.
+
+	// Sequential access detection, protected by the region's mutex.
+	uint64_t readaheadPrevious; // Where the previous access ended.
+	uint64_t readaheadEnd; // Where the data queued for readahead ends.
+	size_t readaheadWindow;
+};
+
+#define READAHEAD_MINIMUM_WINDOW (MM_FILE_CHUNK_BYTES)
+#define READAHEAD_MAXIMUM_WINDOW (MM_FILE_CHUNK_BYTES * 16)
+#define READAHEAD_QUEUE_SIZE (64)
+
+struct ReadaheadRange {
+	Node *node;
+	uint64_t offset, end;
+};
+
+struct Readahead {
+	// Reads the queued parts of files into their caches, a chunk at a time.
+	void Initialise();
+	void Queue(Node *node, uint64_t offset, uint64_t end);
+	void ReadRanges();
+	bool ReadChunk(Node *node, uint64_t offset);
+	void Complete(struct IORequest *request);
+
+	ReadaheadRange queue[READAHEAD_QUEUE_SIZE];
+	uintptr_t queueStart;
+	size_t queueCount;
+	Mutex mutex;
+	Event available;
+
+	// The chunk being read. Its pages are marked SHARED_ADDRESS_READAHEAD until the request completes.
+	struct IORequest *volatile request;
+	uint64_t offset;
+	size_t count;
+	uint8_t *window;
+	uintptr_t pages[MM_FILE_CHUNK_PAGES];
+	Event done; // Set when the chunk has been stored in the cache.
 };
 
+Readahead readahead;
+
 struct Filesystem {
 	FilesystemType type;
 	Node *root;
@@ -110,7 +150,7 @@ struct VFS {
 
 #define NODE_HASH_TABLE_BITS (12)
 	Node *nodeHashTable[1 << NODE_HASH_TABLE_BITS];
-	Mutex nodeHashTableMutex; // Required to changed node handle count.
+	RWLock nodeHashTableLock; // Required to changed node handle count. Lookups acquire it shared.
 };
 
 VFS vfs;
@@ -139,7 +179,9 @@ bool Node::Resize(uint64_t newSize) {
 		data.file.fileSize = newSize;
 
 		sharedMemoryManager.mutex.Acquire();
+		region.mutex.Acquire();
 		sharedMemoryManager.ResizeSharedMemory(&region, newSize);
+		region.mutex.Release();
 		sharedMemoryManager.mutex.Release();
 	}
 
@@ -315,12 +357,55 @@ void Node::CopyInformation(OSNodeInformation *information) {
 }
 
 void Node::Complete(IOPacket *packet) {
+	if (packet->request == readahead.request) {
+		// Store the chunk in the cache before anyone else can access the file.
+		readahead.Complete(packet->request);
+	}
+
 	packet->request->node->semaphore.Return();
 }
 
-void Node::Write(IOPacket *packet, bool canResize) {
-	// TODO Access cache.
+void Node::UpdateReadahead(uint64_t offset, uint64_t count) {
+	region.mutex.AssertLocked();
+
+	uint64_t accessEnd = offset + count;
+
+	if (!region.mappingsCount) {
+		// Pages read ahead stay in the file's cache until the node is destroyed,
+		// so only read ahead files that are mapped, whose pages are kept in the cache anyway.
+		readaheadWindow = 0;
+		readaheadEnd = 0;
+	} else if (offset == readaheadPrevious) {
+		// Sequential access.
+		// When the reader gets within half a window of the end of the readahead, 
+		// double the window and queue the next chunks, so they're read while this part is being consumed.
+		if (accessEnd + readaheadWindow / 2 >= readaheadEnd) {
+			readaheadWindow = readaheadWindow ? readaheadWindow * 2 : READAHEAD_MINIMUM_WINDOW;
+			if (readaheadWindow > READAHEAD_MAXIMUM_WINDOW) readaheadWindow = READAHEAD_MAXIMUM_WINDOW;
+
+			// Small reads will want the rest of this chunk, but larger reads can skip to the next.
+			uint64_t start = accessEnd & ~(uint64_t) (MM_FILE_CHUNK_BYTES - 1);
+			if (offset <= start) start = (accessEnd + MM_FILE_CHUNK_BYTES - 1) & ~(uint64_t) (MM_FILE_CHUNK_BYTES - 1);
+			uint64_t end = start + readaheadWindow;
+			if (start < readaheadEnd) start = readaheadEnd;
+			if (end > data.file.fileSize) end = data.file.fileSize;
+
+			if (end > start) {
+				readahead.Queue(this, start, end);
+				readaheadEnd = end;
+			}
+		}
+	} else if (accessEnd != readaheadPrevious) {
+		// Random access.
+		// Collapse the window; this also stops the rest of the queued readahead.
+		readaheadWindow = 0;
+		readaheadEnd = 0;
+	}
+
+	readaheadPrevious = accessEnd;
+}
 
+void Node::Write(IOPacket *packet, bool canResize) {
 	IORequest *request = packet->request;
 
 	if (request->offset + request->count > data.file.fileSize && canResize) {
@@ -353,6 +438,9 @@ void Node::Write(IOPacket *packet, bool canResize) {
 
 	switch (filesystem->type) {
 		case FILESYSTEM_ESFS: {
+			// Keep the cache, which is shared with the file's mappings, up to date.
+			sharedMemoryManager.WriteCachedPages(&region, request->offset, request->buffer, request->count);
+
 			IOPacket *fsPacket = packet->request->AddPacket(packet);
 			fsPacket->type = IO_PACKET_ESFS;
 			fsPacket->object = request->node;
@@ -372,8 +460,6 @@ void Node::Write(IOPacket *packet, bool canResize) {
 }
 
 void Node::Read(IOPacket *packet) {
-	// TODO Access cache.
-
 	semaphore.Take();
 
 	IORequest *request = packet->request;
@@ -397,6 +483,17 @@ void Node::Read(IOPacket *packet) {
 		return;
 	}
 
+	if (request != readahead.request) {
+		region.mutex.Acquire();
+		UpdateReadahead(request->offset, request->count);
+		region.mutex.Release();
+
+		if (sharedMemoryManager.ReadCachedPages(&region, request->offset, request->buffer, request->count)) {
+			request->progress += request->count;
+			return;
+		}
+	}
+
 	switch (filesystem->type) {
 		case FILESYSTEM_ESFS: {
 			IOPacket *fsPacket = packet->request->AddPacket(packet);
@@ -427,6 +524,195 @@ void VFS::Initialise() {
 	if (!bootedFromEsFS) {
 		KernelPanic("VFS::Initialise - The operating system was not booted from an EssenceFS volume.\n");
 	}
+
+	readahead.Initialise();
+}
+
+void _ReadaheadThread(Readahead *readahead) {
+	while (true) {
+		readahead->available.Wait(OS_WAIT_NO_TIMEOUT);
+		readahead->ReadRanges();
+	}
+}
+
+void Readahead::Initialise() {
+	available.autoReset = true;
+	done.Set();
+	scheduler.SpawnThread((uintptr_t) _ReadaheadThread, (uintptr_t) this, kernelProcess, false);
+}
+
+void Readahead::Queue(Node *node, uint64_t offset, uint64_t end) {
+	mutex.Acquire();
+	Defer(mutex.Release());
+
+	if (queueCount) {
+		ReadaheadRange *last = queue + (queueStart + queueCount - 1) % READAHEAD_QUEUE_SIZE;
+
+		if (last->node == node && last->end == offset) {
+			last->end = end;
+			return;
+		}
+	}
+
+	if (queueCount == READAHEAD_QUEUE_SIZE) {
+		// Readahead is only a hint.
+		return;
+	}
+
+	// Keep the node open until its range has been read.
+	vfs.NodeMapped(node);
+
+	ReadaheadRange *range = queue + (queueStart + queueCount) % READAHEAD_QUEUE_SIZE;
+	range->node = node;
+	range->offset = offset;
+	range->end = end;
+	queueCount++;
+
+	available.Set(false, true);
+}
+
+void Readahead::ReadRanges() {
+	while (true) {
+		mutex.Acquire();
+
+		if (!queueCount) {
+			mutex.Release();
+			break;
+		}
+
+		ReadaheadRange range = queue[queueStart];
+		queueStart = (queueStart + 1) % READAHEAD_QUEUE_SIZE;
+		queueCount--;
+
+		mutex.Release();
+
+		for (uint64_t offset = range.offset; offset < range.end; offset += MM_FILE_CHUNK_BYTES) {
+			if (!ReadChunk(range.node, offset)) {
+				break;
+			}
+		}
+
+		vfs.NodeUnmapped(range.node);
+	}
+}
+
+static bool ReadaheadChunkUncached(Node *node, uint64_t offset, size_t count) {
+	SharedMemoryRegion *region = &node->region;
+	region->mutex.AssertLocked();
+
+	for (uintptr_t i = 0; i < count; i += PAGE_SIZE) {
+		uintptr_t *entry = sharedMemoryManager.GetPageEntry(region, offset + i, false);
+		if (entry && *entry) return false;
+	}
+
+	return true;
+}
+
+bool Readahead::ReadChunk(Node *node, uint64_t offset) {
+	// Returns false if the rest of the range isn't wanted.
+
+	SharedMemoryRegion *region = &node->region;
+	size_t count = 0;
+	bool wanted = true, uncached = false;
+
+	region->mutex.Acquire();
+
+	if (offset >= node->readaheadEnd || offset >= region->sizeBytes || !region->mappingsCount) {
+		wanted = false;
+	} else {
+		count = region->sizeBytes - offset;
+		if (count > MM_FILE_CHUNK_BYTES) count = MM_FILE_CHUNK_BYTES;
+		count = (count + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		uncached = ReadaheadChunkUncached(node, offset, count);
+	}
+
+	region->mutex.Release();
+
+	if (!wanted) return false;
+	if (!uncached) return true;
+
+	for (uintptr_t i = 0; i < count / PAGE_SIZE; i++) {
+		pages[i] = pmm.AllocatePage(false);
+	}
+
+	window = (uint8_t *) MapPhysicalPages(pages, count / PAGE_SIZE);
+	bool success = window != nullptr;
+
+	if (window) {
+		IORequest *request = nullptr;
+
+		region->mutex.Acquire();
+
+		// The chunk might have been accessed while the pages were being allocated.
+		if (offset + count <= region->sizeBytes && ReadaheadChunkUncached(node, offset, count)) {
+			for (uintptr_t i = 0; i < count; i += PAGE_SIZE) {
+				*sharedMemoryManager.GetPageEntry(region, offset + i, true) = SHARED_ADDRESS_READING | SHARED_ADDRESS_READAHEAD;
+			}
+
+			request = (IORequest *) ioRequestPool.Add();
+			request->handles = 1;
+			request->type = IO_REQUEST_READ;
+			request->node = node;
+			request->offset = offset;
+			request->count = count;
+			request->buffer = window;
+
+			this->request = request;
+			this->offset = offset;
+			this->count = count;
+			done.Reset();
+		}
+
+		region->mutex.Release();
+
+		if (request) {
+			request->Start();
+			request->complete.Wait(OS_WAIT_NO_TIMEOUT);
+			success = request->error == OS_SUCCESS;
+			CloseHandleToObject(request, KERNEL_OBJECT_IO_REQUEST);
+		}
+
+		kernelVMM.Free(window);
+	}
+
+	for (uintptr_t i = 0; i < count / PAGE_SIZE; i++) {
+		if (pages[i]) pmm.FreePage(pages[i]);
+	}
+
+	return success;
+}
+
+void Readahead::Complete(IORequest *request) {
+	request->mutex.AssertLocked();
+
+	SharedMemoryRegion *region = &request->node->region;
+	bool success = request->error == OS_SUCCESS;
+
+	if (success) {
+		// Nothing was read past the end of the file.
+		ZeroMemory(window + request->count, count - request->count);
+	}
+
+	region->mutex.Acquire();
+
+	for (uintptr_t i = 0; i < count / PAGE_SIZE; i++) {
+		// The file might have been written, resized or unmapped since the chunk was queued.
+		uintptr_t pageOffset = offset + i * PAGE_SIZE;
+		uintptr_t *entry = pageOffset < region->sizeBytes ? sharedMemoryManager.GetPageEntry(region, pageOffset, false) : nullptr;
+		if (!entry || *entry != (SHARED_ADDRESS_READING | SHARED_ADDRESS_READAHEAD)) continue;
+
+		if (success && region->mappingsCount) {
+			*entry = SHARED_ADDRESS_PRESENT | pages[i];
+			pages[i] = 0;
+		} else {
+			*entry = 0;
+		}
+	}
+
+	this->request = nullptr;
+	region->mutex.Release();
+
+	done.Set();
 }
 
 void VFS::NodeUnmapped(Node *node) {
@@ -434,7 +720,7 @@ void VFS::NodeUnmapped(Node *node) {
 }
 
 void VFS::CloseNode(Node *node, uint64_t flags) {
-	nodeHashTableMutex.Acquire();
+	nodeHashTableLock.AcquireExclusive();
 
 	node->handles--;
 
@@ -478,7 +764,7 @@ void VFS::CloseNode(Node *node, uint64_t flags) {
 		}
 	}
 
-	nodeHashTableMutex.Release();
+	nodeHashTableLock.ReleaseExclusive();
 
 	if (node3) {
 		node3->Sync();
@@ -662,8 +948,8 @@ void VFS::NodeMapped(Node *node) {
 		NodeMapped(node->parent);
 	}
 
-	nodeHashTableMutex.Acquire();
-	Defer(nodeHashTableMutex.Release());
+	nodeHashTableLock.AcquireExclusive();
+	Defer(nodeHashTableLock.ReleaseExclusive());
 
 	if (node->handles == 0) {
 		KernelPanic("VFS::NodeMapped - Mapped a node with 0 handles.\n");
@@ -680,8 +966,8 @@ Node *VFS::RegisterNodeHandle(void *_existingNode, uint64_t &flags, UniqueIdenti
 	Node *existingNode = (Node *) _existingNode;
 	existingNode->data.type = type;
 
-	nodeHashTableMutex.Acquire();
-	Defer(nodeHashTableMutex.Release());
+	nodeHashTableLock.AcquireExclusive();
+	Defer(nodeHashTableLock.ReleaseExclusive());
 
 	if ((flags & OS_OPEN_NODE_READ_BLOCK)    && (existingNode->countRead))   { flags ^= OS_OPEN_NODE_READ_BLOCK;    return nullptr; }
 	if ((flags & OS_OPEN_NODE_READ_ACCESS)   && (existingNode->blockRead))   { flags ^= OS_OPEN_NODE_READ_ACCESS;   return nullptr; }
@@ -746,8 +1032,8 @@ Node *VFS::RegisterNodeHandle(void *_existingNode, uint64_t &flags, UniqueIdenti
 }
 
 Node *VFS::FindOpenNode(UniqueIdentifier identifier, Filesystem *filesystem) {
-	nodeHashTableMutex.Acquire();
-	Defer(nodeHashTableMutex.Release());
+	nodeHashTableLock.AcquireShared();
+	Defer(nodeHashTableLock.ReleaseShared());
 
 	uint16_t slot = ((uint16_t) identifier.d[0] + ((uint16_t) identifier.d[1] << 8)) & 0xFFF;
 
@@ -50,7 +50,7 @@ struct WindowManager {
 
 	Window *pressedWindow, *activeWindow, *hoverWindow;
 
-	Mutex mutex;
+	RWLock lock; // Reading the cursor and window positions only needs this shared.
 
 	int cursorX, cursorY;
 	int cursorImageX, cursorImageY;
@@ -98,7 +98,7 @@ void Clipboard::Copy(void *newBuffer, OSClipboardHeader *newHeader) {
 
 	// Tell the active window about the new contents of the clipboard.
 	{
-		windowManager.mutex.Acquire();
+		windowManager.lock.AcquireShared();
 
 		Window *window = windowManager.activeWindow;
 
@@ -111,7 +111,7 @@ void Clipboard::Copy(void *newBuffer, OSClipboardHeader *newHeader) {
 			window = window->menuParent;
 		}
 
-		windowManager.mutex.Release();
+		windowManager.lock.ReleaseShared();
 	}
 }
 
@@ -143,7 +143,7 @@ void WindowManager::UpdateCursor(int xMovement, int yMovement, unsigned buttons)
 }
 
 void WindowManager::RefreshCursor(Window *window) {
-	mutex.AssertLocked();
+	lock.AssertExclusive();
 
 	OSCursorStyle style = OS_CURSOR_NORMAL;
 
@@ -246,8 +246,8 @@ void WindowManager::RefreshCursor(Window *window) {
 }
 
 void WindowManager::PressKey(unsigned scancode) {
-	mutex.Acquire();
-	Defer(mutex.Release());
+	lock.AcquireExclusive();
+	Defer(lock.ReleaseExclusive());
 
 	if (scancode == OS_SCANCODE_NUM_DIVIDE) {
 		KernelPanic("WindowManager::PressKey - Panic key pressed.\n");
@@ -290,7 +290,7 @@ int MeasureDistance(int x1, int y1, int x2, int y2) {
 }
 
 void WindowManager::SetActiveWindow(Window *window) {
-	mutex.AssertLocked();
+	lock.AssertExclusive();
 
 	if (activeWindow == window) {
 		return;
@@ -362,7 +362,7 @@ void WindowManager::SetActiveWindow(Window *window) {
 }
 
 void WindowManager::ClickCursor(unsigned buttons) {
-	mutex.Acquire();
+	lock.AcquireExclusive();
 
 	unsigned delta = lastButtons ^ buttons;
 	lastButtons = buttons;
@@ -450,7 +450,7 @@ void WindowManager::ClickCursor(unsigned buttons) {
 		}
 	}
 
-	mutex.Release();
+	lock.ReleaseExclusive();
 
 	if (moveCursorNone) {
 		MoveCursor(0, 0);
@@ -460,7 +460,7 @@ void WindowManager::ClickCursor(unsigned buttons) {
 }
 
 void WindowManager::MoveCursor(int xMovement, int yMovement) {
-	mutex.Acquire();
+	lock.AcquireExclusive();
 
 	int oldCursorX = cursorX;
 	int oldCursorY = cursorY;
@@ -530,7 +530,7 @@ void WindowManager::MoveCursor(int xMovement, int yMovement) {
 		RefreshCursor(window);
 	}
 
-	mutex.Release();
+	lock.ReleaseExclusive();
 	graphics.UpdateScreen();
 }
 
@@ -544,7 +544,7 @@ void WMTimerMessages(WindowManager *windowManager) {
 		timer.Remove();
 		tick++;
 
-		windowManager->mutex.Acquire();
+		windowManager->lock.AcquireShared();
 
 		for (uintptr_t i = 0; i < windowManager->windowsCount; i++) {
 			Window *window = windowManager->windows[i];
@@ -563,12 +563,12 @@ void WMTimerMessages(WindowManager *windowManager) {
 			}
 		}
 
-		windowManager->mutex.Release();
+		windowManager->lock.ReleaseShared();
 	}
 }
 
 void WindowManager::Initialise() {
-	mutex.Acquire();
+	lock.AcquireExclusive();
 
 	uiSheetSurface.Initialise(1024, 512, false);
 	wallpaperSurface.Initialise(graphics.resX, graphics.resY, false);
@@ -580,11 +580,12 @@ void WindowManager::Initialise() {
 
 	// Draw the background.
 	Redraw(OS_MAKE_POINT(0, 0), graphics.resX, graphics.resY);
-	mutex.Release();
+	lock.ReleaseExclusive();
 	graphics.UpdateScreen();
 
 	// Create the window manager timer thread.
-	scheduler.SpawnThread((uintptr_t) WMTimerMessages, (uintptr_t) this, kernelProcess, false);
+	Thread *timerThread = scheduler.SpawnThread((uintptr_t) WMTimerMessages, (uintptr_t) this, kernelProcess, false);
+	scheduler.SetThreadPriority(timerThread, OS_THREAD_PRIORITY_HIGH);
 
 	initialised = true;
 }
@@ -593,8 +594,8 @@ Window *WindowManager::CreateWindow(Process *process, OSRectangle bounds, OSObje
 	Window *window;
 
 	{
-		mutex.Acquire();
-		Defer(mutex.Release());
+		lock.AcquireExclusive();
+		Defer(lock.ReleaseExclusive());
 
 		static int cx = 20, cy = 20;
 
@@ -634,7 +635,7 @@ Window *WindowManager::CreateWindow(Process *process, OSRectangle bounds, OSObje
 }
 
 void Window::ClearImage() {
-	windowManager.mutex.AssertLocked();
+	windowManager.lock.AssertExclusive();
 
 	{
 		graphics.frameBuffer.mutex.Acquire();
@@ -659,7 +660,7 @@ void Window::ClearImage() {
 bool Window::Move(OSRectangle &rectangle) {
 	bool result = true;
 
-	windowManager.mutex.Acquire();
+	windowManager.lock.AcquireExclusive();
 	windowManager.SetActiveWindow(this);
 
 	mutex.Acquire();
@@ -701,7 +702,7 @@ bool Window::Move(OSRectangle &rectangle) {
 	rectangle.right = position.x + width;
 	rectangle.bottom = position.y + height;
 
-	windowManager.mutex.Release();
+	windowManager.lock.ReleaseExclusive();
 
 	if (result) Update(false);
 	return result;
@@ -711,8 +712,8 @@ void Window::Destroy() {
 	Window *updateActiveWindow = nullptr;
 
 	{
-		windowManager.mutex.Acquire();
-		Defer(windowManager.mutex.Release());
+		windowManager.lock.AcquireExclusive();
+		Defer(windowManager.lock.ReleaseExclusive());
 
 		// KernelLog(LOG_VERBOSE, "Window %x (api %x) is being destroyed...\n", this, apiWindow);
 
@@ -779,9 +780,9 @@ void Window::Destroy() {
 	}
 
 	if (updateActiveWindow) {
-		windowManager.mutex.Acquire();
+		windowManager.lock.AcquireExclusive();
 		windowManager.SetActiveWindow(updateActiveWindow);
-		windowManager.mutex.Release();
+		windowManager.lock.ReleaseExclusive();
 	}
 
 	{
@@ -792,7 +793,7 @@ void Window::Destroy() {
 }
 
 void WindowManager::Redraw(OSPoint position, int width, int height, Window *except) {
-	mutex.AssertLocked();
+	lock.AssertExclusive();
 
 	{
 		OSRectangle background = {position.x, position.x + width, position.y, position.y + height};
@@ -895,9 +896,9 @@ void Window::Update(bool fromUser) {
 	resizing = false;
 
 #ifdef TRANSPARENT_WINDOWS
-	windowManager.mutex.Acquire();
+	windowManager.lock.AcquireExclusive();
 	windowManager.Redraw(position, width, height);
-	windowManager.mutex.Release();
+	windowManager.lock.ReleaseExclusive();
 #else
 	graphics.frameBuffer.Copy(*surface, position, OS_MAKE_RECTANGLE(0, width, 0, height), true, z + 1);
 #endif
@@ -909,16 +910,16 @@ void Window::Update(bool fromUser) {
 }
 
 void Window::SetCursorStyle(OSCursorStyle style) {
-	windowManager.mutex.Acquire();
+	windowManager.lock.AcquireExclusive();
 	cursorStyle = style;
 	windowManager.RefreshCursor(this);
-	windowManager.mutex.Release();
+	windowManager.lock.ReleaseExclusive();
 }
 
 void Window::NeedWMTimer(int hz) {
-	windowManager.mutex.Acquire();
+	windowManager.lock.AcquireExclusive();
 	needsTimerMessagesHz = hz;
-	windowManager.mutex.Release();
+	windowManager.lock.ReleaseExclusive();
 }
 
 #endif
@@ -89,8 +89,11 @@ bool RegisterIRQHandler(uintptr_t interrupt, IRQHandler handler) {
 Spinlock ipiLock;
 
 void ProcessorSendIPI(uintptr_t interrupt, bool nmi, int processorID) {
-	ipiLock.AssertLocked();
-	ipiVector = interrupt;
+	// TLB shootdowns and yields are identified by their vector, so they can be sent without the lock.
+	if (interrupt != TLB_SHOOTDOWN_IPI && interrupt != YIELD_IPI) {
+		ipiLock.AssertLocked();
+		ipiVector = interrupt;
+	}
 
 	// We now send IPIs at a special priority that ProcessorDisableInterrupts doesn't mask.
 	// Therefore, this isn't a problem.
@@ -120,6 +123,11 @@ void NextTimer(size_t ms) {
 	acpi.lapic.NextTimer(ms);
 }
 
+uint64_t ReadTimeMs() {
+	// The time stamp counter is not calibrated until the LAPIC timer is.
+	return timeStampTicksPerMs ? ProcessorReadTimeStamp() / timeStampTicksPerMs : 0;
+}
+
 extern "C" void SetupProcessor2() {
 	// Find the processor for the current LAPIC.
 	
@@ -231,6 +239,28 @@ void ContextSanityCheck(InterruptContext *context) {
 	}
 }
 
+void FPUDeviceNotAvailable(CPULocalStorage *local) {
+	// The current thread is using the FPU for the first time since it was switched to.
+	// The previous owner's state was saved when it was switched from.
+	Thread *thread = local->currentThread;
+	ProcessorClearTaskSwitched();
+
+	if (local->fpuOwner == thread && thread->fpuLoadedProcessor == (int) local->processorID) {
+		// The thread's state is still in the registers.
+		return;
+	}
+
+	if (thread->fpuStateValid) {
+		ProcessorLoadFPU(FPU_STATE(thread));
+	} else {
+		ProcessorInitialiseFPU();
+		thread->fpuStateValid = true;
+	}
+
+	local->fpuOwner = thread;
+	thread->fpuLoadedProcessor = local->processorID;
+}
+
 extern "C" void InterruptHandler(InterruptContext *context) {
 	if (scheduler.panic && context->interruptNumber != 2) {
 		return;
@@ -243,6 +273,11 @@ extern "C" void InterruptHandler(InterruptContext *context) {
 	CPULocalStorage *local = GetLocalStorage();
 	uintptr_t interrupt = context->interruptNumber;
 
+	if (interrupt == 7 && local && local->currentThread) {
+		FPUDeviceNotAvailable(local);
+		return;
+	}
+
 	if (interrupt < 0x20) {
 		// If we received a non-maskable interrupt, idle.
 		if (interrupt == 2) ProcessorIdle();
@@ -347,14 +382,32 @@ extern "C" void InterruptHandler(InterruptContext *context) {
 		// IPI.
 		// Warning: This code executes at a special IRQL! Do not acquire spinlocks!!
 
-		if (ipiVector == TLB_SHOOTDOWN_IPI) {
-			uintptr_t page = tlbShootdownVirtualAddress;
+		if (interrupt == TLB_SHOOTDOWN_IPI) {
+			// Handle every shootdown waiting for this processor; their IPIs may have been merged.
+			for (uintptr_t i = 0; i < MAX_PROCESSORS / 64; i++) {
+				uint64_t pending = __sync_fetch_and_and(local->tlbShootdownsPending + i, 0);
 
-			for (uintptr_t i = 0; i < tlbShootdownPageCount; i++, page += PAGE_SIZE) {
-				ProcessorInvalidatePage(page);
-			}
+				while (pending) {
+					uintptr_t sender = i * 64 + __builtin_ctzll(pending);
+					pending &= pending - 1;
+
+					TLBShootdown *shootdown = &scheduler.localStorage[sender]->tlbShootdown;
 
-			__sync_fetch_and_sub(&tlbShootdownRemainingProcessors, 1);
+					if (shootdown->flushAll) {
+						ProcessorFlushTLB(shootdown->global);
+					} else {
+						for (uintptr_t j = 0; j < shootdown->rangeCount; j++) {
+							uintptr_t page = shootdown->addresses[j];
+
+							for (uintptr_t k = 0; k < shootdown->pageCounts[j]; k++, page += PAGE_SIZE) {
+								ProcessorInvalidatePage(page);
+							}
+						}
+					}
+
+					__sync_fetch_and_sub(&shootdown->remainingProcessors, 1);
+				}
+			}
 		} else if (ipiVector == KERNEL_PANIC_IPI) {
 			ProcessorHalt();
 		}
@@ -406,6 +459,11 @@ extern "C" void InterruptHandler(InterruptContext *context) {
 	}
 }
 
+extern "C" uintptr_t ActivateAddressSpace(VirtualAddressSpace *virtualAddressSpace) {
+	// Called by ProcessorSwitchAddressSpace.
+	return virtualAddressSpace->Activate();
+}
+
 extern "C" void PostContextSwitch(InterruptContext *context) {
 	CPULocalStorage *local = GetLocalStorage();
 
@@ -426,13 +484,27 @@ extern "C" void PostContextSwitch(InterruptContext *context) {
 
 	local->currentThread->lastKnownExecutionAddress = context->rip;
 
-	if (scheduler.lock.interruptsEnabled) {
+	if (local->queueLock.interruptsEnabled || (local->yieldLocked && scheduler.lock.interruptsEnabled)) {
 		KernelPanic("PostContextSwitch - Interrupts were enabled. (3)\n");
 	}
 
-	// We can only free the scheduler's spinlock when we are no longer using the stack
+	// We can only free the queue's spinlock when we are no longer using the stack
 	// from the previous thread. See DoContextSwitch in x86_64.s.
-	scheduler.lock.Release(true);
+	local->queueLock.Release(true);
+
+	if (local->yieldLocked) {
+		local->yieldLocked = false;
+
+		if (local->requeueThread) {
+			// The previous thread couldn't stay on this processor.
+			// The scheduler's lock was acquired by the previous thread, so take ownership of it first.
+			scheduler.lock.owner = local->currentThread;
+			scheduler.AddActiveThread(local->requeueThread, false);
+			local->requeueThread = nullptr;
+		}
+
+		scheduler.lock.Release(true);
+	}
 
 	if (ProcessorAreInterruptsEnabled()) {
 		// TODO This sometimes happens when running 'v' builds.
@@ -615,12 +615,9 @@ ASMInterruptHandler:
 	mov	rax,0x123456789ABCDEF
 	push	rax
 
-	mov	rbx,rsp
-	and	rsp,~0xF
-	fxsave	[rsp - 512]
-	mov	rsp,rbx
-	sub	rsp,512 + 16
-	
+	; The FPU state isn't saved here; it's switched lazily by the scheduler.
+	; See FPUDeviceNotAvailable in x86_64.cpp.
+
 	xor	rax,rax
 	mov	ax,ds
 	push	rax
@@ -643,11 +640,6 @@ ReturnFromInterruptHandler:
 	mov	ds,ax
 	mov	es,ax
 
-	add	rsp,512 + 16
-	mov	rbx,rsp
-	and	rbx,~0xF
-	fxrstor	[rbx - 512]
-
 	pop	rax
 	mov	rbx,0x123456789ABCDEF
 	cmp	rax,rbx
@@ -678,16 +670,49 @@ ReturnFromInterruptHandler:
 
 [global ProcessorSetAddressSpace]
 ProcessorSetAddressSpace:
+	; Bit 63 is the PCID no-flush bit, and is not stored in CR3.
 	mov	rax,cr3
-	cmp	rax,rdi
+	mov	rdx,rdi
+	btr	rdx,63
+	cmp	rax,rdx
 	je	.cont
 	mov	cr3,rdi
 	.cont:
 	ret
 
+[extern ActivateAddressSpace]
+[global ProcessorSwitchAddressSpace]
+ProcessorSwitchAddressSpace:
+	; IPIs aren't masked by CR8, so clear the interrupt flag as DoContextSwitch does;
+	; otherwise a TLB shootdown could mark the PCID stale between Activate and the CR3 load.
+	pushf
+	cli
+	call	ActivateAddressSpace
+	mov	rdi,rax
+	call	ProcessorSetAddressSpace
+	popf
+	ret
+
+[global ProcessorFlushTLB]
+ProcessorFlushTLB:
+	test	dil,dil
+	jne	.flush_global
+	mov	rax,cr3
+	mov	cr3,rax
+	ret
+	.flush_global:
+	; Toggling global pages flushes every TLB entry, in every PCID.
+	mov	rax,cr4
+	xor	rax,1 << 7
+	mov	cr4,rax
+	xor	rax,1 << 7
+	mov	cr4,rax
+	ret
+
 [global ProcessorGetAddressSpace]
 ProcessorGetAddressSpace:
 	mov	rax,cr3
+	and	rax,~0xFFF ; Remove the PCID.
 	ret
 
 [global ProcessorGetRSP]
@@ -702,7 +727,9 @@ DoContextSwitch:
 	mov	[fs:16],rcx
 	mov	[fs:8],rdx
 	mov	rax,cr3
-	cmp	rax,rsi
+	mov	r8,rsi
+	btr	r8,63
+	cmp	rax,r8
 	je	.cont
 	mov	cr3,rsi
 	.cont:
@@ -720,6 +747,44 @@ ProcessorBreakpointHelper:
 [global ProcessorReadCR3]
 ProcessorReadCR3:
 	mov	rax,cr3
+	and	rax,~0xFFF ; Remove the PCID.
+	ret
+
+[global ProcessorSetTaskSwitched]
+ProcessorSetTaskSwitched:
+	mov	rax,cr0
+	or	rax,8
+	mov	cr0,rax
+	ret
+
+[global ProcessorClearTaskSwitched]
+ProcessorClearTaskSwitched:
+	clts
+	ret
+
+[global ProcessorIsTaskSwitched]
+ProcessorIsTaskSwitched:
+	mov	rax,cr0
+	shr	rax,3
+	and	rax,1
+	ret
+
+[global ProcessorSaveFPU]
+ProcessorSaveFPU:
+	fxsave	[rdi]
+	ret
+
+[global ProcessorLoadFPU]
+ProcessorLoadFPU:
+	fxrstor	[rdi]
+	ret
+
+[global ProcessorInitialiseFPU]
+ProcessorInitialiseFPU:
+	fninit
+	push	0x1F80
+	ldmxcsr	[rsp]
+	add	rsp,8
 	ret
 
 [global SSSE3Framebuffer32To24Copy]
@@ -1,150 +1,239 @@
+// Reads the lock profile written to the log by the kernel's lock profiler (see OSSetLockProfilerEnabled),
+// and prints the call sites with the most contention.
+// Usage: analyse_mutex_log [log = out.txt] [symbols = bin/OS/Kernel.esx_symbols] [count = 20]
+
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
-
-struct Line {
-	char thread[21];
-	char mutex[21];
-	int op;
+#include <elf.h>
+#include <cxxabi.h>
+
+struct Site {
+	uintptr_t address;
+	bool spinlock;
+	uint64_t acquisitions, contendedAcquisitions;
+	uint64_t waitTicks, maxWaitTicks, holdTicks;
 };
 
-struct Mutex {
-	char n[21];
-	uint8_t connections[1024 / 8];
+struct Symbol {
+	uintptr_t address;
+	size_t size;
+	const char *name;
 };
 
-struct Thread {
-	char n[21];
-};
+Site sites[65536];
+size_t siteCount;
 
-Line lines[1048576];
-size_t lineCount;
+Symbol *symbols;
+size_t symbolCount;
 
-Mutex mutexes[1024];
-size_t mutexCount;
+uint64_t ticksPerMs = 1;
+uint64_t droppedRecords;
 
-Thread threads[1024];
-size_t threadCount;
+char *LoadFile(const char *path, size_t *fileSize) {
+	FILE *file = fopen(path, "rb");
 
-int main(int argc, char **argv) {
-	FILE *log = fopen("out.txt", "rb");
-	fseek(log, 0, SEEK_END);
-	size_t fileSize = ftell(log);
-	fseek(log, 0, SEEK_SET);
-	char *buffer = (char *) malloc(fileSize);
-	char *end = buffer + fileSize;
-	fread(buffer, 1, fileSize, log);
-
-	while (*buffer) {
-		char *start = buffer;
-
-		while (*buffer != '\n' && buffer < end) {
-			buffer++;
-		}
+	if (!file) {
+		fprintf(stderr, "Error: Could not open %s.\n", path);
+		exit(1);
+	}
 
-		*buffer = 0;
-		buffer += 2;
+	fseek(file, 0, SEEK_END);
+	*fileSize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *buffer = (char *) malloc(*fileSize + 1);
+	fread(buffer, 1, *fileSize, file);
+	buffer[*fileSize] = 0;
+	fclose(file);
 
-		if (*start == '0') {
-			memcpy(lines[lineCount].thread, start, 21);
-			memcpy(lines[lineCount].mutex, start + 22, 21);
-			lines[lineCount].op = start[44] - '0';
-			lineCount++;
-		}
+	return buffer;
+}
+
+int CompareSymbols(const void *a, const void *b) {
+	uintptr_t x = ((Symbol *) a)->address, y = ((Symbol *) b)->address;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+void LoadSymbols(const char *path) {
+	size_t fileSize;
+	char *file = LoadFile(path, &fileSize);
+
+	Elf64_Ehdr *header = (Elf64_Ehdr *) file;
+
+	if (fileSize < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) || header->e_ident[EI_CLASS] != ELFCLASS64) {
+		fprintf(stderr, "Error: %s is not a 64-bit ELF file.\n", path);
+		exit(1);
 	}
 
-	// printf("found %d mutex operations\n", (int) lineCount);
+	Elf64_Shdr *sections = (Elf64_Shdr *) (file + header->e_shoff);
 
-	for (uintptr_t i = 0; i < lineCount; i++) {
-		bool repeat = false;
+	for (uintptr_t i = 0; i < header->e_shnum; i++) {
+		if (sections[i].sh_type != SHT_SYMTAB) continue;
 
-		for (uintptr_t j = 0; j < mutexCount; j++) {
-			if (0 == memcmp(lines[i].mutex, mutexes[j].n, 21)) {
-				repeat = true;
-				break;
-			}
-		}
+		Elf64_Sym *table = (Elf64_Sym *) (file + sections[i].sh_offset);
+		const char *strings = file + sections[sections[i].sh_link].sh_offset;
+		size_t count = sections[i].sh_size / sizeof(Elf64_Sym);
 
-		if (!repeat) {
-			memcpy(mutexes[mutexCount].n, lines[i].mutex, 21);
-			mutexCount++;
+		symbols = (Symbol *) realloc(symbols, (symbolCount + count) * sizeof(Symbol));
+
+		for (uintptr_t j = 0; j < count; j++) {
+			if (ELF64_ST_TYPE(table[j].st_info) != STT_FUNC || !table[j].st_value) continue;
+			Symbol *symbol = symbols + symbolCount++;
+			symbol->address = table[j].st_value;
+			symbol->size = table[j].st_size;
+			symbol->name = strings + table[j].st_name;
 		}
 	}
 
-	// printf("found %d mutexes\n", (int) mutexCount);
+	qsort(symbols, symbolCount, sizeof(Symbol), CompareSymbols);
+}
 
-	for (uintptr_t i = 0; i < lineCount; i++) {
-		bool repeat = false;
+const char *Symbolise(uintptr_t address, uintptr_t *offset) {
+	// Find the last symbol that starts at or before the address.
+	intptr_t low = 0, high = (intptr_t) symbolCount - 1, found = -1;
 
-		for (uintptr_t j = 0; j < threadCount; j++) {
-			if (0 == memcmp(lines[i].thread, threads[j].n, 21)) {
-				repeat = true;
-				break;
-			}
-		}
+	while (low <= high) {
+		intptr_t middle = (low + high) / 2;
 
-		if (!repeat) {
-			memcpy(threads[threadCount].n, lines[i].thread, 21);
-			threadCount++;
+		if (symbols[middle].address <= address) {
+			found = middle;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
 		}
 	}
 
-	// printf("found %d threads\n", (int) threadCount);
+	if (found == -1 || (symbols[found].size && address >= symbols[found].address + symbols[found].size)) {
+		return nullptr;
+	}
 
-	int maxX = 0;
+	*offset = address - symbols[found].address;
+	return symbols[found].name;
+}
 
-	for (uintptr_t i = 0; i < threadCount; i++) {
-		Thread thread = threads[i];
-		// printf("---thread %.*s\n", 21, thread.n);
-		int x = 0;
+uint64_t ReadNumber(char **position, int base) {
+	// The kernel's formatter separates digits with '_' and ','.
+	char buffer[64];
+	size_t length = 0;
 
-		int stack[16];
+	while (**position == ' ') (*position)++;
+	if (base == 16 && (*position)[0] == '0' && (*position)[1] == 'x') *position += 2;
 
-		for (uintptr_t j = 0; j < lineCount; j++) {
-			if (memcmp(lines[j].thread, thread.n, 21)) {
-				continue;
-			}
+	while (**position && **position != ' ' && **position != '\n' && **position != '\r') {
+		if (**position != '_' && **position != ',' && length < sizeof(buffer) - 1) buffer[length++] = **position;
+		(*position)++;
+	}
 
-#if 0
-			for (int i = 0; i <= x; i++) {
-				putchar(' ');
-			}
-#endif
+	buffer[length] = 0;
+	return strtoull(buffer, nullptr, base);
+}
 
-			if (lines[j].op) {
-				for (uintptr_t k = 0; k < mutexCount; k++) {
-					if (0 == memcmp(lines[j].mutex, mutexes[k].n, 21)) {
-						stack[x] = k;
-					}
-				}
-				
-				if (x) {
-					// printf("%d->%d\n", stack[x], stack[x-1]);
-					int id = stack[x - 1];
-					mutexes[stack[x]].connections[id / 8] |= 1 << (id & 7);
+void ParseLog(const char *path) {
+	size_t fileSize;
+	char *position = LoadFile(path, &fileSize);
+	const char *prefix = "LockProfile: ";
+	size_t prefixLength = strlen(prefix);
+
+	while ((position = strstr(position, prefix))) {
+		position += prefixLength;
+
+		if (0 == memcmp(position, "begin", 5)) {
+			// Only report the most recent profile.
+			position += 5;
+			ticksPerMs = ReadNumber(&position, 10);
+			if (!ticksPerMs) ticksPerMs = 1;
+			siteCount = 0;
+			droppedRecords = 0;
+		} else if (0 == memcmp(position, "dropped", 7)) {
+			position += 7;
+			droppedRecords += ReadNumber(&position, 10);
+		} else if (*position == 'S' || *position == 'M') {
+			Site record = {};
+			record.spinlock = *position == 'S';
+			position++;
+			record.address = ReadNumber(&position, 16);
+			record.acquisitions = ReadNumber(&position, 10);
+			record.contendedAcquisitions = ReadNumber(&position, 10);
+			record.waitTicks = ReadNumber(&position, 10);
+			record.maxWaitTicks = ReadNumber(&position, 10);
+			record.holdTicks = ReadNumber(&position, 10);
+
+			// Merge the records from each processor.
+			Site *site = nullptr;
+
+			for (uintptr_t i = 0; i < siteCount; i++) {
+				if (sites[i].address == record.address && sites[i].spinlock == record.spinlock) {
+					site = sites + i;
+					break;
 				}
+			}
 
-				// putchar(' ');
-				// printf("acquire %.*s\n", 21, lines[j].mutex);
-				x++;
-				if (x > maxX) maxX = x;
+			if (!site) {
+				if (siteCount == sizeof(sites) / sizeof(sites[0])) continue;
+				site = sites + siteCount++;
+				*site = record;
 			} else {
-				x--;
-				// printf("release %.*s\n", 21, lines[j].mutex);
+				site->acquisitions += record.acquisitions;
+				site->contendedAcquisitions += record.contendedAcquisitions;
+				site->waitTicks += record.waitTicks;
+				site->holdTicks += record.holdTicks;
+				if (record.maxWaitTicks > site->maxWaitTicks) site->maxWaitTicks = record.maxWaitTicks;
 			}
 		}
 	}
+}
 
-	// printf("maxX = %d\n", maxX);
+int CompareSites(const void *a, const void *b) {
+	// Most time spent waiting first.
+	uint64_t x = ((Site *) a)->waitTicks, y = ((Site *) b)->waitTicks;
+	return x > y ? -1 : x < y ? 1 : 0;
+}
 
-	for (uintptr_t i = 0; i < mutexCount; i++) {
-		for (uintptr_t j = i + 1; j < mutexCount; j++) {
-			if (mutexes[i].connections[j % 8] & (1 << (j & 7))) {
-				if (mutexes[j].connections[i % 8] & (1 << (i & 7))) {
-					printf("deadlock on pair %.*s, %.*s\n", 21, mutexes[i].n, 21, mutexes[j].n);
-				}
-			}
+int main(int argc, char **argv) {
+	const char *logPath = argc > 1 ? argv[1] : "out.txt";
+	const char *symbolsPath = argc > 2 ? argv[2] : "bin/OS/Kernel.esx_symbols";
+	size_t count = argc > 3 ? atoi(argv[3]) : 20;
+
+	LoadSymbols(symbolsPath);
+	ParseLog(logPath);
+
+	if (!siteCount) {
+		fprintf(stderr, "Error: No lock profile found in %s.\n", logPath);
+		return 1;
+	}
+
+	qsort(sites, siteCount, sizeof(Site), CompareSites);
+
+	printf("%-4s %-4s %12s %10s %12s %12s %12s  %s\n",
+			"rank", "type", "acquisitions", "contended", "wait (us)", "max (us)", "hold (us)", "call site");
+
+	for (uintptr_t i = 0; i < siteCount && i < count; i++) {
+		Site *site = sites + i;
+		uintptr_t offset = 0;
+		const char *name = Symbolise(site->address, &offset);
+
+		printf("%-4d %-4s %12lu %9.1f%% %12.1f %12.1f %12.1f  ",
+				(int) i + 1, site->spinlock ? "spin" : "mutx",
+				(unsigned long) site->acquisitions,
+				site->acquisitions ? 100.0 * site->contendedAcquisitions / site->acquisitions : 0.0,
+				1000.0 * site->waitTicks / ticksPerMs,
+				1000.0 * site->maxWaitTicks / ticksPerMs,
+				1000.0 * site->holdTicks / ticksPerMs);
+
+		if (name) {
+			int status;
+			char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+			printf("%s+0x%lx\n", demangled ? demangled : name, (unsigned long) offset);
+			free(demangled);
+		} else {
+			printf("0x%lx\n", (unsigned long) site->address);
 		}
 	}
+
+	if (droppedRecords) {
+		printf("\nWarning: %lu records were dropped because a processor's profile was full.\n", (unsigned long) droppedRecords);
+	}
+
+	return 0;
 }